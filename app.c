@@ -113,6 +113,16 @@ SL_WEAK void app_init(void)
   // Initlializing the I2C transfer
   i2c_Init();
 
+  // The heart rate sensor is on I2C0, it takes fast mode
+  MAX_30101_Attach(i2c_Get_Bus(), MAX_30101_ADDRESS);
+  i2c_Set_Speed_Profile(MAX_30101_ADDRESS, &i2c_speed_fast);
+
+  // Captured for replay on a host when SENSOR_CAPTURE is on (scheduler.c)
+  captureInit(i2c_Get_Bus());
+
+  // Bus counters, durations and last transactions over VCOM and GATT
+  diagInit(i2c_Get_Bus());
+
   // Initializing the Timer (LETIMER0) Interrupt
 //  LETIMER0_IRQInit();
 
@@ -164,6 +174,9 @@ SL_WEAK void app_process_action(void)
  *****************************************************************************/
   void sl_bt_on_event(sl_bt_msg_t *evt)
   {
+//    Retry of a failed I2C transaction, deferred from the I2C interrupt
+    i2c_Queue_Signal(evt);
+
 //    Bluetooth Event Handler
     ble_handler(evt);
 
@@ -24,6 +24,8 @@ extern const sli_bt_gattdb_t gattdb;
 #define gattdb_heart_rate_measurement         38
 #define gattdb_heart_rate_led                 42
 #define gattdb_ota_control                    46
+#define gattdb_perfusion_index                49
+#define gattdb_i2c_diagnostics                51
 
 
 #endif // __GATT_DB_H
@@ -11,11 +11,307 @@
 #include <stdint.h>
 #include "timers.h"
 #include <stdio.h>
+#include <string.h>
+#include "scheduler.h"
+
+// Include logging for this file
+#define INCLUDE_LOG_DEBUG 1
+#include "src/log.h"
+
+
+/**************************************************************************//**
+ * Queue of the interrupt driven transfers
+ *****************************************************************************/
+typedef struct
+{
+  bool write;         // true for a register write, false for a read
+  uint8_t reg;
+  uint8_t *data;
+  size_t len;
+} max_30101_transfer_t;
+
+static max_30101_transfer_t async_queue[MAX_30101_ASYNC_QUEUE_LEN];
+static volatile uint8_t async_head = 0, async_count = 0;
+static volatile bool async_busy = false;
+
+static void MAX_30101_Async_Done (sensor_bus_status_t status);
+
+static sensor_dev_t max_30101_dev;          // Bus and address, set by MAX_30101_Attach()
+
+static max_30101_fifo_stats_t max_30101_fifo_stats;
+static uint32_t max_30101_sample_index = 0; // Samples produced since boot, lost ones included
+
+
+/**************************************************************************//**
+ * Shadow copy of the configuration registers
+ *
+ * Shutdown keeps the register contents, so as long as every write goes
+ * through MAX_30101_Write_Regs() the shadow matches the sensor and unchanged
+ * registers need not be written again. A register is known once it has been
+ * written, or after MAX_30101_Reset() (reset values). Nothing is known at
+ * boot or after an I2C error.
+ *****************************************************************************/
+static uint8_t max_30101_shadow[MAX_30101_SHADOW_SIZE];
+static uint64_t max_30101_shadow_known = 0; // Bit n set when register n is known
+
+#define MAX_30101_SHADOW_BIT(reg) ((uint64_t)1 << (reg))
+
+/**************************************************************************//**
+ * Sensor configuration, applied by MAX_30101_Init()
+ *
+ * Entries that are next to each other here and at consecutive addresses are
+ * written in one transaction, the register pointer of the sensor auto
+ * increments. MODE_CONFIG is written last and on its own, after SPO2_CONFIG
+ * at the next address, so the sensor only starts sampling once the LEDs, the
+ * interrupts, the FIFO and the sample rate are set up.
+ *****************************************************************************/
+typedef struct
+{
+  uint8_t reg;
+  uint8_t value;
+} max_30101_reg_val_t;
+
+static const max_30101_reg_val_t max_30101_config[] =
+{
+  { MAX_30101_REG_INT_ENABLE_1, MAX_30101_INT_A_FULL },  // For full buffer, PROX added when gated
+
+  { MAX_30101_REG_LED1_PA,      0x4F },                  // Replaced by the profile
+  { MAX_30101_REG_LED2_PA,      0x00 },                  // Replaced by the profile
+  { MAX_30101_REG_LED3_PA,      0x00 },                  // Replaced by the profile
+
+  { MAX_30101_REG_PILOT_PA,     0x00 },                  // Replaced by the profile
+  { MAX_30101_REG_MULTI_LED_1,  0x11 },                  // Working
+  { MAX_30101_REG_MULTI_LED_2,  0x00 },
+
+  { MAX_30101_REG_PROX_INT_THRESH, 0x00 },               // Replaced by the profile
+
+  { MAX_30101_REG_FIFO_WR_PTR,  0x00 },                  // Empty FIFO, no samples left over from the last measurement
+  { MAX_30101_REG_OVF_COUNTER,  0x00 },
+  { MAX_30101_REG_FIFO_RD_PTR,  0x00 },
+
+  { MAX_30101_REG_FIFO_CONFIG,  0x51 },                  // Replaced by the FIFO preset
+  { MAX_30101_REG_SPO2_CONFIG,  0x1A },                  // Replaced by the profile
+
+  { MAX_30101_REG_MODE_CONFIG,  MAX_30101_MODE_HR },     // Starts sampling
+};
+
+#define MAX_30101_CONFIG_LEN (sizeof(max_30101_config)/sizeof(max_30101_config[0]))
+
+
+/**************************************************************************//**
+ * FIFO presets. SMP_AVE trades output rate for fewer samples to drain, the
+ * A_FULL watermark sets how many samples are drained per interrupt. At least
+ * one slot is left free so the drain has a sample period before the FIFO
+ * overflows.
+ *****************************************************************************/
+typedef struct
+{
+  uint8_t smp_ave;    // log2 of the samples averaged
+  uint8_t a_full;     // Empty FIFO slots left when A_FULL fires
+} max_30101_fifo_cfg_t;
+
+static const max_30101_fifo_cfg_t max_30101_fifo_presets[num_MAX_30101_FIFO_PRESETS] =
+{
+  [MAX_30101_FIFO_LOW_LATENCY] = { 2, 15 },
+  [MAX_30101_FIFO_BALANCED]    = { 2, 1 },
+  [MAX_30101_FIFO_MIN_WAKEUPS] = { 3, 1 },
+};
+
+static max_30101_fifo_preset_t max_30101_fifo_preset = MAX_30101_FIFO_BALANCED;
+
+
+/**************************************************************************//**
+ * Acquisition profile
+ *
+ * The default gives the 400 samples/s (after averaging) the heart rate DSP
+ * was tuned with, at the LED current found to work best. 1600 samples/s
+ * needs a pulse of 215 us or less, so the samples have 17 bits.
+ *****************************************************************************/
+static const uint16_t max_30101_sample_rates[num_MAX_30101_SR] =
+{
+  50, 100, 200, 400, 800, 1000, 1600, 3200
+};
+
+// Fastest sample rate every pulse width allows with one LED (refer to data
+// sheet), the LED pulse and the ADC conversion have to fit in the sample
+// period
+static const max_30101_sample_rate_t max_30101_max_rate[num_MAX_30101_PW] =
+{
+  [MAX_30101_PW_69US]  = MAX_30101_SR_3200,
+  [MAX_30101_PW_118US] = MAX_30101_SR_1600,
+  [MAX_30101_PW_215US] = MAX_30101_SR_1600,
+  [MAX_30101_PW_411US] = MAX_30101_SR_1000,
+};
+
+static max_30101_profile_t max_30101_profile =
+{
+  .sample_rate = MAX_30101_SR_1600,
+  .pulse_width = MAX_30101_PW_215US,
+  .adc_range = MAX_30101_ADC_2048NA,
+  .led_current_ua = { 0x4F*MAX_30101_LED_CURRENT_STEP_UA, 0, 0 },
+  .pilot_current_ua = 0x0A*MAX_30101_LED_CURRENT_STEP_UA,
+  .prox_threshold = 0x10,
+};
+
+static bool max_30101_proximity = false;
+
+static bool max_30101_agc = false;
+static uint8_t max_30101_agc_pa[MAX_30101_NUM_LEDS]; // LEDx_PA of the queued AGC write
+
+// LED current step in flight: FIFO_WR_PTR is read right after the AGC write,
+// the samples pushed before that were taken at the old current
+static bool max_30101_agc_pending = false;
+static uint8_t max_30101_agc_wr_ptr;        // FIFO_WR_PTR once the write was done
+static uint8_t max_30101_agc_old_pa;        // LED1_PA before the step
+static uint8_t max_30101_fifo_wr_ptr = 0;   // FIFO_WR_PTR of the last batch
+
+
+/**************************************************************************//**
+ * This function selects the bus the sensor is on: the I2C peripheral on
+ * target, the model or a replayed trace on a host. Must be called before any
+ * other function of the driver.
+ *
+ * @param:
+ *      bus:  The bus
+ *      addr: 7 bit I2C address of the sensor
+ *
+ * @return:
+ *      no params
+ *****************************************************************************/
+void MAX_30101_Attach (sensor_bus_t *bus, uint8_t addr)
+{
+  max_30101_dev.bus = bus;
+  max_30101_dev.addr = addr;
+
+  // Nothing is known about a sensor on another bus
+  MAX_30101_Shadow_Invalidate();
+}
+
+
+/**************************************************************************//**
+ * This function does a blocking read of consecutive registers, a failure is
+ * logged and ends the measurement
+ *
+ * @param:
+ *      reg:              The register to start reading from
+ *      read_data:        Buffer for the data
+ *      nbytes_read_data: Number of bytes to read
+ *
+ * @return:
+ *      false if the transfer failed
+ *****************************************************************************/
+static bool MAX_30101_Bus_Read (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data)
+{
+  sensor_bus_status_t status = Sensor_Bus_Read(&max_30101_dev, reg, read_data, nbytes_read_data);
+
+  if (status != SENSOR_BUS_OK)
+  {
+      LOG_ERROR("MAX30101 Reg 0x%02x read error: %d", reg, status);
+      createEventSystemError();
+  }
+
+  return status == SENSOR_BUS_OK;
+}
+
+
+/**************************************************************************//**
+ * This function does a blocking write of consecutive registers, a failure
+ * is logged and ends the measurement
+ *
+ * @param:
+ *      reg:               The register to start writing to
+ *      write_data:        Data to write
+ *      nbytes_write_data: Number of bytes to write
+ *
+ * @return:
+ *      false if the transfer failed
+ *****************************************************************************/
+static bool MAX_30101_Bus_Write (uint8_t reg, const uint8_t* write_data, size_t nbytes_write_data)
+{
+  sensor_bus_status_t status = Sensor_Bus_Write(&max_30101_dev, reg, write_data, nbytes_write_data);
+
+  if (status != SENSOR_BUS_OK)
+  {
+      LOG_ERROR("MAX30101 Reg 0x%02x write error: %d", reg, status);
+      createEventSystemError();
+  }
+
+  return status == SENSOR_BUS_OK;
+}
+
+
+/**************************************************************************//**
+ * This function returns the value of a configuration register, from the
+ * table or, for the registers set at runtime, from the profile and the FIFO
+ * preset
+ *
+ * @param:
+ *      entry: The table entry
+ *
+ * @return:
+ *      The value to write
+ *****************************************************************************/
+static uint8_t MAX_30101_Config_Value (const max_30101_reg_val_t *entry)
+{
+  const max_30101_fifo_cfg_t *fifo = &max_30101_fifo_presets[max_30101_fifo_preset];
+
+  switch (entry->reg)
+  {
+    case MAX_30101_REG_FIFO_CONFIG:
+      return (fifo->smp_ave << MAX_30101_FIFO_SMP_AVE_SHIFT) | MAX_30101_FIFO_ROLLOVER_EN |
+             (fifo->a_full & MAX_30101_FIFO_A_FULL_MASK);
+
+    case MAX_30101_REG_SPO2_CONFIG:
+      return (max_30101_profile.adc_range << MAX_30101_SPO2_ADC_RGE_SHIFT) |
+             (max_30101_profile.sample_rate << MAX_30101_SPO2_SR_SHIFT) |
+             (max_30101_profile.pulse_width << MAX_30101_SPO2_LED_PW_SHIFT);
+
+    case MAX_30101_REG_LED1_PA:
+    case MAX_30101_REG_LED2_PA:
+    case MAX_30101_REG_LED3_PA:
+      return max_30101_profile.led_current_ua[entry->reg - MAX_30101_REG_LED1_PA]/MAX_30101_LED_CURRENT_STEP_UA;
+
+    case MAX_30101_REG_PILOT_PA:
+      return max_30101_profile.pilot_current_ua/MAX_30101_LED_CURRENT_STEP_UA;
+
+    case MAX_30101_REG_PROX_INT_THRESH:
+      return max_30101_profile.prox_threshold;
+
+    case MAX_30101_REG_INT_ENABLE_1:
+      return entry->value | (max_30101_proximity ? MAX_30101_INT_PROX : 0);
+
+    default:
+      return entry->value;
+  }
+}
+
 
 /**************************************************************************//**
  * This function initializes the sensor registers and initiates the sensor to
  * start taking readings
  *
+ * The configuration table is written in bursts of consecutive registers. The
+ * sensor needs no settling time after a register write, so there are no
+ * waits here (only MAX_30101_Reset() has to wait).
+ *
+ * Registers that already hold the table value are skipped. After a
+ * MAX_30101_ShutDown() (warm resume) this comes down to three blocking
+ * transactions:
+ *
+ *   - the read of INT_STATUS_1/2
+ *   - the FIFO_WR_PTR, OVF_COUNTER and FIFO_RD_PTR burst, they are not
+ *     shadowed and are always written
+ *   - MODE_CONFIG, not shadowed either
+ *
+ * The scheduler adds a fourth with MAX_30101_Start_Temperature(). A profile,
+ * FIFO preset or proximity change adds the registers it touches. The FIFO is
+ * emptied so the first batch only holds samples taken at the current of this
+ * measurement.
+ *
+ * The interrupt status is read first: a measurement dropped by a bus fault
+ * before it drained the FIFO leaves A_FULL pending and INT low, the next
+ * one would never see a falling edge.
+ *
  * @param:
  *      no params
  * @return:
@@ -23,44 +319,32 @@
  *****************************************************************************/
 void MAX_30101_Init()
 {
-  // Checking initial values
-  uint8_t write = 0xff, read;
-  i2c_Write_Read_blocking(0x08, &read, sizeof(read));
-  i2c_Write_Read_blocking(0x09, &read, sizeof(read));
-  i2c_Write_Read_blocking(0x0C, &read, sizeof(read));
-  i2c_Write_Read_blocking(0x11, &read, sizeof(read));
-  i2c_Write_Read_blocking(0x00, &read, sizeof(read));
-
-
-  write = 0x51;
-  i2c_Write_Write_blocking(0x08, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+  uint8_t burst[MAX_30101_MAX_BURST];
+  size_t i = 0;
 
-  write = 0x02;
-  i2c_Write_Write_blocking(0x09, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+  max_30101_agc_pending = false;
+  max_30101_fifo_wr_ptr = 0;
 
-  write = 0x4F;// Much better
-  i2c_Write_Write_blocking(0x0C, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+  MAX_30101_Bus_Read(MAX_30101_REG_INT_STATUS_1, burst, 2);
 
-  write = 0x11;// Working
-  i2c_Write_Write_blocking(0x11, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+  while (i < MAX_30101_CONFIG_LEN)
+  {
+      uint8_t reg = max_30101_config[i].reg;
+      size_t len = 0;
 
-  write = 0x80; // For full buffer
-  i2c_Write_Write_blocking(0x02, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+      // Collects the run of consecutive registers starting at entry i
+      do
+      {
+          burst[len] = MAX_30101_Config_Value(&max_30101_config[i + len]);
+          len++;
+      } while ((i + len < MAX_30101_CONFIG_LEN) &&
+               (len < MAX_30101_MAX_BURST) &&
+               (max_30101_config[i + len].reg == reg + len));
 
-  write = 0x1F;
-  i2c_Write_Write_blocking(0x0A, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+      MAX_30101_Write_Regs(reg, burst, len);
 
-  // Checking final values
-  i2c_Write_Read_blocking(0x08, &read, sizeof(read));
-  i2c_Write_Read_blocking(0x09, &read, sizeof(read));
-  i2c_Write_Read_blocking(0x0C, &read, sizeof(read));
-  i2c_Write_Read_blocking(0x11, &read, sizeof(read));
+      i += len;
+  }
 }
 
 /**************************************************************************//**
@@ -99,9 +383,8 @@ void MAX_30101_Get_Reg_Val (uint8_t reg, uint8_t* read_data, size_t nbytes_read_
  *****************************************************************************/
 void MAX_30101_ShutDown()
 {
-  uint8_t write = 0x82; // Shutdown
-  i2c_Write_Write_blocking(0x09, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+  uint8_t write = MAX_30101_MODE_SHDN | MAX_30101_MODE_HR; // Shutdown
+  MAX_30101_Write_Regs(MAX_30101_REG_MODE_CONFIG, &write, sizeof(write));
 }
 
 
@@ -118,9 +401,8 @@ void MAX_30101_ShutDown()
  *****************************************************************************/
 void MAX_30101_PowerUp()
 {
-  uint8_t write = 0x02; // Power Up
-  i2c_Write_Write_blocking(0x09, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+  uint8_t write = MAX_30101_MODE_HR; // Power Up
+  MAX_30101_Write_Regs(MAX_30101_REG_MODE_CONFIG, &write, sizeof(write));
 }
 
 
@@ -128,6 +410,12 @@ void MAX_30101_PowerUp()
  * This function resets the sensor and sets all the registers back to its
  * default values.
  *
+ * The RESET bit clears itself once the sensor is ready again, it is polled
+ * rather than waiting a fixed time. The poll gives up after
+ * MAX_30101_RESET_POLLS*MAX_30101_RESET_POLL_US.
+ *
+ * The shadow copy is resynchronized to the reset values (all zero).
+ *
  * @param:
  *      no params
  *
@@ -136,12 +424,873 @@ void MAX_30101_PowerUp()
  *****************************************************************************/
 void MAX_30101_Reset()
 {
-  uint8_t write = 0xC2; // Reset
-  i2c_Write_Write_blocking(0x09, &write, sizeof(write));
-  timerWaitUs_blocking(5000);
+  uint8_t write = MAX_30101_MODE_SHDN | MAX_30101_MODE_RESET | MAX_30101_MODE_HR; // Reset
+  uint8_t mode = MAX_30101_MODE_RESET;
+
+  MAX_30101_Shadow_Invalidate();
+
+  MAX_30101_Bus_Write(MAX_30101_REG_MODE_CONFIG, &write, sizeof(write));
+
+  for (int i = 0; (i < MAX_30101_RESET_POLLS) && (mode & MAX_30101_MODE_RESET); i++)
+  {
+      timerWaitUs_blocking(MAX_30101_RESET_POLL_US);
+      MAX_30101_Bus_Read(MAX_30101_REG_MODE_CONFIG, &mode, sizeof(mode));
+  }
+
+  if (mode & MAX_30101_MODE_RESET)
+  {
+      LOG_ERROR("MAX30101 reset did not complete");
+      return;
+  }
+
+  memset(max_30101_shadow, 0, sizeof(max_30101_shadow));
+  max_30101_shadow_known = ~(uint64_t)0;
+}
+
+
+/**************************************************************************//**
+ * This function reads nsamples samples out of the sensor FIFO in a single
+ * repeated start transaction. The FIFO_DATA register does not auto increment
+ * so all the bytes are clocked out of the same register, which saves the
+ * start condition, address and register write of every sample compared to
+ * reading one sample per transaction.
+ *
+ * @param:
+ *      fifo_data: Buffer of at least nsamples*MAX_30101_Get_Bytes_Per_Sample() bytes
+ *      nsamples:  Number of samples to read (at most MAX_30101_FIFO_DEPTH)
+ *
+ * @return:
+ *      no params
+ *****************************************************************************/
+void MAX_30101_Read_FIFO (uint8_t* fifo_data, size_t nsamples)
+{
+  if (nsamples == 0)
+    return;
+
+  MAX_30101_Bus_Read(MAX_30101_REG_FIFO_DATA, fifo_data, nsamples*MAX_30101_Get_Bytes_Per_Sample());
+}
+
+
+/**************************************************************************//**
+ * This function tells whether a register holds configuration that stays put
+ * until it is written (and so can be kept in the shadow copy). Status, FIFO
+ * and self clearing registers always go to the bus.
+ *
+ * @param:
+ *      reg: The register
+ *
+ * @return:
+ *      true if the register is kept in the shadow copy
+ *****************************************************************************/
+static bool MAX_30101_Shadowed (uint8_t reg)
+{
+  return ((reg >= MAX_30101_REG_INT_ENABLE_1) && (reg <= MAX_30101_REG_INT_ENABLE_1 + 1)) ||
+         ((reg >= MAX_30101_REG_FIFO_CONFIG) && (reg <= MAX_30101_REG_MULTI_LED_2)) ||
+         (reg == MAX_30101_REG_PROX_INT_THRESH);
+}
+
+
+/**************************************************************************//**
+ * This function writes consecutive registers through the shadow copy. Leading
+ * and trailing registers that already hold the value are trimmed off, and
+ * nothing is put on the bus if the whole run is unchanged.
+ *
+ * @param:
+ *      reg:               The first register to write
+ *      write_data:        Values of the consecutive registers
+ *      nbytes_write_data: Number of registers to write
+ *
+ * @return:
+ *      no params
+ *****************************************************************************/
+void MAX_30101_Write_Regs (uint8_t reg, const uint8_t* write_data, size_t nbytes_write_data)
+{
+  size_t first = 0, last = nbytes_write_data;
+  bool shadowed = true;
+
+  for (size_t i = 0; i < nbytes_write_data; i++)
+    shadowed = shadowed && MAX_30101_Shadowed(reg + i) &&
+               (max_30101_shadow_known & MAX_30101_SHADOW_BIT(reg + i));
+
+  if (shadowed)
+  {
+      while ((first < last) && (max_30101_shadow[reg + first] == write_data[first]))
+        first++;
+      while ((last > first) && (max_30101_shadow[reg + last - 1] == write_data[last - 1]))
+        last--;
+
+      if (first == last)
+        return;
+  }
+
+  if (!MAX_30101_Bus_Write(reg + first, &write_data[first], last - first))
+  {
+      MAX_30101_Shadow_Invalidate();
+      return;
+  }
+
+#if MAX_30101_VERIFY_CONFIG
+  uint8_t readback[MAX_30101_MAX_BURST];
+
+  if ((last - first) <= sizeof(readback))
+  {
+      MAX_30101_Bus_Read(reg + first, readback, last - first);
+
+      for (size_t j = first; j < last; j++)
+      {
+          if (readback[j - first] != write_data[j])
+            LOG_ERROR("MAX30101 Reg 0x%02x: wrote 0x%02x, read 0x%02x", (int)(reg + j), write_data[j], readback[j - first]);
+      }
+  }
+#endif
+
+  for (size_t i = first; i < last; i++)
+  {
+      if (MAX_30101_Shadowed(reg + i))
+      {
+          max_30101_shadow[reg + i] = write_data[i];
+          max_30101_shadow_known |= MAX_30101_SHADOW_BIT(reg + i);
+      }
+  }
+}
+
+
+/**************************************************************************//**
+ * This function drops the shadow copy, the next MAX_30101_Init() writes the
+ * whole configuration again. Used when the register contents are no longer
+ * known (I2C error, reset in progress).
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no params
+ *****************************************************************************/
+void MAX_30101_Shadow_Invalidate()
+{
+  max_30101_shadow_known = 0;
+}
+
+
+/**************************************************************************//**
+ * This function adds a transfer to the interrupt driven queue. Nothing is put
+ * on the bus until MAX_30101_Async_Submit() is called.
+ *
+ * @param:
+ *      write: true for a register write, false for a read
+ *      reg:   The register the transfer starts at
+ *      data:  Data to write or buffer for the data read
+ *      len:   Number of bytes
+ *
+ * @return:
+ *      false if the queue is full
+ *****************************************************************************/
+static bool MAX_30101_Queue (bool write, uint8_t reg, uint8_t* data, size_t len)
+{
+  bool queued = false;
+
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+
+  if (async_count < MAX_30101_ASYNC_QUEUE_LEN)
+  {
+      max_30101_transfer_t *transfer = &async_queue[(async_head + async_count) % MAX_30101_ASYNC_QUEUE_LEN];
+
+      transfer->write = write;
+      transfer->reg = reg;
+      transfer->data = data;
+      transfer->len = len;
+      async_count++;
+      queued = true;
+  }
+
+  CORE_EXIT_CRITICAL();
+
+  if (!queued)
+    LOG_ERROR("MAX30101 transfer queue full");
+
+  return queued;
+}
+
+
+/**************************************************************************//**
+ * This function queues a register read on the interrupt driven path
+ *
+ * @param:
+ *      reg:              The register to start reading from
+ *      read_data:        Buffer for the data, valid until completion
+ *      nbytes_read_data: Number of bytes to read
+ *
+ * @return:
+ *      false if the queue is full
+ *****************************************************************************/
+bool MAX_30101_Queue_Read (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data)
+{
+  return MAX_30101_Queue(false, reg, read_data, nbytes_read_data);
+}
+
+
+/**************************************************************************//**
+ * This function queues a register write on the interrupt driven path
+ *
+ * @param:
+ *      reg:               The register to start writing to
+ *      write_data:        Data to write, valid until completion
+ *      nbytes_write_data: Number of bytes to write
+ *
+ * @return:
+ *      false if the queue is full
+ *****************************************************************************/
+bool MAX_30101_Queue_Write (uint8_t reg, uint8_t* write_data, size_t nbytes_write_data)
+{
+  if (!MAX_30101_Queue(true, reg, write_data, nbytes_write_data))
+    return false;
+
+  // The shadow follows the queued value, a failed transfer invalidates it
+  // through MAX_30101_Async_Abort()
+  for (size_t i = 0; i < nbytes_write_data; i++)
+  {
+      if (MAX_30101_Shadowed(reg + i))
+      {
+          max_30101_shadow[reg + i] = write_data[i];
+          max_30101_shadow_known |= MAX_30101_SHADOW_BIT(reg + i);
+      }
+  }
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function queues a FIFO burst of nsamples samples on the interrupt
+ * driven path (see MAX_30101_Read_FIFO())
+ *
+ * @param:
+ *      fifo_data: Buffer of at least nsamples*MAX_30101_Get_Bytes_Per_Sample() bytes
+ *      nsamples:  Number of samples to read
+ *
+ * @return:
+ *      false if the queue is full
+ *****************************************************************************/
+bool MAX_30101_Queue_Read_FIFO (uint8_t* fifo_data, size_t nsamples)
+{
+  if (nsamples == 0)
+    return true;
+
+  return MAX_30101_Queue(false, MAX_30101_REG_FIFO_DATA, fifo_data, nsamples*MAX_30101_Get_Bytes_Per_Sample());
+}
+
+
+/**************************************************************************//**
+ * This function queues the read of INT_STATUS_1 through FIFO_RD_PTR in one
+ * burst: interrupt status, write pointer, overflow counter and read pointer
+ * of the same instant. Reading the status also clears the interrupts.
+ *
+ * @param:
+ *      fifo_status: Buffer of MAX_30101_FIFO_STATUS_LEN bytes
+ *
+ * @return:
+ *      false if the queue is full
+ *****************************************************************************/
+bool MAX_30101_Queue_Read_FIFO_Status (uint8_t* fifo_status)
+{
+  return MAX_30101_Queue(false, MAX_30101_REG_INT_STATUS_1, fifo_status, MAX_30101_FIFO_STATUS_LEN);
 }
 
 
+/**************************************************************************//**
+ * This function works out the batch to drain from a status burst and keeps
+ * the overflow statistics.
+ *
+ * With roll over enabled a full FIFO keeps the newest samples, so the samples
+ * counted by OVF_COUNTER were lost just before the ones in the FIFO and the
+ * FIFO holds MAX_30101_FIFO_DEPTH samples (the pointers are equal). The
+ * counter is cleared by the sensor when the batch is read.
+ *
+ * After an LED current step the batch tells which of its samples were taken
+ * at the new current: the ones pushed after the write pointer read that
+ * follows the AGC write (MAX_30101_AGC_Update()). The sample being averaged
+ * while the write lands mixes both currents, it counts as a new one. Equal pointers
+ * with A_FULL set are a full FIFO too, A_FULL never fires on an empty one.
+ *
+ * @param:
+ *      fifo_status: Status burst read by MAX_30101_Queue_Read_FIFO_Status()
+ *      batch:       Filled with the batch description
+ *
+ * @return:
+ *      Number of samples to read out of the FIFO
+ *****************************************************************************/
+uint8_t MAX_30101_FIFO_Account (const uint8_t* fifo_status, max_30101_batch_t* batch)
+{
+  uint8_t write_ptr = fifo_status[MAX_30101_REG_FIFO_WR_PTR - MAX_30101_REG_INT_STATUS_1];
+  uint8_t ovf = fifo_status[MAX_30101_REG_OVF_COUNTER - MAX_30101_REG_INT_STATUS_1];
+  uint8_t read_ptr = fifo_status[MAX_30101_REG_FIFO_RD_PTR - MAX_30101_REG_INT_STATUS_1];
+  bool a_full = (fifo_status[MAX_30101_REG_INT_STATUS_1] & MAX_30101_INT_A_FULL) != 0;
+
+  batch->dropped = ovf;
+  batch->nsamples = (write_ptr - read_ptr) & (MAX_30101_FIFO_DEPTH - 1);
+
+  if ((batch->nsamples == 0) && a_full)
+    batch->nsamples = MAX_30101_FIFO_DEPTH;
+
+  if (ovf != 0)
+  {
+      batch->nsamples = MAX_30101_FIFO_DEPTH;
+
+      max_30101_fifo_stats.overflows++;
+      max_30101_fifo_stats.dropped += ovf;
+
+      LOG_ERROR("MAX30101 FIFO overflow: %d%s samples lost (%d in total)", ovf,
+                (ovf == MAX_30101_OVF_COUNTER_MAX) ? " or more" : "", (int)max_30101_fifo_stats.dropped);
+  }
+
+  // Samples pushed between the previous batch and the end of the AGC write
+  uint32_t agc_samples = (max_30101_agc_wr_ptr - max_30101_fifo_wr_ptr) & (MAX_30101_FIFO_DEPTH - 1);
+
+  max_30101_sample_index += batch->dropped;
+  batch->first_index = max_30101_sample_index;
+  max_30101_sample_index += batch->nsamples;
 
+  batch->led_pa = max_30101_shadow[MAX_30101_REG_LED1_PA];
+  batch->led_pa_before = batch->led_pa;
+  batch->led_pa_from = 0;
 
+  if (max_30101_agc_pending)
+  {
+      uint32_t from = (agc_samples > batch->dropped) ? agc_samples - batch->dropped : 0;
 
+      batch->led_pa_before = max_30101_agc_old_pa;
+      batch->led_pa_from = (from > batch->nsamples) ? batch->nsamples : from;
+      max_30101_agc_pending = false;
+  }
+
+  max_30101_fifo_wr_ptr = write_ptr;
+
+  max_30101_fifo_stats.batches++;
+  max_30101_fifo_stats.samples += batch->nsamples;
+  if (batch->nsamples == 0)
+    max_30101_fifo_stats.empty++;
+
+  return batch->nsamples;
+}
+
+
+/**************************************************************************//**
+ * This function returns the cumulative FIFO statistics
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Pointer to the statistics
+ *****************************************************************************/
+const max_30101_fifo_stats_t* MAX_30101_Get_FIFO_Stats()
+{
+  return &max_30101_fifo_stats;
+}
+
+
+/**************************************************************************//**
+ * This function starts a die temperature conversion. The conversion takes
+ * about 29 ms and runs on its own, the result is read with
+ * MAX_30101_Queue_Read_Temperature() along with a later FIFO drain.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no params
+ *****************************************************************************/
+void MAX_30101_Start_Temperature()
+{
+  uint8_t write = MAX_30101_TEMP_EN;
+  MAX_30101_Bus_Write(MAX_30101_REG_DIE_TEMP_CONFIG, &write, sizeof(write));
+}
+
+
+/**************************************************************************//**
+ * This function queues the read of the die temperature (TINT and TFRAC)
+ *
+ * @param:
+ *      temp_data: Buffer of MAX_30101_DIE_TEMP_LEN bytes
+ *
+ * @return:
+ *      false if the queue is full
+ *****************************************************************************/
+bool MAX_30101_Queue_Read_Temperature (uint8_t* temp_data)
+{
+  return MAX_30101_Queue(false, MAX_30101_REG_DIE_TINT, temp_data, MAX_30101_DIE_TEMP_LEN);
+}
+
+
+/**************************************************************************//**
+ * This function converts TINT and TFRAC into a temperature
+ *
+ * @param:
+ *      temp_data: TINT and TFRAC as read by MAX_30101_Queue_Read_Temperature()
+ *
+ * @return:
+ *      Die temperature in units of 0.01 C
+ *****************************************************************************/
+int32_t MAX_30101_Temperature_Centi (const uint8_t* temp_data)
+{
+  return ((int32_t)(int8_t)temp_data[0])*100 + ((temp_data[1] & 0x0F)*625)/100;
+}
+
+
+/**************************************************************************//**
+ * This function starts the transfer at the head of the queue. When the queue
+ * is empty the completion event is posted and the EM1 requirement that kept
+ * the I2C peripheral clocked is released.
+ *
+ * Called from thread context by MAX_30101_Async_Submit() and from the bus
+ * completion (I2C0_IRQHandler on target) when a transfer is done.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void MAX_30101_Async_Start_Head()
+{
+  sensor_bus_status_t status;
+  max_30101_transfer_t *transfer;
+
+  if (async_count == 0)
+  {
+      async_busy = false;
+      sl_power_manager_remove_em_requirement(SL_POWER_MANAGER_EM1);
+      createEventI2CTransfer();
+      return;
+  }
+
+  transfer = &async_queue[async_head];
+
+  if (transfer->write)
+    status = Sensor_Bus_Start_Write(&max_30101_dev, transfer->reg, transfer->data, transfer->len, MAX_30101_Async_Done);
+  else
+    status = Sensor_Bus_Start_Read(&max_30101_dev, transfer->reg, transfer->data, transfer->len, MAX_30101_Async_Done);
+
+  if (status != SENSOR_BUS_IN_PROGRESS)
+  {
+      MAX_30101_Async_Abort();
+      createEventSystemError();
+  }
+}
+
+
+/**************************************************************************//**
+ * This function puts the queued transfers on the bus. They run back to back
+ * from the I2C interrupt while the core sleeps in EM1.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void MAX_30101_Async_Submit()
+{
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+
+  if (!async_busy)
+  {
+      async_busy = true;
+
+      // The I2C peripheral is not clocked in EM2
+      sl_power_manager_add_em_requirement(SL_POWER_MANAGER_EM1);
+
+      MAX_30101_Async_Start_Head();
+  }
+
+  CORE_EXIT_CRITICAL();
+}
+
+
+/**************************************************************************//**
+ * This function retires the transfer that just completed and starts the next
+ * one. A failed transfer drops the queue and ends the measurement. Bus
+ * completion callback, runs in I2C0_IRQHandler on target.
+ *
+ * @param:
+ *      status: Outcome of the transfer
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void MAX_30101_Async_Done (sensor_bus_status_t status)
+{
+  if (!async_busy || async_count == 0)
+    return;
+
+  if (status != SENSOR_BUS_OK)
+  {
+      MAX_30101_Async_Abort();
+      createEventSystemError();
+      return;
+  }
+
+  async_head = (async_head + 1) % MAX_30101_ASYNC_QUEUE_LEN;
+  async_count--;
+
+  MAX_30101_Async_Start_Head();
+}
+
+
+/**************************************************************************//**
+ * This function drops every queued transfer, used when a transfer fails.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void MAX_30101_Async_Abort()
+{
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+
+  Sensor_Bus_Abort(max_30101_dev.bus);
+
+  if (async_busy)
+  {
+      async_busy = false;
+      sl_power_manager_remove_em_requirement(SL_POWER_MANAGER_EM1);
+  }
+  async_head = 0;
+  async_count = 0;
+
+  // Queued writes may or may not have reached the sensor
+  MAX_30101_Shadow_Invalidate();
+
+  CORE_EXIT_CRITICAL();
+}
+
+
+/**************************************************************************//**
+ * This function tells whether transfers are still in flight on the interrupt
+ * driven path. The blocking functions must not be used meanwhile.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      true while transfers are in flight
+ *****************************************************************************/
+bool MAX_30101_Async_Busy()
+{
+  return async_busy;
+}
+
+
+/**************************************************************************//**
+ * This function turns the LED current control on or off
+ *
+ * @param:
+ *      enable: true to let MAX_30101_AGC_Update() step the LED currents
+ *
+ * @return:
+ *      no params
+ *****************************************************************************/
+void MAX_30101_Set_AGC (bool enable)
+{
+  max_30101_agc = enable;
+}
+
+
+/**************************************************************************//**
+ * This function is the LED current control loop, run once per drained batch.
+ *
+ * Nothing changes while the DC level of the batch is between
+ * MAX_30101_AGC_LOW and MAX_30101_AGC_HIGH (hysteresis). Outside, the active
+ * LED currents are scaled towards MAX_30101_AGC_TARGET, by at most
+ * MAX_30101_AGC_MAX_STEP, and the new LED1_PA..LED3_PA are queued as one
+ * burst, followed by a read of FIFO_WR_PTR that tells the first sample at the
+ * new current. The profile follows so the next measurement starts from the
+ * new current. The next batch carries the step in max_30101_batch_t.
+ *
+ * @param:
+ *      batch_dc: Mean of the samples of the batch
+ *
+ * @return:
+ *      true if a write was queued (to be submitted by the caller)
+ *****************************************************************************/
+bool MAX_30101_AGC_Update (uint32_t batch_dc)
+{
+  uint32_t pa = max_30101_profile.led_current_ua[0]/MAX_30101_LED_CURRENT_STEP_UA;
+  uint32_t new_pa;
+
+  if (!max_30101_agc || (pa == 0) ||
+      ((batch_dc >= MAX_30101_AGC_LOW) && (batch_dc <= MAX_30101_AGC_HIGH)))
+    return false;
+
+  new_pa = ((uint64_t)pa*MAX_30101_AGC_TARGET)/(batch_dc ? batch_dc : 1);
+
+  if (new_pa > pa*MAX_30101_AGC_MAX_STEP)
+    new_pa = pa*MAX_30101_AGC_MAX_STEP;
+  if (new_pa < pa/MAX_30101_AGC_MAX_STEP)
+    new_pa = pa/MAX_30101_AGC_MAX_STEP;
+  if (new_pa > 0xFF)
+    new_pa = 0xFF;
+  if (new_pa < 1)
+    new_pa = 1;
+
+  if (new_pa == pa)
+    return false;
+
+  // The write and the pointer read go out together, only this thread queues
+  if (async_count + 2 > MAX_30101_ASYNC_QUEUE_LEN)
+    return false;
+
+  for (int i = 0; i < MAX_30101_NUM_LEDS; i++)
+  {
+      uint32_t led_pa = ((max_30101_profile.led_current_ua[i]/MAX_30101_LED_CURRENT_STEP_UA)*new_pa)/pa;
+
+      if (led_pa > 0xFF)
+        led_pa = 0xFF;
+
+      max_30101_agc_pa[i] = led_pa;
+      max_30101_profile.led_current_ua[i] = led_pa*MAX_30101_LED_CURRENT_STEP_UA;
+  }
+
+  LOG_INFO("LED AGC: DC %d, LED1_PA 0x%02x -> 0x%02x", (int)batch_dc, (int)pa, (int)new_pa);
+
+  max_30101_agc_old_pa = max_30101_shadow[MAX_30101_REG_LED1_PA];
+
+  MAX_30101_Queue_Write(MAX_30101_REG_LED1_PA, max_30101_agc_pa, sizeof(max_30101_agc_pa));
+  MAX_30101_Queue_Read(MAX_30101_REG_FIFO_WR_PTR, &max_30101_agc_wr_ptr, sizeof(max_30101_agc_wr_ptr));
+  max_30101_agc_pending = true;
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function turns proximity gating on or off, from the next
+ * MAX_30101_Init(). With gating the sensor starts in proximity mode: it
+ * pulses the LED at the pilot current and raises PROX_INT once the reading
+ * crosses the threshold (a finger is on the sensor), then switches to the
+ * configured mode by itself. Writing MODE_CONFIG enters proximity mode again.
+ *
+ * @param:
+ *      enable: true to wait for a finger before sampling
+ *
+ * @return:
+ *      no params
+ *****************************************************************************/
+void MAX_30101_Set_Proximity (bool enable)
+{
+  max_30101_proximity = enable;
+}
+
+
+/**************************************************************************//**
+ * This function tells whether proximity gating is on
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      true if the sensor waits for a finger before sampling
+ *****************************************************************************/
+bool MAX_30101_Get_Proximity()
+{
+  return max_30101_proximity;
+}
+
+
+/**************************************************************************//**
+ * This function selects the FIFO watermark and averaging preset. It takes
+ * effect at the next MAX_30101_Init(), i.e. the next measurement, so the FIFO
+ * never holds samples of two different rates.
+ *
+ * @param:
+ *      preset: One of max_30101_fifo_preset_t
+ *
+ * @return:
+ *      no params
+ *****************************************************************************/
+void MAX_30101_Set_FIFO_Preset (max_30101_fifo_preset_t preset)
+{
+  if (preset >= num_MAX_30101_FIFO_PRESETS)
+  {
+      LOG_ERROR("Invalid MAX30101 FIFO preset %d", (int)preset);
+      return;
+  }
+
+  if (preset == max_30101_fifo_preset)
+    return;
+
+  max_30101_fifo_preset = preset;
+
+  LOG_INFO("MAX30101 FIFO preset %d: %d samples per batch, %d samples/s, %d wakeups/min",
+           (int)preset, (int)MAX_30101_Get_FIFO_Batch(), (int)MAX_30101_Get_Sample_Rate(),
+           (int)MAX_30101_Get_Wakeups_Per_Minute());
+}
+
+
+/**************************************************************************//**
+ * This function returns the FIFO preset in use
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      The current max_30101_fifo_preset_t
+ *****************************************************************************/
+max_30101_fifo_preset_t MAX_30101_Get_FIFO_Preset()
+{
+  return max_30101_fifo_preset;
+}
+
+
+/**************************************************************************//**
+ * This function returns the number of samples in the FIFO when the almost
+ * full interrupt fires, i.e. the samples drained per wakeup
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Samples per batch
+ *****************************************************************************/
+uint32_t MAX_30101_Get_FIFO_Batch()
+{
+  return MAX_30101_FIFO_DEPTH - max_30101_fifo_presets[max_30101_fifo_preset].a_full;
+}
+
+
+/**************************************************************************//**
+ * This function checks a profile against the data sheet and makes it the one
+ * applied by the next MAX_30101_Init(). An invalid profile is rejected and
+ * the current one is kept.
+ *
+ * @param:
+ *      profile: The profile to use
+ *
+ * @return:
+ *      false if the profile is not a legal configuration
+ *****************************************************************************/
+bool MAX_30101_Set_Profile (const max_30101_profile_t* profile)
+{
+  if ((profile->sample_rate >= num_MAX_30101_SR) ||
+      (profile->pulse_width >= num_MAX_30101_PW) ||
+      (profile->adc_range >= num_MAX_30101_ADC))
+  {
+      LOG_ERROR("Invalid MAX30101 profile");
+      return false;
+  }
+
+  if (profile->sample_rate > max_30101_max_rate[profile->pulse_width])
+  {
+      LOG_ERROR("MAX30101 profile: %d samples/s is too fast for pulse width %d",
+                max_30101_sample_rates[profile->sample_rate], (int)profile->pulse_width);
+      return false;
+  }
+
+  for (int i = 0; i < MAX_30101_NUM_LEDS; i++)
+  {
+      if (profile->led_current_ua[i] > MAX_30101_LED_CURRENT_MAX_UA)
+      {
+          LOG_ERROR("MAX30101 profile: LED%d current %d uA out of range", i + 1, profile->led_current_ua[i]);
+          return false;
+      }
+  }
+
+  if (profile->pilot_current_ua > MAX_30101_LED_CURRENT_MAX_UA)
+  {
+      LOG_ERROR("MAX30101 profile: pilot current %d uA out of range", profile->pilot_current_ua);
+      return false;
+  }
+
+  max_30101_profile = *profile;
+
+  LOG_INFO("MAX30101 profile: %d samples/s, %d bits, LED1 %d uA",
+           (int)MAX_30101_Get_Sample_Rate(), (int)MAX_30101_Get_Resolution_Bits(), max_30101_profile.led_current_ua[0]);
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function returns the profile in use
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Pointer to the current profile
+ *****************************************************************************/
+const max_30101_profile_t* MAX_30101_Get_Profile()
+{
+  return &max_30101_profile;
+}
+
+
+/**************************************************************************//**
+ * This function returns the size of one FIFO sample, 3 bytes for every
+ * active LED
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Bytes per sample
+ *****************************************************************************/
+uint32_t MAX_30101_Get_Bytes_Per_Sample()
+{
+  return MAX_30101_BYTES_PER_LED*MAX_30101_ACTIVE_LEDS;
+}
+
+
+/**************************************************************************//**
+ * This function returns the ADC resolution set by the pulse width. Samples
+ * are left justified in 18 bits whatever the resolution.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Resolution in bits
+ *****************************************************************************/
+uint32_t MAX_30101_Get_Resolution_Bits()
+{
+  return 15 + max_30101_profile.pulse_width;
+}
+
+
+/**************************************************************************//**
+ * This function returns the rate at which averaged samples reach the FIFO
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Samples per second
+ *****************************************************************************/
+uint32_t MAX_30101_Get_Sample_Rate()
+{
+  return max_30101_sample_rates[max_30101_profile.sample_rate] >> max_30101_fifo_presets[max_30101_fifo_preset].smp_ave;
+}
+
+
+/**************************************************************************//**
+ * This function returns how often the almost full interrupt wakes the core
+ * while the sensor is sampling
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Wakeups per minute
+ *****************************************************************************/
+uint32_t MAX_30101_Get_Wakeups_Per_Minute()
+{
+  return (60*MAX_30101_Get_Sample_Rate())/MAX_30101_Get_FIFO_Batch();
+}
@@ -12,11 +12,199 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
+#include "sensor_bus.h"
+
+// Interrupt status registers (refer to data sheet)
+#define MAX_30101_REG_INT_STATUS_1  0x00
+#define MAX_30101_REG_INT_STATUS_2  0x01
+#define MAX_30101_REG_INT_ENABLE_1  0x02
+#define MAX_30101_INT_A_FULL        0x80  // FIFO almost full flag in INT_STATUS_1 / INT_ENABLE_1
+#define MAX_30101_INT_PROX          0x10  // Proximity threshold crossed, INT_STATUS_1 / INT_ENABLE_1
+#define MAX_30101_INT_DIE_TEMP_RDY  0x02  // Die temperature conversion done, INT_STATUS_2 / INT_ENABLE_2
+
+// FIFO registers (refer to data sheet)
+#define MAX_30101_REG_FIFO_WR_PTR   0x04
+#define MAX_30101_REG_OVF_COUNTER   0x05
+#define MAX_30101_REG_FIFO_RD_PTR   0x06
+#define MAX_30101_REG_FIFO_DATA     0x07
+
+// INT_STATUS_1 up to FIFO_RD_PTR, read in one burst when the FIFO is drained
+#define MAX_30101_FIFO_STATUS_LEN   (MAX_30101_REG_FIFO_RD_PTR - MAX_30101_REG_INT_STATUS_1 + 1)
+#define MAX_30101_OVF_COUNTER_MAX   0x1F  // OVF_COUNTER saturates here
+
+// Configuration registers (refer to data sheet)
+#define MAX_30101_REG_FIFO_CONFIG   0x08
+#define MAX_30101_REG_MODE_CONFIG   0x09
+#define MAX_30101_REG_SPO2_CONFIG   0x0A
+#define MAX_30101_REG_LED1_PA       0x0C
+#define MAX_30101_REG_LED2_PA       0x0D
+#define MAX_30101_REG_LED3_PA       0x0E
+#define MAX_30101_REG_PILOT_PA      0x10  // LED current in proximity mode
+#define MAX_30101_REG_MULTI_LED_1   0x11
+#define MAX_30101_REG_MULTI_LED_2   0x12
+#define MAX_30101_REG_PROX_INT_THRESH 0x30
+
+// Die temperature registers (refer to data sheet)
+#define MAX_30101_REG_DIE_TINT      0x1F  // Integer part, two's complement C
+#define MAX_30101_REG_DIE_TFRAC     0x20  // Fraction, 0.0625 C steps in [3:0]
+#define MAX_30101_REG_DIE_TEMP_CONFIG 0x21
+#define MAX_30101_TEMP_EN           0x01  // Starts a conversion, cleared by the sensor when done
+#define MAX_30101_DIE_TEMP_LEN      2     // TINT and TFRAC
+
+#define MAX_30101_SHADOW_SIZE       (MAX_30101_REG_PROX_INT_THRESH + 1) // Registers covered by the shadow copy
+
+#define MAX_30101_FIFO_SMP_AVE_SHIFT 5     // FIFO_CONFIG[7:5], 2^n samples averaged (n <= 5)
+#define MAX_30101_FIFO_ROLLOVER_EN  0x10
+#define MAX_30101_FIFO_A_FULL_MASK  0x0F  // FIFO_CONFIG[3:0], empty slots left when A_FULL fires
+
+#define MAX_30101_MODE_SHDN         0x80
+#define MAX_30101_MODE_RESET        0x40  // Cleared by the sensor once the reset is complete
+#define MAX_30101_MODE_HR           0x02  // Heart rate mode, red LED only
+
+#define MAX_30101_SPO2_ADC_RGE_SHIFT 5    // SPO2_CONFIG[6:5]
+#define MAX_30101_SPO2_SR_SHIFT     2     // SPO2_CONFIG[4:2]
+#define MAX_30101_SPO2_LED_PW_SHIFT 0     // SPO2_CONFIG[1:0]
+
+#define MAX_30101_FIFO_DEPTH        32    // Samples the FIFO can hold
+#define MAX_30101_BYTES_PER_LED     3     // Every active LED adds 3 bytes to a FIFO sample
+#define MAX_30101_NUM_LEDS          3
+#define MAX_30101_ACTIVE_LEDS       1     // Heart rate mode, red LED only
+#define MAX_30101_LED_CURRENT_STEP_UA 200 // LEDx_PA LSB
+#define MAX_30101_LED_CURRENT_MAX_UA  (0xFF*MAX_30101_LED_CURRENT_STEP_UA)
+#define MAX_30101_ADC_FULL_SCALE    0x3FFFF // Samples are left justified in 18 bits
+
+// LED current control, keeps the DC level of a batch between LOW and HIGH
+#define MAX_30101_AGC_LOW           (MAX_30101_ADC_FULL_SCALE/4)
+#define MAX_30101_AGC_HIGH          ((MAX_30101_ADC_FULL_SCALE/4)*3)
+#define MAX_30101_AGC_TARGET        (MAX_30101_ADC_FULL_SCALE/2)
+#define MAX_30101_AGC_MAX_STEP      2     // The current changes at most by this factor per batch
+
+// Sample rate before averaging, SPO2_CONFIG[4:2]
+typedef enum
+{
+  MAX_30101_SR_50,
+  MAX_30101_SR_100,
+  MAX_30101_SR_200,
+  MAX_30101_SR_400,
+  MAX_30101_SR_800,
+  MAX_30101_SR_1000,
+  MAX_30101_SR_1600,
+  MAX_30101_SR_3200,
+  num_MAX_30101_SR
+} max_30101_sample_rate_t;
+
+// LED pulse width, sets the ADC resolution, SPO2_CONFIG[1:0]
+typedef enum
+{
+  MAX_30101_PW_69US,                // 15 bits
+  MAX_30101_PW_118US,               // 16 bits
+  MAX_30101_PW_215US,               // 17 bits
+  MAX_30101_PW_411US,               // 18 bits
+  num_MAX_30101_PW
+} max_30101_pulse_width_t;
+
+// ADC full scale, SPO2_CONFIG[6:5]
+typedef enum
+{
+  MAX_30101_ADC_2048NA,
+  MAX_30101_ADC_4096NA,
+  MAX_30101_ADC_8192NA,
+  MAX_30101_ADC_16384NA,
+  num_MAX_30101_ADC
+} max_30101_adc_range_t;
+
+// Acquisition profile, applied by the next MAX_30101_Init()
+typedef struct
+{
+  max_30101_sample_rate_t sample_rate;
+  max_30101_pulse_width_t pulse_width;
+  max_30101_adc_range_t adc_range;
+  uint16_t led_current_ua[MAX_30101_NUM_LEDS]; // Red, IR, green; rounded down to 200 uA steps
+  uint16_t pilot_current_ua;        // LED current while waiting for a finger (proximity mode)
+  uint8_t prox_threshold;           // Proximity trigger, compared with the 8 MSBs of the ADC count
+} max_30101_profile_t;
+
+// One drained FIFO batch
+typedef struct
+{
+  uint32_t first_index;             // Index of the first sample since boot, lost samples included
+  uint8_t nsamples;                 // Samples to read out of the FIFO
+  uint8_t dropped;                  // Samples lost to an overflow just before this batch
+  uint8_t led_pa;                   // LED1_PA the batch was sampled with, from sample led_pa_from on
+  uint8_t led_pa_before;            // LED1_PA of the samples before led_pa_from (LED current step)
+  uint8_t led_pa_from;              // First sample at led_pa, 0 if the whole batch is
+} max_30101_batch_t;
+
+// Cumulative FIFO statistics since boot
+typedef struct
+{
+  uint32_t batches;
+  uint32_t samples;                 // Samples drained
+  uint32_t dropped;                 // Samples lost to overflows (lower bound once OVF_COUNTER saturates)
+  uint32_t overflows;               // Batches that had lost samples
+  uint32_t empty;                   // Batches with no samples to drain
+} max_30101_fifo_stats_t;
+
+// FIFO watermark / averaging presets, applied by the next MAX_30101_Init()
+// (rates below are for the default profile)
+typedef enum
+{
+  MAX_30101_FIFO_LOW_LATENCY,       // 17 sample batches at 400 samples/s
+  MAX_30101_FIFO_BALANCED,          // 31 sample batches at 400 samples/s (default)
+  MAX_30101_FIFO_MIN_WAKEUPS,       // 31 sample batches at 200 samples/s
+  num_MAX_30101_FIFO_PRESETS
+} max_30101_fifo_preset_t;
+
+#define MAX_30101_ASYNC_QUEUE_LEN   8     // Transfers that can be queued on the interrupt driven path
+
+#define MAX_30101_MAX_BURST         4     // Longest run of consecutive registers written in one transaction
+#define MAX_30101_RESET_POLLS       10    // Bound on the RESET bit polling, 5 ms in total
+#define MAX_30101_RESET_POLL_US     500
+
+// Set to 1 to read every configuration burst back and log mismatches
+#ifndef MAX_30101_VERIFY_CONFIG
+#define MAX_30101_VERIFY_CONFIG     0
+#endif
+
+void MAX_30101_Attach (sensor_bus_t *bus, uint8_t addr);
 void MAX_30101_Init();
 void MAX_30101_Get_Reg_Val (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data);
 void MAX_30101_ShutDown();
 void MAX_30101_PowerUp();
 void MAX_30101_Reset();
+void MAX_30101_Read_FIFO (uint8_t* fifo_data, size_t nsamples);
+void MAX_30101_Write_Regs (uint8_t reg, const uint8_t* write_data, size_t nbytes_write_data);
+void MAX_30101_Shadow_Invalidate();
+bool MAX_30101_Set_Profile (const max_30101_profile_t* profile);
+const max_30101_profile_t* MAX_30101_Get_Profile();
+uint32_t MAX_30101_Get_Bytes_Per_Sample();
+uint32_t MAX_30101_Get_Resolution_Bits();
+void MAX_30101_Set_AGC (bool enable);
+bool MAX_30101_AGC_Update (uint32_t batch_dc);
+void MAX_30101_Set_Proximity (bool enable);
+bool MAX_30101_Get_Proximity();
+void MAX_30101_Set_FIFO_Preset (max_30101_fifo_preset_t preset);
+max_30101_fifo_preset_t MAX_30101_Get_FIFO_Preset();
+uint32_t MAX_30101_Get_FIFO_Batch();
+uint32_t MAX_30101_Get_Sample_Rate();
+uint32_t MAX_30101_Get_Wakeups_Per_Minute();
+
+// Interrupt driven (non-blocking) access. Transfers are queued and started
+// with MAX_30101_Async_Submit(), completion of the whole queue is posted as
+// event_I2CTransfer_IRQ_hr. Buffers must stay valid until then.
+bool MAX_30101_Queue_Read (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data);
+bool MAX_30101_Queue_Write (uint8_t reg, uint8_t* write_data, size_t nbytes_write_data);
+bool MAX_30101_Queue_Read_FIFO (uint8_t* fifo_data, size_t nsamples);
+bool MAX_30101_Queue_Read_FIFO_Status (uint8_t* fifo_status);
+uint8_t MAX_30101_FIFO_Account (const uint8_t* fifo_status, max_30101_batch_t* batch);
+const max_30101_fifo_stats_t* MAX_30101_Get_FIFO_Stats();
+void MAX_30101_Start_Temperature();
+bool MAX_30101_Queue_Read_Temperature (uint8_t* temp_data);
+int32_t MAX_30101_Temperature_Centi (const uint8_t* temp_data);
+void MAX_30101_Async_Submit();
+void MAX_30101_Async_Abort();
+bool MAX_30101_Async_Busy();
 
 #endif /* SRC_MAX_30101_H_ */
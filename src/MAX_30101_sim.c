@@ -0,0 +1,903 @@
+/*
+ * MAX_30101_sim.c
+ *
+ *  Behavioural model of the MAX30101 for running the acquisition path on a
+ *  host, without a board. Models the register map with auto increment, the
+ *  32 sample FIFO with its pointers, roll over and overflow counter, the
+ *  A_FULL / PPG_RDY / PROX / DIE_TEMP_RDY interrupts, the shutdown and reset
+ *  bits of MODE_CONFIG, proximity mode and the multi-LED slots. Samples come
+ *  from a source callback at the configured rate and averaging, a rate the
+ *  pulse width doesn't allow stops the sampling. Bus faults (NACK, bus
+ *  error, stuck SDA) can be injected on the sim bus.
+ *
+ *  Time only moves in MAX_30101_Sim_Advance(), which makes runs reproducible.
+ *
+ *  Self test:
+ *      gcc -DTESTING -Isrc src/MAX_30101_sim.c src/sensor_bus.c -lm && ./a.out
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "MAX_30101_sim.h"
+
+
+#define MAX_30101_SIM_PI 3.14159265358979323846
+
+static const uint32_t sim_sample_rates[8] = { 50, 100, 200, 400, 800, 1000, 1600, 3200 };
+
+// Fastest SR code every pulse width allows, with one LED and with two or
+// more (refer to data sheet)
+static const uint8_t sim_max_sr[2][4] =
+{
+  { 7, 6, 6, 5 },   // 3200, 1600, 1600, 1000
+  { 6, 5, 4, 3 },   // 1600, 1000, 800, 400
+};
+
+
+/**************************************************************************//**
+ * This function returns the LED driven in a multi-LED time slot
+ *
+ * @param:
+ *      sim:  The model
+ *      slot: Slot number, 0 to MAX_30101_SIM_SLOTS-1
+ *
+ * @return:
+ *      Slot control code: 0 disabled, 1-3 LED1-LED3, 5-7 LED1-LED3 at the
+ *      pilot current
+ *****************************************************************************/
+static uint8_t MAX_30101_Sim_Slot (const max_30101_sim_t *sim, int slot)
+{
+  uint8_t reg = sim->regs[MAX_30101_REG_MULTI_LED_1 + slot/2];
+
+  return (slot % 2) ? ((reg >> 4) & 0x07) : (reg & 0x07);
+}
+
+
+/**************************************************************************//**
+ * This function returns the number of LED slots in a FIFO sample for the
+ * current mode
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      Active slots, 0 if the mode does not sample
+ *****************************************************************************/
+static int MAX_30101_Sim_Active_Slots (const max_30101_sim_t *sim)
+{
+  int slots = 0;
+
+  switch (sim->regs[MAX_30101_REG_MODE_CONFIG] & 0x07)
+  {
+    case 0x02:  // Heart rate, red
+      return 1;
+
+    case 0x03:  // SpO2, red and IR
+      return 2;
+
+    case 0x07:  // Multi-LED, slots are used in order up to the first disabled one
+      while ((slots < MAX_30101_SIM_SLOTS) && (MAX_30101_Sim_Slot(sim, slots) != 0))
+        slots++;
+      return slots;
+
+    default:
+      return 0;
+  }
+}
+
+
+/**************************************************************************//**
+ * This function returns the time between two FIFO samples, the sample rate
+ * of SPO2_CONFIG divided by the averaging of FIFO_CONFIG
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      Sample period in us
+ *****************************************************************************/
+uint32_t MAX_30101_Sim_Sample_Period_Us (const max_30101_sim_t *sim)
+{
+  uint32_t rate = sim_sample_rates[(sim->regs[MAX_30101_REG_SPO2_CONFIG] >> MAX_30101_SPO2_SR_SHIFT) & 0x07];
+  uint32_t smp_ave = sim->regs[MAX_30101_REG_FIFO_CONFIG] >> MAX_30101_FIFO_SMP_AVE_SHIFT;
+
+  if (smp_ave > 5)
+    smp_ave = 5;
+
+  return (1000000u << smp_ave)/rate;
+}
+
+
+/**************************************************************************//**
+ * This function returns the number of unread FIFO samples
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      Samples in the FIFO
+ *****************************************************************************/
+uint8_t MAX_30101_Sim_FIFO_Count (const max_30101_sim_t *sim)
+{
+  return sim->fifo_count;
+}
+
+
+/**************************************************************************//**
+ * This function tells whether the sample rate of SPO2_CONFIG leaves time for
+ * the LED pulse of every active slot
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      true if the data sheet allows the combination
+ *****************************************************************************/
+static bool MAX_30101_Sim_Legal_Rate (const max_30101_sim_t *sim)
+{
+  uint8_t spo2 = sim->regs[MAX_30101_REG_SPO2_CONFIG];
+  uint8_t sr = (spo2 >> MAX_30101_SPO2_SR_SHIFT) & 0x07;
+
+  return sr <= sim_max_sr[MAX_30101_Sim_Active_Slots(sim) > 1][spo2 & 0x03];
+}
+
+
+/**************************************************************************//**
+ * This function tells whether the model is sampling (not shut down, in a
+ * mode with LEDs and at a rate the pulse width allows)
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      true while samples are produced
+ *****************************************************************************/
+static bool MAX_30101_Sim_Sampling (const max_30101_sim_t *sim)
+{
+  return !(sim->regs[MAX_30101_REG_MODE_CONFIG] & MAX_30101_MODE_SHDN) &&
+         (MAX_30101_Sim_Active_Slots(sim) > 0) &&
+         MAX_30101_Sim_Legal_Rate(sim);
+}
+
+
+/**************************************************************************//**
+ * This function puts every register back to its power on value and empties
+ * the FIFO. PWR_RDY is only raised by a power up (MAX_30101_Sim_Init()), not
+ * by a soft reset.
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void MAX_30101_Sim_Reset (max_30101_sim_t *sim)
+{
+  memset(sim->regs, 0, sizeof(sim->regs));
+  sim->regs[MAX_30101_REG_REV_ID] = 0x03;
+  sim->regs[MAX_30101_REG_PART_ID] = MAX_30101_SIM_PART_ID;
+
+  sim->fifo_byte = 0;
+  sim->fifo_count = 0;
+  sim->proximity = false;
+  sim->temp_done_us = 0;
+}
+
+
+/**************************************************************************//**
+ * This function sets up the model in its power on state
+ *
+ * @param:
+ *      sim:        The model
+ *      source:     Optical signal, MAX_30101_Sim_Default_Source if NULL
+ *      source_ctx: Passed to source
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void MAX_30101_Sim_Init (max_30101_sim_t *sim, max_30101_sim_source_t source, void *source_ctx)
+{
+  memset(sim, 0, sizeof(*sim));
+
+  sim->source = source ? source : MAX_30101_Sim_Default_Source;
+  sim->source_ctx = source_ctx;
+  sim->die_temperature = 3000;
+
+  MAX_30101_Sim_Reset(sim);
+  sim->regs[MAX_30101_REG_INT_STATUS_1] = MAX_30101_INT_PWR_RDY;
+}
+
+
+/**************************************************************************//**
+ * This function takes one sample: in proximity mode it checks the threshold,
+ * otherwise it pushes a sample of every active slot into the FIFO
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void MAX_30101_Sim_Sample (max_30101_sim_t *sim)
+{
+  int slots = MAX_30101_Sim_Active_Slots(sim);
+  uint8_t fifo_config = sim->regs[MAX_30101_REG_FIFO_CONFIG];
+  uint8_t *wr_ptr = &sim->regs[MAX_30101_REG_FIFO_WR_PTR];
+  uint8_t *rd_ptr = &sim->regs[MAX_30101_REG_FIFO_RD_PTR];
+  uint8_t *ovf = &sim->regs[MAX_30101_REG_OVF_COUNTER];
+  uint32_t lsb_mask = (1u << (3 - (sim->regs[MAX_30101_REG_SPO2_CONFIG] & 0x03))) - 1;
+
+  if (sim->proximity)
+  {
+      uint32_t value = sim->source(sim->source_ctx, 0, sim->now_us, sim->regs[MAX_30101_REG_PILOT_PA]);
+
+      if ((value >> 10) > sim->regs[MAX_30101_REG_PROX_INT_THRESH])
+      {
+          sim->proximity = false;
+          sim->regs[MAX_30101_REG_INT_STATUS_1] |= MAX_30101_INT_PROX;
+      }
+      return;
+  }
+
+  if (sim->fifo_count == MAX_30101_FIFO_DEPTH)
+  {
+      if (*ovf < MAX_30101_OVF_COUNTER_MAX)
+        (*ovf)++;
+      sim->samples_lost++;
+
+      if (!(fifo_config & MAX_30101_FIFO_ROLLOVER_EN))
+        return;
+
+      // Roll over: the oldest sample makes room for the new one
+      *rd_ptr = (*rd_ptr + 1) & (MAX_30101_FIFO_DEPTH - 1);
+      sim->fifo_byte = 0;
+      sim->fifo_count--;
+  }
+
+  for (int slot = 0; slot < slots; slot++)
+  {
+      // HR and SpO2 modes drive red then IR, multi-LED mode follows the slots
+      uint8_t code = ((sim->regs[MAX_30101_REG_MODE_CONFIG] & 0x07) == 0x07) ? MAX_30101_Sim_Slot(sim, slot) :
+                                                                               (uint8_t)(slot + 1);
+      uint8_t led = (code - 1) & 0x03;
+      uint8_t pa = (code & 0x04) ? sim->regs[MAX_30101_REG_PILOT_PA] : sim->regs[MAX_30101_REG_LED1_PA + led];
+      uint32_t value = sim->source(sim->source_ctx, led, sim->now_us, pa);
+
+      if (value > MAX_30101_ADC_FULL_SCALE)
+        value = MAX_30101_ADC_FULL_SCALE;
+
+      // Left justified, the low bits are zero below 18 bit resolution
+      value &= ~lsb_mask;
+
+      sim->fifo[*wr_ptr][slot*MAX_30101_BYTES_PER_LED + 0] = (uint8_t)(value >> 16);
+      sim->fifo[*wr_ptr][slot*MAX_30101_BYTES_PER_LED + 1] = (uint8_t)(value >> 8);
+      sim->fifo[*wr_ptr][slot*MAX_30101_BYTES_PER_LED + 2] = (uint8_t)(value >> 0);
+  }
+
+  *wr_ptr = (*wr_ptr + 1) & (MAX_30101_FIFO_DEPTH - 1);
+  sim->fifo_count++;
+  sim->samples_pushed++;
+
+  sim->regs[MAX_30101_REG_INT_STATUS_1] |= MAX_30101_INT_PPG_RDY;
+
+  // Raised again after every push while the FIFO is above the watermark
+  if (sim->fifo_count >= MAX_30101_FIFO_DEPTH - (fifo_config & MAX_30101_FIFO_A_FULL_MASK))
+    sim->regs[MAX_30101_REG_INT_STATUS_1] |= MAX_30101_INT_A_FULL;
+}
+
+
+/**************************************************************************//**
+ * This function writes one register
+ *
+ * @param:
+ *      sim:   The model
+ *      reg:   The register
+ *      value: The value written
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void MAX_30101_Sim_Write_Reg (max_30101_sim_t *sim, uint8_t reg, uint8_t value)
+{
+  switch (reg)
+  {
+    case MAX_30101_REG_INT_STATUS_1:
+    case MAX_30101_REG_INT_STATUS_2:
+    case MAX_30101_REG_FIFO_DATA:
+    case MAX_30101_REG_DIE_TINT:
+    case MAX_30101_REG_DIE_TFRAC:
+    case MAX_30101_REG_REV_ID:
+    case MAX_30101_REG_PART_ID:
+      break;  // Read only
+
+    case MAX_30101_REG_FIFO_WR_PTR:
+    case MAX_30101_REG_FIFO_RD_PTR:
+    case MAX_30101_REG_OVF_COUNTER:
+      sim->regs[reg] = value & 0x1F;
+      sim->fifo_byte = 0;
+      sim->fifo_count = (sim->regs[MAX_30101_REG_FIFO_WR_PTR] - sim->regs[MAX_30101_REG_FIFO_RD_PTR]) &
+                        (MAX_30101_FIFO_DEPTH - 1);
+      break;
+
+    case MAX_30101_REG_MODE_CONFIG:
+      if (value & MAX_30101_MODE_RESET)
+      {
+          // Completes at once, the RESET bit reads back as 0
+          MAX_30101_Sim_Reset(sim);
+          break;
+      }
+
+      sim->regs[reg] = value;
+
+      if (MAX_30101_Sim_Sampling(sim))
+      {
+          sim->proximity = (sim->regs[MAX_30101_REG_INT_ENABLE_1] & MAX_30101_INT_PROX) != 0;
+          sim->next_sample_us = sim->now_us + MAX_30101_Sim_Sample_Period_Us(sim);
+      }
+      break;
+
+    case MAX_30101_REG_FIFO_CONFIG:
+    case MAX_30101_REG_SPO2_CONFIG:
+      // A new rate or averaging restarts the sample timing
+      sim->regs[reg] = value;
+      sim->next_sample_us = sim->now_us + MAX_30101_Sim_Sample_Period_Us(sim);
+      break;
+
+    case MAX_30101_REG_DIE_TEMP_CONFIG:
+      sim->regs[reg] = value & MAX_30101_TEMP_EN;
+      if (value & MAX_30101_TEMP_EN)
+        sim->temp_done_us = sim->now_us + MAX_30101_SIM_TEMP_US;
+      break;
+
+    default:
+      sim->regs[reg] = value;
+      break;
+  }
+
+  // The data sheet leaves an illegal rate undefined, the model stops sampling
+  if (((reg == MAX_30101_REG_MODE_CONFIG) || (reg == MAX_30101_REG_SPO2_CONFIG)) &&
+      !(sim->regs[MAX_30101_REG_MODE_CONFIG] & MAX_30101_MODE_SHDN) &&
+      (MAX_30101_Sim_Active_Slots(sim) > 0) && !MAX_30101_Sim_Legal_Rate(sim))
+    sim->illegal_configs++;
+}
+
+
+/**************************************************************************//**
+ * This function reads one register, with the read side effects (status
+ * registers clear, FIFO_DATA pops)
+ *
+ * @param:
+ *      sim: The model
+ *      reg: The register
+ *
+ * @return:
+ *      The register value
+ *****************************************************************************/
+static uint8_t MAX_30101_Sim_Read_Reg (max_30101_sim_t *sim, uint8_t reg)
+{
+  uint8_t value = sim->regs[reg];
+  int bytes_per_sample = MAX_30101_Sim_Active_Slots(sim)*MAX_30101_BYTES_PER_LED;
+
+  switch (reg)
+  {
+    case MAX_30101_REG_INT_STATUS_1:
+    case MAX_30101_REG_INT_STATUS_2:
+      sim->regs[reg] = 0;
+      break;
+
+    case MAX_30101_REG_FIFO_DATA:
+      sim->regs[MAX_30101_REG_INT_STATUS_1] &= ~MAX_30101_INT_A_FULL;
+
+      if ((sim->fifo_count == 0) || (bytes_per_sample == 0))
+        return 0;
+
+      value = sim->fifo[sim->regs[MAX_30101_REG_FIFO_RD_PTR]][sim->fifo_byte++];
+
+      if (sim->fifo_byte == bytes_per_sample)
+      {
+          sim->fifo_byte = 0;
+          sim->fifo_count--;
+          sim->regs[MAX_30101_REG_FIFO_RD_PTR] = (sim->regs[MAX_30101_REG_FIFO_RD_PTR] + 1) & (MAX_30101_FIFO_DEPTH - 1);
+          sim->regs[MAX_30101_REG_OVF_COUNTER] = 0;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  return value;
+}
+
+
+/**************************************************************************//**
+ * This function is an I2C write transaction: the register address followed
+ * by the data, the register pointer auto increments except on FIFO_DATA
+ *
+ * @param:
+ *      sim:               The model
+ *      reg:               The register to start writing to
+ *      write_data:        Data to write
+ *      nbytes_write_data: Number of bytes to write
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void MAX_30101_Sim_Write (max_30101_sim_t *sim, uint8_t reg, const uint8_t *write_data, size_t nbytes_write_data)
+{
+  sim->transactions++;
+  sim->bytes += nbytes_write_data + 1;
+
+  for (size_t i = 0; i < nbytes_write_data; i++)
+  {
+      MAX_30101_Sim_Write_Reg(sim, reg, write_data[i]);
+      if (reg != MAX_30101_REG_FIFO_DATA)
+        reg++;
+  }
+}
+
+
+/**************************************************************************//**
+ * This function is an I2C write-read transaction: the register address
+ * followed by a repeated start and the data, the register pointer auto
+ * increments except on FIFO_DATA
+ *
+ * @param:
+ *      sim:              The model
+ *      reg:              The register to start reading from
+ *      read_data:        Buffer for the data
+ *      nbytes_read_data: Number of bytes to read
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void MAX_30101_Sim_Read (max_30101_sim_t *sim, uint8_t reg, uint8_t *read_data, size_t nbytes_read_data)
+{
+  sim->transactions++;
+  sim->bytes += nbytes_read_data + 1;
+
+  for (size_t i = 0; i < nbytes_read_data; i++)
+  {
+      read_data[i] = MAX_30101_Sim_Read_Reg(sim, reg);
+      if (reg != MAX_30101_REG_FIFO_DATA)
+        reg++;
+  }
+}
+
+
+/**************************************************************************//**
+ * This function returns the model time of the next internal event (sample
+ * or end of a temperature conversion)
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      Time in us, UINT64_MAX if nothing is pending
+ *****************************************************************************/
+uint64_t MAX_30101_Sim_Next_Event (const max_30101_sim_t *sim)
+{
+  uint64_t next = UINT64_MAX;
+
+  if (MAX_30101_Sim_Sampling(sim))
+    next = sim->next_sample_us;
+
+  if (sim->temp_done_us && (sim->temp_done_us < next))
+    next = sim->temp_done_us;
+
+  return next;
+}
+
+
+/**************************************************************************//**
+ * This function moves the model time forward, taking every sample and
+ * finishing every conversion that falls in the interval
+ *
+ * @param:
+ *      sim: The model
+ *      us:  Time to advance
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void MAX_30101_Sim_Advance (max_30101_sim_t *sim, uint64_t us)
+{
+  uint64_t end = sim->now_us + us;
+  uint64_t next;
+
+  while ((next = MAX_30101_Sim_Next_Event(sim)) <= end)
+  {
+      sim->now_us = next;
+
+      if (sim->temp_done_us == next)
+      {
+          int32_t temp = sim->die_temperature;
+          int32_t tint = (temp >= 0) ? temp/100 : -((-temp + 99)/100);
+
+          sim->regs[MAX_30101_REG_DIE_TINT] = (uint8_t)(int8_t)tint;
+          sim->regs[MAX_30101_REG_DIE_TFRAC] = (uint8_t)(((temp - tint*100)*16)/100) & 0x0F;
+          sim->regs[MAX_30101_REG_DIE_TEMP_CONFIG] = 0;
+          sim->regs[MAX_30101_REG_INT_STATUS_2] |= MAX_30101_INT_DIE_TEMP_RDY;
+          sim->temp_done_us = 0;
+      }
+
+      if (MAX_30101_Sim_Sampling(sim) && (sim->next_sample_us == next))
+      {
+          MAX_30101_Sim_Sample(sim);
+          sim->next_sample_us += MAX_30101_Sim_Sample_Period_Us(sim);
+      }
+  }
+
+  sim->now_us = end;
+}
+
+
+/**************************************************************************//**
+ * This function tells whether the (active low, open drain) INT pin is pulled
+ * down
+ *
+ * @param:
+ *      sim: The model
+ *
+ * @return:
+ *      true while an enabled interrupt is pending
+ *****************************************************************************/
+bool MAX_30101_Sim_Int_Asserted (const max_30101_sim_t *sim)
+{
+  return (sim->regs[MAX_30101_REG_INT_STATUS_1] & (sim->regs[MAX_30101_REG_INT_ENABLE_1] | MAX_30101_INT_PWR_RDY)) ||
+         (sim->regs[MAX_30101_REG_INT_STATUS_2] & sim->regs[MAX_30101_REG_INT_ENABLE_1 + 1]);
+}
+
+
+/**************************************************************************//**
+ * This function is a minimal finger on the sensor: a DC level proportional
+ * to the LED current with a pulse of 2 % on top
+ *
+ * @param:
+ *      ctx:  Pulse rate in bpm (const uint32_t *), NULL for 72 bpm
+ *      led:  LED being sampled
+ *      t_us: Sample time
+ *      pa:   LEDx_PA of the LED
+ *
+ * @return:
+ *      18 bit ADC count
+ *****************************************************************************/
+uint32_t MAX_30101_Sim_Default_Source (void *ctx, uint8_t led, uint64_t t_us, uint8_t pa)
+{
+  double bpm = ctx ? *(const uint32_t *)ctx : 72;
+  double t = t_us*1e-6, beat = 2*MAX_30101_SIM_PI*(bpm/60.0)*t;
+  double dc = 2400.0*pa;
+  double pulse = sin(beat) + 0.3*sin(2*beat);
+  double value = dc*(1.0 + 0.02*pulse);
+
+  (void)led;
+
+  if (value < 0)
+    value = 0;
+  if (value > MAX_30101_ADC_FULL_SCALE)
+    value = MAX_30101_ADC_FULL_SCALE;
+
+  return (uint32_t)value;
+}
+
+
+/**************************************************************************//**
+ * This function returns the time a register transfer keeps the bus busy:
+ * start, address, register, (repeated start and address for a read), the
+ * data and stop, 9 clocks per byte
+ *
+ * @param:
+ *      bus_hz: SCL frequency
+ *      write:  true for a write, false for a read
+ *      len:    Data bytes
+ *
+ * @return:
+ *      Duration in us, 0 if bus_hz is 0
+ *****************************************************************************/
+uint32_t MAX_30101_Sim_Transfer_Us (uint32_t bus_hz, bool write, size_t len)
+{
+  uint32_t bits = 9*(2 + (write ? 0 : 1) + len) + (write ? 2 : 3);
+
+  if (bus_hz == 0)
+    return 0;
+
+  return (uint32_t)(((uint64_t)bits*1000000 + bus_hz - 1)/bus_hz);
+}
+
+
+/**************************************************************************//**
+ * Sensor bus backend on the model
+ *
+ * Transfers complete at once (the interrupt driven ones before the start
+ * returns), the model time moves on by the time the transfer takes on the
+ * bus. The address is not checked, the model is the only device.
+ *
+ * An injected fault fails the transfer without touching the registers. A
+ * NACK ends after the address and a bus error after the register address.
+ * Against a stuck SDA the controller doesn't get to send anything, no time
+ * passes.
+ *****************************************************************************/
+static sensor_bus_status_t MAX_30101_Sim_Bus_Transfer (void *ctx, uint8_t addr, bool write, uint8_t reg, uint8_t *data, size_t len)
+{
+  max_30101_sim_t *sim = ctx;
+
+  (void)addr;
+
+  if (sim->fault_count)
+  {
+      sim->fault_count--;
+      sim->faults++;
+
+      switch (sim->fault)
+      {
+        case MAX_30101_SIM_FAULT_NACK:
+          MAX_30101_Sim_Advance(sim, MAX_30101_Sim_Transfer_Us(sim->bus_hz, true, 0)/2);
+          return SENSOR_BUS_NACK;
+
+        case MAX_30101_SIM_FAULT_BUS_ERROR:
+          MAX_30101_Sim_Advance(sim, MAX_30101_Sim_Transfer_Us(sim->bus_hz, true, 0));
+          return SENSOR_BUS_ERROR;
+
+        default:
+          return SENSOR_BUS_ERROR;
+      }
+  }
+
+  if (write)
+    MAX_30101_Sim_Write(sim, reg, data, len);
+  else
+    MAX_30101_Sim_Read(sim, reg, data, len);
+
+  MAX_30101_Sim_Advance(sim, MAX_30101_Sim_Transfer_Us(sim->bus_hz, write, len));
+
+  return SENSOR_BUS_OK;
+}
+
+static uint64_t MAX_30101_Sim_Bus_Now (void *ctx)
+{
+  return ((max_30101_sim_t *)ctx)->now_us;
+}
+
+static const sensor_bus_ops_t max_30101_sim_bus_ops =
+{
+  .transfer = MAX_30101_Sim_Bus_Transfer,
+  .start = MAX_30101_Sim_Bus_Transfer,
+  .abort = NULL,
+  .now_us = MAX_30101_Sim_Bus_Now,
+};
+
+
+/**************************************************************************//**
+ * This function sets a bus up on the model
+ *
+ * @param:
+ *      bus:    The bus
+ *      sim:    The model, must outlive the bus
+ *      bus_hz: SCL frequency the transfers are timed at, 0 for none
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void MAX_30101_Sim_Bus_Init (sensor_bus_t *bus, max_30101_sim_t *sim, uint32_t bus_hz)
+{
+  memset(bus, 0, sizeof(*bus));
+
+  sim->bus_hz = bus_hz;
+
+  bus->name = "max30101-sim";
+  bus->ops = &max_30101_sim_bus_ops;
+  bus->ctx = sim;
+}
+
+
+/**************************************************************************//**
+ * This function makes the next transfers on the sim bus fail
+ *
+ * @param:
+ *      sim:   The model
+ *      fault: How they fail, MAX_30101_SIM_FAULT_NONE to clear
+ *      count: Number of transfers, from the next one on
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void MAX_30101_Sim_Inject_Fault (max_30101_sim_t *sim, max_30101_sim_fault_t fault, uint32_t count)
+{
+  sim->fault = fault;
+  sim->fault_count = (fault == MAX_30101_SIM_FAULT_NONE) ? 0 : count;
+}
+
+
+#ifdef TESTING
+
+#include <stdio.h>
+#include <assert.h>
+
+/**************************************************************************//**
+ * Drains the model the way state_machine_hr does: status burst, then one
+ * FIFO burst. Returns the samples read.
+ *****************************************************************************/
+static int drain (max_30101_sim_t *sim, uint32_t *lost)
+{
+  uint8_t status[MAX_30101_FIFO_STATUS_LEN];
+  uint8_t data[MAX_30101_FIFO_DEPTH*MAX_30101_BYTES_PER_LED];
+  int n;
+
+  MAX_30101_Sim_Read(sim, MAX_30101_REG_INT_STATUS_1, status, sizeof(status));
+
+  n = (status[MAX_30101_REG_FIFO_WR_PTR] - status[MAX_30101_REG_FIFO_RD_PTR]) & (MAX_30101_FIFO_DEPTH - 1);
+  if (status[MAX_30101_REG_OVF_COUNTER])
+    n = MAX_30101_FIFO_DEPTH;
+  *lost += status[MAX_30101_REG_OVF_COUNTER];
+
+  MAX_30101_Sim_Read(sim, MAX_30101_REG_FIFO_DATA, data, n*MAX_30101_BYTES_PER_LED);
+
+  return n;
+}
+
+static sensor_bus_t bus;
+static sensor_dev_t dev = { &bus, 0x57 };
+static uint8_t bus_status[MAX_30101_FIFO_STATUS_LEN];
+static int completions;
+
+/**************************************************************************//**
+ * Bus completion that starts a second transfer, as the driver queue does
+ *****************************************************************************/
+static void chain (sensor_bus_status_t status)
+{
+  assert(status == SENSOR_BUS_OK);
+  if (++completions == 1)
+    Sensor_Bus_Start_Read(&dev, MAX_30101_REG_INT_STATUS_1, bus_status, sizeof(bus_status), chain);
+}
+
+int main()
+{
+  max_30101_sim_t sim;
+  uint32_t drained = 0, lost = 0, wakeups = 0;
+  uint8_t cfg;
+
+  MAX_30101_Sim_Init(&sim, NULL, NULL);
+
+  // Same values as the default driver configuration
+  uint8_t int_en = MAX_30101_INT_A_FULL;
+  uint8_t leds[] = { 0x4F, 0x00, 0x00 };
+  uint8_t fifo_mode_spo2[] = { 0x51, MAX_30101_MODE_HR, 0x1A };
+
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_INT_ENABLE_1, &int_en, 1);
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_LED1_PA, leds, sizeof(leds));
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_FIFO_CONFIG, fifo_mode_spo2, sizeof(fifo_mode_spo2));
+
+  assert(MAX_30101_Sim_Sample_Period_Us(&sim) == 2500);
+
+  // Clears PWR_RDY
+  MAX_30101_Sim_Read(&sim, MAX_30101_REG_INT_STATUS_1, &cfg, 1);
+
+  // 10 s, drained as soon as INT is asserted
+  for (int ms = 0; ms < 10000; ms++)
+  {
+      MAX_30101_Sim_Advance(&sim, 1000);
+      if (MAX_30101_Sim_Int_Asserted(&sim))
+      {
+          drained += drain(&sim, &lost);
+          wakeups++;
+      }
+  }
+  printf("Drained %u of %u samples, %u lost, %u wakeups/min\n", drained, sim.samples_pushed, lost, wakeups*6);
+  assert(sim.samples_pushed == 4000);
+  assert(lost == 0 && sim.samples_lost == 0);
+  assert(drained + MAX_30101_Sim_FIFO_Count(&sim) == sim.samples_pushed);
+
+  // Late drain: 200 ms without reading, everything past 32 samples is lost
+  uint32_t pushed = sim.samples_pushed;
+  uint8_t backlog = MAX_30101_Sim_FIFO_Count(&sim);
+  MAX_30101_Sim_Advance(&sim, 200000);
+  drained += drain(&sim, &lost);
+  printf("Late drain: %u lost, OVF_COUNTER reported %u\n", sim.samples_lost, lost);
+  assert(sim.samples_lost == backlog + (sim.samples_pushed - pushed) - MAX_30101_FIFO_DEPTH);
+  // OVF_COUNTER saturates, longer gaps need the timestamps to be measured
+  assert(lost == ((sim.samples_lost > MAX_30101_OVF_COUNTER_MAX) ? MAX_30101_OVF_COUNTER_MAX : sim.samples_lost));
+  assert(MAX_30101_Sim_FIFO_Count(&sim) == 0);
+
+  // Die temperature
+  cfg = MAX_30101_TEMP_EN;
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_DIE_TEMP_CONFIG, &cfg, 1);
+  MAX_30101_Sim_Advance(&sim, MAX_30101_SIM_TEMP_US);
+  uint8_t temp[2];
+  MAX_30101_Sim_Read(&sim, MAX_30101_REG_DIE_TINT, temp, 2);
+  assert(temp[0] == 30 && temp[1] == 0);
+
+  // Shutdown stops the FIFO, reset clears the registers
+  cfg = MAX_30101_MODE_SHDN | MAX_30101_MODE_HR;
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_MODE_CONFIG, &cfg, 1);
+  pushed = sim.samples_pushed;
+  MAX_30101_Sim_Advance(&sim, 100000);
+  assert(sim.samples_pushed == pushed);
+
+  cfg = MAX_30101_MODE_RESET;
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_MODE_CONFIG, &cfg, 1);
+  MAX_30101_Sim_Read(&sim, MAX_30101_REG_LED1_PA, &cfg, 1);
+  assert(cfg == 0);
+  assert(!MAX_30101_Sim_Int_Asserted(&sim));
+
+  // Proximity: nothing is sampled until the pilot reading crosses the threshold
+  uint8_t prox[] = { 0x0A, 0x11, 0x00 };
+  int_en = MAX_30101_INT_A_FULL | MAX_30101_INT_PROX;
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_INT_ENABLE_1, &int_en, 1);
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_LED1_PA, leds, sizeof(leds));
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_PILOT_PA, prox, sizeof(prox));
+  cfg = 0x10;
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_PROX_INT_THRESH, &cfg, 1);
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_FIFO_CONFIG, fifo_mode_spo2, sizeof(fifo_mode_spo2));
+  pushed = sim.samples_pushed;
+  MAX_30101_Sim_Advance(&sim, 2500);
+  assert(sim.samples_pushed == pushed);
+  MAX_30101_Sim_Read(&sim, MAX_30101_REG_INT_STATUS_1, &cfg, 1);
+  assert(cfg & MAX_30101_INT_PROX);
+  MAX_30101_Sim_Advance(&sim, 2500);
+  assert(sim.samples_pushed == pushed + 1);
+
+  // 1600 samples/s with a 411 us pulse is not allowed, 1000 samples/s is
+  cfg = (MAX_30101_SR_1600 << MAX_30101_SPO2_SR_SHIFT) | MAX_30101_PW_411US;
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_SPO2_CONFIG, &cfg, 1);
+  assert(sim.illegal_configs == 1);
+  pushed = sim.samples_pushed;
+  MAX_30101_Sim_Advance(&sim, 100000);
+  assert(sim.samples_pushed == pushed);
+  cfg = (MAX_30101_SR_1000 << MAX_30101_SPO2_SR_SHIFT) | MAX_30101_PW_411US;
+  MAX_30101_Sim_Write(&sim, MAX_30101_REG_SPO2_CONFIG, &cfg, 1);
+  MAX_30101_Sim_Advance(&sim, 4000);
+  assert(sim.illegal_configs == 1 && sim.samples_pushed == pushed + 1);
+
+  // Through the bus layer: blocking and chained interrupt driven transfers
+  uint8_t part_id;
+
+  MAX_30101_Sim_Bus_Init(&bus, &sim, 100000);
+  assert(Sensor_Bus_Read(&dev, MAX_30101_REG_PART_ID, &part_id, 1) == SENSOR_BUS_OK);
+  assert(part_id == MAX_30101_SIM_PART_ID);
+  assert(Sensor_Bus_Start_Read(&dev, MAX_30101_REG_INT_STATUS_1, bus_status, sizeof(bus_status), chain) == SENSOR_BUS_IN_PROGRESS);
+  assert(completions == 2 && !bus.busy);
+  assert(bus.stats.transactions == 3 && bus.stats.bytes == 1 + 2*MAX_30101_FIFO_STATUS_LEN);
+  printf("Bus: %u transactions, %u bytes, %u us at 100 kHz\n", bus.stats.transactions, bus.stats.bytes, (unsigned)bus.stats.busy_us);
+
+  // Injected faults: the transfers fail and the register keeps its value,
+  // a stuck SDA fails them without any time on the bus
+  uint8_t pa = sim.regs[MAX_30101_REG_LED1_PA] ^ 0xFF, pa_read = 0;
+  uint32_t nacks = bus.stats.nacks, errors = bus.stats.errors;
+  uint64_t t_us = sim.now_us;
+
+  MAX_30101_Sim_Inject_Fault(&sim, MAX_30101_SIM_FAULT_NACK, 1);
+  assert(Sensor_Bus_Write(&dev, MAX_30101_REG_LED1_PA, &pa, 1) == SENSOR_BUS_NACK && sim.now_us > t_us);
+  assert(Sensor_Bus_Read(&dev, MAX_30101_REG_LED1_PA, &pa_read, 1) == SENSOR_BUS_OK && pa_read != pa);
+
+  MAX_30101_Sim_Inject_Fault(&sim, MAX_30101_SIM_FAULT_BUS_ERROR, 2);
+  assert(Sensor_Bus_Write(&dev, MAX_30101_REG_LED1_PA, &pa, 1) == SENSOR_BUS_ERROR);
+  assert(Sensor_Bus_Start_Write(&dev, MAX_30101_REG_LED1_PA, &pa, 1, chain) == SENSOR_BUS_ERROR && !bus.busy);
+
+  MAX_30101_Sim_Inject_Fault(&sim, MAX_30101_SIM_FAULT_STUCK_SDA, 3);
+  t_us = sim.now_us;
+  for (int i = 0; i < 3; i++)
+    assert(Sensor_Bus_Write(&dev, MAX_30101_REG_LED1_PA, &pa, 1) == SENSOR_BUS_ERROR);
+  assert(sim.now_us == t_us && sim.regs[MAX_30101_REG_LED1_PA] != pa);
+
+  assert(Sensor_Bus_Write(&dev, MAX_30101_REG_LED1_PA, &pa, 1) == SENSOR_BUS_OK && sim.regs[MAX_30101_REG_LED1_PA] == pa);
+  assert(sim.faults == 6 && bus.stats.nacks == nacks + 1 && bus.stats.errors == errors + 5);
+  printf("Faults: %u injected, %u NACKs, %u bus errors\n", sim.faults, bus.stats.nacks - nacks, bus.stats.errors - errors);
+
+  // Replay: the recorded answer comes back, a different transaction fails
+  static const uint8_t part[] = { MAX_30101_SIM_PART_ID };
+  static const sensor_bus_record_t trace[] = { { 0x57, false, MAX_30101_REG_PART_ID, 1, part, SENSOR_BUS_OK } };
+  sensor_bus_replay_t replay;
+
+  Sensor_Bus_Replay_Init(&bus, &replay, trace, 1);
+  part_id = 0;
+  assert(Sensor_Bus_Read(&dev, MAX_30101_REG_PART_ID, &part_id, 1) == SENSOR_BUS_OK && part_id == MAX_30101_SIM_PART_ID);
+  assert(Sensor_Bus_Read(&dev, MAX_30101_REG_PART_ID, &part_id, 1) == SENSOR_BUS_ERROR && replay.mismatches == 1);
+
+  printf("MAX30101 model OK\n");
+
+  return 0;
+}
+
+#endif
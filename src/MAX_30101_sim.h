@@ -0,0 +1,90 @@
+/*
+ * MAX_30101_sim.h
+ *
+ *  Behavioural model of the MAX30101 for running the acquisition path on a
+ *  host, without a board.
+ *
+ */
+
+#ifndef SRC_MAX_30101_SIM_H_
+#define SRC_MAX_30101_SIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "MAX_30101.h"
+#include "sensor_bus.h"
+
+#define MAX_30101_SIM_NUM_REGS      256
+#define MAX_30101_SIM_SLOTS         4     // Multi-LED mode time slots
+#define MAX_30101_SIM_TEMP_US       29000 // Die temperature conversion time
+#define MAX_30101_SIM_PART_ID       0x15
+
+#define MAX_30101_REG_REV_ID        0xFE
+#define MAX_30101_REG_PART_ID       0xFF
+
+#define MAX_30101_INT_PPG_RDY       0x40
+#define MAX_30101_INT_PWR_RDY       0x01
+
+// Optical signal seen by the photodiode: returns the 18 bit ADC count of
+// LED led (0 red, 1 IR, 2 green) at time t_us with LEDx_PA = pa.
+// PPG_Synth_Source() (ppg_synth.h) is a realistic finger.
+typedef uint32_t (*max_30101_sim_source_t) (void *ctx, uint8_t led, uint64_t t_us, uint8_t pa);
+
+// Faults of the sim bus, for the error paths of the drivers. The registers
+// are not touched by a failed transfer.
+typedef enum
+{
+  MAX_30101_SIM_FAULT_NONE = 0,
+  MAX_30101_SIM_FAULT_NACK,             // Address not acknowledged
+  MAX_30101_SIM_FAULT_BUS_ERROR,        // Misplaced START/STOP after the register address
+  MAX_30101_SIM_FAULT_STUCK_SDA,        // SDA held low: the transfer fails before it starts
+} max_30101_sim_fault_t;
+
+typedef struct
+{
+  uint8_t regs[MAX_30101_SIM_NUM_REGS];
+
+  // FIFO, one entry per sample, 3 bytes per active slot
+  uint8_t fifo[MAX_30101_FIFO_DEPTH][MAX_30101_SIM_SLOTS*MAX_30101_BYTES_PER_LED];
+  uint8_t fifo_byte;              // Bytes of the oldest sample already clocked out
+  uint8_t fifo_count;             // Unread samples (the pointers alone can't tell full from empty)
+
+  bool proximity;                 // Waiting for the proximity threshold
+
+  uint64_t now_us;                // Model time
+  uint64_t next_sample_us;        // Time of the next FIFO push
+  uint64_t temp_done_us;          // End of the die temperature conversion, 0 if none
+  int32_t die_temperature;        // Temperature reported by the next conversion, 0.01 C
+
+  uint32_t bus_hz;                // SCL frequency transfers on the sim bus take time at, 0 for none
+  max_30101_sim_fault_t fault;    // Injected into the next transfers on the sim bus
+  uint32_t fault_count;           // Transfers left to fail
+
+  max_30101_sim_source_t source;
+  void *source_ctx;
+
+  // Statistics
+  uint32_t samples_pushed;
+  uint32_t samples_lost;
+  uint32_t illegal_configs;       // MODE_CONFIG / SPO2_CONFIG writes leaving a rate the pulse width doesn't allow
+  uint32_t transactions;
+  uint32_t bytes;
+  uint32_t faults;                // Transfers failed by an injected fault
+} max_30101_sim_t;
+
+void MAX_30101_Sim_Init (max_30101_sim_t *sim, max_30101_sim_source_t source, void *source_ctx);
+void MAX_30101_Sim_Write (max_30101_sim_t *sim, uint8_t reg, const uint8_t *write_data, size_t nbytes_write_data);
+void MAX_30101_Sim_Read (max_30101_sim_t *sim, uint8_t reg, uint8_t *read_data, size_t nbytes_read_data);
+void MAX_30101_Sim_Advance (max_30101_sim_t *sim, uint64_t us);
+uint64_t MAX_30101_Sim_Next_Event (const max_30101_sim_t *sim);
+bool MAX_30101_Sim_Int_Asserted (const max_30101_sim_t *sim);
+uint32_t MAX_30101_Sim_Sample_Period_Us (const max_30101_sim_t *sim);
+uint8_t MAX_30101_Sim_FIFO_Count (const max_30101_sim_t *sim);
+uint32_t MAX_30101_Sim_Default_Source (void *ctx, uint8_t led, uint64_t t_us, uint8_t pa);
+void MAX_30101_Sim_Bus_Init (sensor_bus_t *bus, max_30101_sim_t *sim, uint32_t bus_hz);
+void MAX_30101_Sim_Inject_Fault (max_30101_sim_t *sim, max_30101_sim_fault_t fault, uint32_t count);
+uint32_t MAX_30101_Sim_Transfer_Us (uint32_t bus_hz, bool write, size_t len);
+
+#endif /* SRC_MAX_30101_SIM_H_ */
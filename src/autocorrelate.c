@@ -18,11 +18,60 @@
 
 
 /*
- * See documentation in .h file
+ * Scaling of the 18 bit format, measured from the buffer before the
+ * autocorrelation runs (see ac_scale_18bps())
  */
-int
-autocorrelate_detect_period(void *samples, uint32_t nsamp,
-    autocorrelate_sample_format_t format)
+typedef struct {
+  int32_t offset;         // mean of the buffer, subtracted from every sample
+  uint32_t pre_shift;     // applied to the centred sample so a product fits in 32 bits
+  uint32_t post_shift;    // applied to every product so nsamp of them fit in 31 bits
+} ac_scale_t;
+
+
+/*
+ * Mean-removal pre-pass for kAC_18bps_unsigned. One pass over the buffer
+ * gives the mean and the extremes, and from the largest deviation from
+ * the mean the shifts are chosen so that |sum| < 2^30 for every lag. The
+ * 32 bit accumulator can then never overflow, and neither can the
+ * difference of two sums in the peak search.
+ */
+static void
+ac_scale_18bps(const uint32_t *samples, uint32_t nsamp, ac_scale_t *scale)
+{
+  uint32_t sum = 0, min = UINT32_MAX, max = 0, peak, amp_bits, nsamp_bits;
+
+  for (uint32_t k=0; k < nsamp; k++) {
+    uint32_t x = samples[k] & AUTOCORRELATE_18BPS_MASK;
+    sum += x;
+    if (x < min)
+      min = x;
+    if (x > max)
+      max = x;
+  }
+
+  scale->offset = (int32_t)(sum / nsamp);
+  peak = ((uint32_t)scale->offset - min > max - (uint32_t)scale->offset) ?
+      (uint32_t)scale->offset - min : max - (uint32_t)scale->offset;
+
+  // |centred sample| < 2^amp_bits, kept at 15 bits so a product fits in 30
+  amp_bits = (peak == 0) ? 0 : 32 - __builtin_clz(peak);
+  scale->pre_shift = (amp_bits > 15) ? amp_bits - 15 : 0;
+  amp_bits -= scale->pre_shift;
+
+  // nsamp products of up to 2^(2*amp_bits) must stay below 2^30
+  nsamp_bits = (nsamp <= 1) ? 0 : 32 - __builtin_clz(nsamp - 1);
+  scale->post_shift = (2*amp_bits + nsamp_bits > 30) ? 2*amp_bits + nsamp_bits - 30 : 0;
+}
+
+
+/*
+ * Reference implementation: one full pass over the buffer per lag. Kept
+ * in its original form (plus the 18 bit case) so the blocked kernel
+ * below can be checked against it.
+ */
+static int
+autocorrelate_detect_period_reference(void *samples, uint32_t nsamp,
+    autocorrelate_sample_format_t format, const ac_scale_t *scale)
 {
   int32_t sum = 0;
   int prev_sum = 0;
@@ -65,6 +114,12 @@ autocorrelate_detect_period(void *samples, uint32_t nsamp,
         s2 = (int32_t)*((uint32_t*)samples + k+i) - (1 << 31);
         sum += (s1 * s2);
         break;
+
+      case kAC_18bps_unsigned:
+        s1 = ((int32_t)(*((uint32_t*)samples + k) & AUTOCORRELATE_18BPS_MASK) - scale->offset) >> scale->pre_shift;
+        s2 = ((int32_t)(*((uint32_t*)samples + k+i) & AUTOCORRELATE_18BPS_MASK) - scale->offset) >> scale->pre_shift;
+        sum += (s1 * s2) >> scale->post_shift;
+        break;
       }
     }
     
@@ -88,6 +143,224 @@ autocorrelate_detect_period(void *samples, uint32_t nsamp,
 }
 
 
+/*
+ * Fetch sample idx, centred the same way the reference path does
+ */
+static inline __attribute__((always_inline)) int32_t
+ac_sample(const void *samples, uint32_t idx,
+    autocorrelate_sample_format_t format, const ac_scale_t *scale)
+{
+  switch (format) {
+  case kAC_12bps_unsigned:
+    return (int32_t)*((const uint16_t*)samples + idx) - (1 << 11);
+  case kAC_16bps_unsigned:
+    return (int32_t)*((const uint16_t*)samples + idx) - (1 << 15);
+  case kAC_12bps_signed:
+  case kAC_16bps_signed:
+    return *((const int16_t*)samples + idx);
+  case kAC_18bps_unsigned:
+    return ((int32_t)(*((const uint32_t*)samples + idx) & AUTOCORRELATE_18BPS_MASK)
+        - scale->offset) >> scale->pre_shift;
+  case kAC_32bps_unsigned:
+  default:
+    return (int32_t)(*((const uint32_t*)samples + idx) - (1u << 31));
+  }
+}
+
+
+/*
+ * One term of the autocorrelation sum. The 32 bit format is accumulated
+ * without a shift, so the product wraps exactly like the reference path.
+ */
+static inline __attribute__((always_inline)) uint32_t
+ac_product(int32_t s1, int32_t s2, autocorrelate_sample_format_t format,
+    const ac_scale_t *scale)
+{
+  switch (format) {
+  case kAC_12bps_unsigned:
+  case kAC_12bps_signed:
+    return (uint32_t)((s1 * s2) >> 12);
+  case kAC_16bps_unsigned:
+  case kAC_16bps_signed:
+    return (uint32_t)((s1 * s2) >> 16);
+  case kAC_18bps_unsigned:
+    return (uint32_t)((s1 * s2) >> scale->post_shift);
+  case kAC_32bps_unsigned:
+  default:
+    return (uint32_t)s1 * (uint32_t)s2;
+  }
+}
+
+
+/*
+ * Compute the sums for lags lag .. lag+block-1 in one pass over the
+ * buffer. The sample at k is loaded once and shared by every lag, and
+ * the samples at k+lag .. k+lag+block-1 slide through a small window, so
+ * each step costs two loads instead of two per lag. The accumulators
+ * are kept modulo 2^32 and every lag is summed in the same order as the
+ * reference path, so the results are bit-exact.
+ *
+ * All lags of the block must be smaller than nsamp. block and format
+ * are expected to be compile-time constants at the call site so the
+ * window and the accumulators end up in registers.
+ */
+static inline __attribute__((always_inline)) void
+ac_lag_block(const void *samples, uint32_t nsamp,
+    autocorrelate_sample_format_t format, const ac_scale_t *scale,
+    uint32_t lag, uint32_t block, int32_t *sums)
+{
+  uint32_t acc[AUTOCORRELATE_MAX_BLOCK];
+  int32_t win[AUTOCORRELATE_MAX_BLOCK];
+  uint32_t common = nsamp - (lag + block - 1);   // terms shared by every lag of the block
+
+#pragma GCC unroll 8
+  for (uint32_t j=0; j < block; j++) {
+    acc[j] = 0;
+    if (j < block - 1)
+      win[j] = ac_sample(samples, lag + j, format, scale);
+  }
+
+  for (uint32_t k=0; k < common; k++) {
+    int32_t s1 = ac_sample(samples, k, format, scale);
+    win[block - 1] = ac_sample(samples, k + lag + block - 1, format, scale);
+
+#pragma GCC unroll 8
+    for (uint32_t j=0; j < block; j++)
+      acc[j] += ac_product(s1, win[j], format, scale);
+
+#pragma GCC unroll 8
+    for (uint32_t j=0; j < block - 1; j++)
+      win[j] = win[j + 1];
+  }
+
+  // the shorter lags of the block have a few more terms left
+  for (uint32_t j=0; j < block - 1; j++) {
+    for (uint32_t k=common; k < nsamp - lag - j; k++)
+      acc[j] += ac_product(ac_sample(samples, k, format, scale),
+          ac_sample(samples, k + lag + j, format, scale), format, scale);
+  }
+
+  for (uint32_t j=0; j < block; j++)
+    sums[j] = (int32_t)acc[j];
+}
+
+
+/*
+ * Instantiate the kernel for one constant block size and format
+ */
+#define AC_LAG_BLOCK_FN(name, blk, fmt)                                   \
+  static void name(const void *samples, uint32_t nsamp,                 \
+      const ac_scale_t *scale, uint32_t lag, int32_t *sums)               \
+  {                                                                       \
+    ac_lag_block(samples, nsamp, fmt, scale, lag, blk, sums);             \
+  }
+
+AC_LAG_BLOCK_FN(ac_lags_12u_x1, 1, kAC_12bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_12u_x4, 4, kAC_12bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_12u_x8, 8, kAC_12bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_16u_x1, 1, kAC_16bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_16u_x4, 4, kAC_16bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_16u_x8, 8, kAC_16bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_12s_x1, 1, kAC_12bps_signed)
+AC_LAG_BLOCK_FN(ac_lags_12s_x4, 4, kAC_12bps_signed)
+AC_LAG_BLOCK_FN(ac_lags_12s_x8, 8, kAC_12bps_signed)
+AC_LAG_BLOCK_FN(ac_lags_16s_x1, 1, kAC_16bps_signed)
+AC_LAG_BLOCK_FN(ac_lags_16s_x4, 4, kAC_16bps_signed)
+AC_LAG_BLOCK_FN(ac_lags_16s_x8, 8, kAC_16bps_signed)
+AC_LAG_BLOCK_FN(ac_lags_32u_x1, 1, kAC_32bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_32u_x4, 4, kAC_32bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_32u_x8, 8, kAC_32bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_18u_x1, 1, kAC_18bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_18u_x4, 4, kAC_18bps_unsigned)
+AC_LAG_BLOCK_FN(ac_lags_18u_x8, 8, kAC_18bps_unsigned)
+
+typedef void (*ac_lags_fn_t)(const void *samples, uint32_t nsamp,
+    const ac_scale_t *scale, uint32_t lag, int32_t *sums);
+
+// Indexed by [format][0: single lag, 1: block of 4, 2: block of 8]
+static const ac_lags_fn_t ac_lags_table[][3] = {
+  [kAC_12bps_unsigned] = { ac_lags_12u_x1, ac_lags_12u_x4, ac_lags_12u_x8 },
+  [kAC_16bps_unsigned] = { ac_lags_16u_x1, ac_lags_16u_x4, ac_lags_16u_x8 },
+  [kAC_12bps_signed]   = { ac_lags_12s_x1, ac_lags_12s_x4, ac_lags_12s_x8 },
+  [kAC_16bps_signed]   = { ac_lags_16s_x1, ac_lags_16s_x4, ac_lags_16s_x8 },
+  [kAC_32bps_unsigned] = { ac_lags_32u_x1, ac_lags_32u_x4, ac_lags_32u_x8 },
+  [kAC_18bps_unsigned] = { ac_lags_18u_x1, ac_lags_18u_x4, ac_lags_18u_x8 },
+};
+
+
+/*
+ * See documentation in .h file
+ */
+int
+autocorrelate_detect_period_blocked(void *samples, uint32_t nsamp,
+    autocorrelate_sample_format_t format, uint32_t block)
+{
+  int32_t sums[AUTOCORRELATE_MAX_BLOCK];
+  int32_t sum = 0;
+  int32_t prev_sum = 0;
+  int32_t thresh = 0;
+  bool slope_positive = false;
+  ac_lags_fn_t lags_fn;
+  ac_scale_t scale = { 0, 0, 0 };
+
+  if (nsamp == 0)
+    return -1;
+
+  if (format == kAC_18bps_unsigned)
+    ac_scale_18bps(samples, nsamp, &scale);
+
+  if (block <= 1)
+    return autocorrelate_detect_period_reference(samples, nsamp, format, &scale);
+
+  assert(block == 4 || block == AUTOCORRELATE_MAX_BLOCK);
+  lags_fn = ac_lags_table[format][block == 4 ? 1 : 2];
+
+  for (uint32_t i=0; i < nsamp; i += block) {
+    uint32_t n = block;
+
+    if (nsamp - i < block) {
+      // not enough lags left for a whole block, finish one lag at a time
+      n = nsamp - i;
+      for (uint32_t j=0; j < n; j++)
+        ac_lags_table[format][0](samples, nsamp, &scale, i + j, &sums[j]);
+    } else {
+      lags_fn(samples, nsamp, &scale, i, sums);
+    }
+
+    // same peak search as the reference path, one lag at a time
+    for (uint32_t j=0; j < n; j++) {
+      prev_sum = sum;
+      sum = sums[j];
+
+      if (i + j == 0) {
+        thresh = sum / 2;
+
+      } else if ((sum > thresh) && (sum - prev_sum > 0)) {
+        slope_positive = true;
+
+      } else if (slope_positive && (sum - prev_sum) <= 0) {
+        return i + j - 1;
+      }
+    }
+  }
+
+  // no correlation found
+  return -1;
+}
+
+
+/*
+ * See documentation in .h file
+ */
+int
+autocorrelate_detect_period(void *samples, uint32_t nsamp,
+    autocorrelate_sample_format_t format)
+{
+  return autocorrelate_detect_period_blocked(samples, nsamp, format,
+      AUTOCORRELATE_BLOCK);
+}
+
+
 //#define TESTING
 
 #ifdef TESTING
@@ -123,10 +396,11 @@ int main()
     int res4 = autocorrelate_detect_period(unsigned_16bps_test, BUF_SIZE, kAC_16bps_unsigned);
 
     assert(period-res1 <= slop && res1-period <= slop);
-    assert(period-resslop <= slop && resslop-period <= slop);
+    assert(period-res2 <= slop && res2-period <= slop);
     assert(period-res3 <= slop && res3-period <= slop);
     assert(period-res4 <= slop && res4-period <= slop);
   }
 }
 
 #endif
+
@@ -15,10 +15,23 @@ typedef enum {
   kAC_16bps_unsigned,   // 16 bits per sample, unsigned samples
   kAC_12bps_signed,     // 12 bits per sample, signed samples (stored in 16 bits)
   kAC_16bps_signed,     // 16 bits per sample, signed samples
-  kAC_32bps_unsigned
+  kAC_32bps_unsigned,
+  kAC_18bps_unsigned    // 18 bits per sample, unsigned samples (stored in 32 bits, e.g. MAX30101 FIFO).
+                        // The mean is removed and the scaling is chosen from the measured dynamic
+                        // range, so the 32 bit accumulator never overflows
 } autocorrelate_sample_format_t;
+
+#define AUTOCORRELATE_18BPS_MASK 0x3FFFF
   
 
+// Number of adjacent lags computed per pass over the buffer (1, 4 or 8)
+#ifndef AUTOCORRELATE_BLOCK
+#define AUTOCORRELATE_BLOCK 4
+#endif
+
+#define AUTOCORRELATE_MAX_BLOCK 8
+
+
 /*
  * Determine the fundamental period of a waveform using
  * autocorrelation
@@ -36,4 +49,23 @@ int autocorrelate_detect_period(void *samples, uint32_t nsamp,
     autocorrelate_sample_format_t format);
 
 
+/*
+ * Same as autocorrelate_detect_period(), with an explicit number of lags
+ * computed per pass over the buffer. The result is bit-exact for every
+ * blocking factor.
+ *
+ * Parameters:
+ *   samples   Array of samples
+ *   nsamp     Number of samples
+ *   format    The format for the samples (see above)
+ *   block     1 (reference path, one pass per lag), 4 or 8
+ *
+ * Returns:
+ *   The recovered fundamental period of the waveform, expressed in
+ *   number of samples, or -1 if no correlation was found
+ */
+int autocorrelate_detect_period_blocked(void *samples, uint32_t nsamp,
+    autocorrelate_sample_format_t format, uint32_t block);
+
+
 #endif  //  _AUTOCORRELATE_H_
@@ -63,10 +63,15 @@ void ble_Init(void)
   ble_data_ptr->flag_indication_hr = false;
   ble_data_ptr->flag_indication_in_progress = false;
   ble_data_ptr->flag_indication_hr_led = false;
+  ble_data_ptr->flag_indication_temp = false;
   ble_data_ptr->flag_bonded = false;
   ble_data_ptr->button_0_flag = false;
   ble_data_ptr->button_1_flag = false;
   ble_data_ptr->factor = 0;
+  ble_data_ptr->dc_level = 0;
+  ble_data_ptr->ac_peak_to_peak = 0;
+  ble_data_ptr->perfusion_index = 0;
+  ble_data_ptr->die_temperature = 0;
 }
 
 
@@ -278,16 +283,21 @@ void ble_handler(sl_bt_msg_t *evt) {
         #if NOP_INDICATION_CONNECTION == 1
               if ((ble_data_ptr->flag_conection == true) && (ble_data_ptr->flag_indication_hr == true) && (ble_data_ptr->flag_bonded == true))
               {
-                  LETIMER_IntEnable(LETIMER0, LETIMER_IEN_UF);
+                  timerUFIntEnable();
         //          LOG_INFO("Enabled"); // For debugging purpose
               }
         #endif
 
               /**Setting up the timer to poll for the circular buffer**/
               // We will poll every second
+              // The soft timer is deprecated in favour of the sleeptimer, the
+              // scheduler still runs on its event, the warning is silenced here only
+        #pragma GCC diagnostic push
+        #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
               sc = sl_bt_system_set_soft_timer ((32768*1),   // 1 second is equal to 32768 ticks
                                                  3,           // handle = 3
                                                  0);;         // repeating
+        #pragma GCC diagnostic pop
 
               // Printing the error message if the Server Write Failed fails
               if (sc != 0)
@@ -372,7 +382,7 @@ void ble_handler(sl_bt_msg_t *evt) {
         #if NOP_INDICATION_CONNECTION == 1
               if ((ble_data_ptr->flag_conection == false) || (ble_data_ptr->flag_indication_hr == false) || (ble_data_ptr->flag_bonded == false))
                 {
-                  LETIMER_IntDisable(LETIMER0, LETIMER_IEN_UF);
+                  timerUFIntDisable();
         //          LOG_INFO("Disabled");
                   sl_bt_gatt_set_characteristic_notification(ble_data_ptr->connectionHandle,
                                                              gattdb_heart_rate_measurement,
@@ -386,6 +396,8 @@ void ble_handler(sl_bt_msg_t *evt) {
               gpioLed0SetOff();
               gpioLed1SetOff();
 
+              // No interrupt driven transfer may be in flight on the blocking path
+              MAX_30101_Async_Abort();
               MAX_30101_Reset();
               MAX_30101_ShutDown();
 
@@ -435,6 +447,8 @@ void ble_handler(sl_bt_msg_t *evt) {
               ble_data_ptr->flag_conection = false;
               ble_data_ptr->flag_indication_hr = false;
               ble_data_ptr->flag_indication_hr_led = false;
+              ble_data_ptr->flag_indication_temp = false;
+              ble_data_ptr->flag_indication_in_progress = false; // The confirmation of the closed connection never comes
 
               RGB_LED(1, 1, 1);
 
@@ -473,7 +487,8 @@ void ble_handler(sl_bt_msg_t *evt) {
         case 3:
 #if DEVICE_IS_BLE_SERVER
           // We will process the indication only when the length of bufer is not 0 and there is no other indication in progress
-          if(ble_data_ptr->flag_indication_in_progress == false && cbfifo_length() != 0)
+          // The buffer is kept while there is no connection, it is sent once the client is back
+          if(ble_data_ptr->flag_conection == true && ble_data_ptr->flag_indication_in_progress == false && cbfifo_length() != 0)
           {
               // Dequeueing the buffer
               cbfifo_dequeue(cb_buffer_unload, (sizeof(cb_buffer_unload)/sizeof(uint8_t)));
@@ -548,6 +563,22 @@ void ble_handler(sl_bt_msg_t *evt) {
 
                   LOG_INFO("Temperature indication sent from buffer : %d indications left in the buffer", (cbfifo_length()/11));
               }
+              else if (unload_buffer_seq_unwrap.charHandle == gattdb_temperature_measurement)
+              {
+                  // Sending indication
+                  sc = sl_bt_gatt_server_send_indication(ble_data_ptr->connectionHandle,
+                                                         gattdb_temperature_measurement,
+                                                         unload_buffer_seq_unwrap.bufferLen,
+                                                         unload_buffer_seq_unwrap.buffer);
+
+                  ble_data_ptr->flag_indication_in_progress = true;
+
+                  // Printing the error message if the Sending Indication fails
+                  if (sc != 0)
+                    LOG_ERROR("!!! Die Temperature Sending Indication Failed !!!\nError Code: 0x%x",sc);
+
+                  LOG_INFO("Die temperature indication sent from buffer : %d indications left in the buffer", (cbfifo_length()/11));
+              }
           }
 #else
 #endif
@@ -560,7 +591,7 @@ void ble_handler(sl_bt_msg_t *evt) {
 
 
       // Checking which external event occurred
-      if (evt->data.evt_system_external_signal.extsignals == event_PB0Pressed_hr)
+      if (evt->data.evt_system_external_signal.extsignals & event_PB0Pressed_hr)
       {
           ble_data_ptr->button_0_flag = !ble_data_ptr->button_0_flag;
 
@@ -672,8 +703,8 @@ void ble_handler(sl_bt_msg_t *evt) {
 
           #endif
       }
-      // Event for the PB1 button
-      else if (evt->data.evt_system_external_signal.extsignals == event_PB1Pressed_hr)
+      // Event for the PB1 button, may come in the same event as PB0
+      if (evt->data.evt_system_external_signal.extsignals & event_PB1Pressed_hr)
         {
           ble_data_ptr->button_1_flag = !ble_data_ptr->button_1_flag;
       #if DEVICE_IS_BLE_SERVER
@@ -754,12 +785,12 @@ void ble_handler(sl_bt_msg_t *evt) {
       #if NOP_INDICATION_CONNECTION == 1
             if ((ble_data_ptr->flag_conection == true) && (ble_data_ptr->flag_indication_hr == true) && (ble_data_ptr->flag_bonded == true))
             {
-              LETIMER_IntEnable(LETIMER0, LETIMER_IEN_UF);
+              timerUFIntEnable();
       //        LOG_INFO("Enable"); // For debugging purpose
             }
             else if ((ble_data_ptr->flag_conection == false) || (ble_data_ptr->flag_indication_hr == false) || (ble_data_ptr->flag_bonded == false))
             {
-              LETIMER_IntDisable(LETIMER0, LETIMER_IEN_UF);
+              timerUFIntDisable();
       //        LOG_INFO("Disable"); // For debugging purpose
             }
       #endif
@@ -856,17 +887,30 @@ void ble_handler(sl_bt_msg_t *evt) {
               LOG_INFO("Indication Complete");
           }
 
+          // Sensor die temperature handling for indication enable and in flight
+          if ((evt->data.evt_gatt_server_characteristic_status.characteristic) == gattdb_temperature_measurement && \
+              (evt->data.evt_gatt_server_characteristic_status.status_flags) == 0x01) // 1 if Characteristic client configuration has been changed.
+          {
+              // sl_bt_gatt_server_client_configuration_t is set to 2 if indications are enabled
+              ble_data_ptr->flag_indication_temp = ((evt->data.evt_gatt_server_characteristic_status.client_config_flags) == 0x02);
+          }
+          else if ((evt->data.evt_gatt_server_characteristic_status.characteristic) == gattdb_temperature_measurement && \
+              (evt->data.evt_gatt_server_characteristic_status.status_flags) == 0x02) // 2 if Characteristic confirmation has been received
+          {
+              ble_data_ptr->flag_indication_in_progress = false; // This is a flag that will be set when the indication is acknowledged by the server.
+          }
+
 
           // This code will be run only if the temperature state machine is required to run if we have an active connection and the indication are ON. Set NOP_INDICATION_CONNECTION in app.h
         #if NOP_INDICATION_CONNECTION == 1
               if ((ble_data_ptr->flag_conection == true) && (ble_data_ptr->flag_indication_hr == true) && (ble_data_ptr->flag_bonded == true))
               {
-                LETIMER_IntEnable(LETIMER0, LETIMER_IEN_UF);
+                timerUFIntEnable();
         //        LOG_INFO("Enable"); // For debugging purpose
               }
               else if ((ble_data_ptr->flag_conection == false) || (ble_data_ptr->flag_indication_hr == false) || (ble_data_ptr->flag_bonded == false))
               {
-                LETIMER_IntDisable(LETIMER0, LETIMER_IEN_UF);
+                timerUFIntDisable();
         //        LOG_INFO("Disable"); // For debugging purpose
               }
 
@@ -30,7 +30,7 @@
 #define UINT8_TO_BITSTREAM(p, n)        { *(p)++ = (uint8_t)(n); } // Converts the 8 bit data into a bit stream
 #define UINT32_TO_BITSTREAM(p, n)       { *(p)++ = (uint8_t)(n); *(p)++ = (uint8_t)((n) >> 8); \
                                           *(p)++ = (uint8_t)((n) >> 16); *(p)++ = (uint8_t)((n) >> 24); } // Converts the 32 bit data into a bit stream
-#define UINT32_TO_FLOAT(m, e)           (((uint32_t)(m) & 0x00FFFFFFU) | (uint32_t)((int32_t)(e) << 24)) // Converts the 32 bit data into float
+#define UINT32_TO_FLOAT(m, e)           (((uint32_t)(m) & 0x00FFFFFFU) | ((uint32_t)(uint8_t)(int8_t)(e) << 24)) // Converts the 32 bit data into float
 
 // A structure to store the variables and flags
 typedef struct {
@@ -49,6 +49,7 @@ typedef struct {
 
   bool flag_indication_hr;
   bool flag_indication_hr_led;
+  bool flag_indication_temp;
 
 //  bool flag_indication_button_state;// Remove
 
@@ -61,6 +62,12 @@ typedef struct {
 
   uint8_t heart_rate_status_led_value;
 
+  // Signal statistics of the last measurement window (computed while draining the sensor FIFO)
+  uint32_t dc_level;              // Running mean of the raw samples
+  uint32_t ac_peak_to_peak;       // Max - Min of the raw samples
+  uint16_t perfusion_index;       // AC/DC in units of 0.01 %
+  int32_t die_temperature;        // MAX30101 die temperature in units of 0.01 C (Health Thermometer), no SpO2 path uses it yet
+
   // For the client implementation
   uint16_t myCharacteristicHandle_hr;
   uint32_t myServiceHandle_hr;
@@ -0,0 +1,206 @@
+/*
+ * cbfifo.c
+ *
+ *  Circular buffer of the indications waiting for the client, split out of
+ *  scheduler.c so that it builds without the SDK (host build, benchmarks).
+ *
+ *  Modified on: 8 Dec 2021
+ *      Author:
+ *          Author 1: Nihal T
+ *          Author 2: Sudarshan J
+ *
+ */
+
+#include "cbfifo.h"
+
+/**************************************************************************//**
+ * GLOBAL variable declaration
+ *****************************************************************************/
+uint8_t cbfifo_array[ARRAY_CAPACITY];
+uint8_t *write = cbfifo_array;
+uint8_t *read = cbfifo_array;
+uint8_t capacity_full = 0;
+
+
+/**************************************************************************//**
+ * Enqueues data onto the FIFO, up to the limit of the available FIFO
+ * capacity.
+ *
+ * This is to say that there is an error that has  during the temperature
+ * state machine. This will be encountered by reseting the device.
+ *
+ * @param:
+ *   buf      Pointer to the data
+ *   nbyte    Max number of bytes to enqueue
+ *
+ * @return:
+ *   The number of bytes actually enqueued, which could be 0. In case
+ *   of an error, returns -1.
+ *****************************************************************************/
+size_t cbfifo_enqueue(void *buf, size_t nbyte)
+{
+    /* checks for the capacity of the array buffer */
+    uint16_t available_capacity = ARRAY_CAPACITY - (cbfifo_length());
+    size_t count = 0;
+    if(buf == NULL)
+    {
+        return -1;
+    }
+
+    if(available_capacity > ZERO)
+    {
+        if(nbyte <= available_capacity)
+        {
+           while(nbyte--)
+            {
+                /*write pointer writes to the memory location and increments */
+                *write++ = *(uint8_t*)buf++;
+                count++;
+                if(write == (cbfifo_array + ARRAY_CAPACITY))
+                {
+                    write = cbfifo_array;
+                }
+
+            }
+        }
+        else
+        {
+           /*if enough space is not available, only enqueue as much as possible */
+            while(available_capacity--)
+            {
+
+                *write++ = *(uint8_t*)buf++;
+                count++;
+                if(write == (cbfifo_array + ARRAY_CAPACITY))
+                {
+                    write = cbfifo_array;
+                }
+
+            }
+        }
+        /* write pointer has gone around and filled all the array spaces,
+        set the capacity full flag */
+        if(write == read)
+        {
+            capacity_full = ONE;
+        }
+    }
+    else
+    {
+        count = 0;
+    }
+    return count;
+}
+
+
+/**************************************************************************//**
+ * Attempts to remove ("dequeue") up to nbyte bytes of data from the
+ * FIFO. Removed data will be copied into the buffer pointed to by buf.
+ *
+ * To further explain the behavior: If the FIFO's current length is 24
+ * bytes, and the caller requests 30 bytes, cbfifo_dequeue should
+ * return the 24 bytes it has, and the new FIFO length will be 0. If
+ * the FIFO is empty (current length is 0 bytes), a request to dequeue
+ * any number of bytes will result in a return of 0 from
+ * cbfifo_dequeue.
+ *
+ * @param:
+ *   buf      Destination for the dequeued data
+ *   nbyte    Bytes of data requested
+ *
+ * @return:
+ *   The number of bytes actually copied, which will be between 0 and
+ *   nbyte.
+ *****************************************************************************/
+size_t cbfifo_dequeue(void *buf, size_t nbyte)
+{
+    uint16_t available_dequeue = cbfifo_length();
+    uint16_t count = 0;
+    if(buf == NULL)
+    {
+        return -1;
+    }
+    if(available_dequeue > ZERO)
+    {
+        /* if bytes are available to dequeue, check the nbyte requirement */
+        if(nbyte <= available_dequeue )
+        {
+            while(nbyte--)
+            {
+                /*read from pointer into the buffer and increment, go around if 128th loc is reached */
+                *(uint8_t*)buf++ = *read;
+                *read++ = 0;
+                count++;
+                if(read == (cbfifo_array + ARRAY_CAPACITY))
+                {
+                    read = cbfifo_array;
+                }
+            }
+      }
+      else
+      {
+        while(available_dequeue--)
+        {
+           *(uint8_t*)buf++ = *read;
+            *read++ = 0;
+            count++;
+            if(read == (cbfifo_array + ARRAY_CAPACITY))
+            {
+                read = cbfifo_array;
+            }
+        }
+      }
+        capacity_full = ZERO;
+    }
+    else
+    {
+        count = 0;
+    }
+    return count;
+}
+
+
+/**************************************************************************//**
+ *
+ * Returns the number of bytes currently on the FIFO.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Number of bytes currently available to be dequeued from the FIFO
+ *****************************************************************************/
+size_t cbfifo_length()
+{
+    uint16_t ret;
+    if((capacity_full) == 1)
+    {
+        return ARRAY_CAPACITY;
+    }
+    if(write < read)
+    {
+        /*since write address value is less than read, read has to go around till 128 to get length  */
+        ret = ((cbfifo_array + ARRAY_CAPACITY) - read) + (write - cbfifo_array);
+    }
+    else
+    {
+       ret = write - read;
+    }
+    return ret;
+}
+
+
+/**************************************************************************//**
+ *
+ * Returns the FIFO's capacity
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      The capacity, in bytes, for the FIFO
+ *****************************************************************************/
+size_t cbfifo_capacity()
+{
+    return sizeof(cbfifo_array);
+}
@@ -0,0 +1,33 @@
+/* This header is a header file for the circular buffer - cbfifo.c
+ * cbfifo.h
+ *
+ *  Modified on: 8 Dec 2021
+ *      Author:
+ *          Author 1: Nihal T
+ *          Author 2: Sudarshan J
+ *
+ */
+
+#ifndef SRC_CBFIFO_H_
+#define SRC_CBFIFO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Definitions for CB FIFO
+size_t cbfifo_enqueue(void *buf, size_t nbyte);       // Enqueue nbytes from the buf array
+size_t cbfifo_dequeue(void *buf, size_t nbyte);       // Dequeue nbytes from the buf array
+size_t cbfifo_length();                               // Length of the buffer that has data in it
+size_t cbfifo_capacity();                             // Capacity of the buffer
+
+
+/*capacity of the static buffer is 176 bytes
+ * 2 bytes for the characteristic +
+ * 4 bytes for the number of bytes to transfer +
+ * 5 bytes for the buffer (5 bytes for temperature and 1 byte for button state)*/
+#define ARRAY_CAPACITY 176
+#define ZERO 0
+#define ONE 1
+
+
+#endif /* SRC_CBFIFO_H_ */
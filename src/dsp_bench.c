@@ -0,0 +1,233 @@
+/*
+ * dsp_bench.c
+ *
+ *  Benchmark of the DSP kernels of the firmware (autocorrelation for every
+ *  sample format and blocking factor in use, cbfifo) over the input sizes
+ *  the application runs them on, on a seeded synthetic PPG (ppg_synth.h).
+ *  One table row per kernel and size.
+ *
+ *  The kernels are plain C with no SDK dependency, the same file builds for
+ *  two counters:
+ *
+ *    Cortex-M4 on the board (__ARM_ARCH_7EM__ builds): the DWT cycle
+ *    counter, printf as retargeted by the firmware (VCOM).
+ *
+ *    Host: CLOCK_MONOTONIC, for quick relative comparisons only.
+ *
+ *      gcc -O2 -DDSP_BENCH -Isrc src/dsp_bench.c src/autocorrelate.c src/cbfifo.c src/ppg_synth.c -lm
+ *
+ *    or make dsp_bench (Makefile of the repository root).
+ *
+ *  Every kernel result is checked against the reference (block 1) path, a
+ *  regression in speed can't hide a wrong answer.
+ *
+ */
+
+#ifdef DSP_BENCH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "autocorrelate.h"
+#include "cbfifo.h"
+#include "ppg_synth.h"
+
+#define BENCH_SAMPLE_RATE   400     // Heart rate window rate of the firmware (MAX_30101_Get_Sample_Rate())
+#define BENCH_MAX_SAMPLES   3200    // Longest heart rate window, 8 s at 400 sps
+#define BENCH_BPM           100     // 240 samples per beat at 400 sps, the peak search runs over a realistic number of lags
+#define BENCH_LED_PA        0x1F
+#define BENCH_RUNS          8       // Calls per measurement, the result is per call
+#define BENCH_RECORD_LEN    11      // Bytes per indication queued in cbfifo
+#define BENCH_CLOCK_HZ      38400000
+
+#if defined(__ARM_ARCH_7EM__)
+
+#define DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#define DEMCR      (*(volatile uint32_t *)0xE000EDFC)
+
+static void bench_init(void) { DEMCR |= (1 << 24); DWT_CYCCNT = 0; DWT_CTRL |= 1; }
+static uint64_t bench_now(void) { return DWT_CYCCNT; }   // Measurements are far below the 112 s wrap
+
+#else
+
+#include <time.h>
+
+static void bench_init(void) { }
+static uint64_t bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
+
+
+static uint32_t samples_18bps[BENCH_MAX_SAMPLES];
+static int16_t samples_16bps[BENCH_MAX_SAMPLES];
+
+typedef struct
+{
+  const char *name;
+  int (*run) (uint32_t n, uint32_t arg);
+  uint32_t arg;
+  const uint32_t *sizes;                    // 0 terminated
+  int (*check) (uint32_t n, uint32_t arg);  // Expected result, NULL if none
+} bench_kernel_t;
+
+static const uint32_t window_sizes[] = { 800, 1600, 3200, 0 };      // 2, 4 and 8 s windows at 400 sps
+static const uint32_t queue_sizes[] = { 1, 8, 16, 0 };          // Records, 16 fill the queue
+
+
+/**************************************************************************//**
+ * Autocorrelation kernels, arg is the blocking factor
+ *****************************************************************************/
+static int bench_ac_18bps (uint32_t n, uint32_t arg)
+{
+  return autocorrelate_detect_period_blocked(samples_18bps, n, kAC_18bps_unsigned, arg);
+}
+
+static int bench_ac_18bps_ref (uint32_t n, uint32_t arg)
+{
+  return autocorrelate_detect_period_blocked(samples_18bps, n, kAC_18bps_unsigned, 1);
+}
+
+static int bench_ac_16bps (uint32_t n, uint32_t arg)
+{
+  return autocorrelate_detect_period_blocked(samples_16bps, n, kAC_16bps_signed, arg);
+}
+
+static int bench_ac_16bps_ref (uint32_t n, uint32_t arg)
+{
+  return autocorrelate_detect_period_blocked(samples_16bps, n, kAC_16bps_signed, 1);
+}
+
+
+/**************************************************************************//**
+ * cbfifo kernel: n indication records queued, then taken out again, the way
+ * the state machine and the soft timer of ble.c use it
+ *****************************************************************************/
+static int bench_cbfifo (uint32_t n, uint32_t arg)
+{
+  uint8_t record[BENCH_RECORD_LEN] = { 0 };
+  int bytes = 0;
+
+  for (uint32_t i = 0; i < n; i++)
+  {
+    record[0] = i;
+    cbfifo_enqueue(record, sizeof(record));
+  }
+  while (cbfifo_length() != 0)
+    bytes += cbfifo_dequeue(record, sizeof(record));
+
+  return bytes;
+}
+
+static int bench_cbfifo_check (uint32_t n, uint32_t arg)
+{
+  return n*BENCH_RECORD_LEN;
+}
+
+
+static const bench_kernel_t bench_kernels[] = {
+  { "ac18 b1",  bench_ac_18bps, 1, window_sizes, bench_ac_18bps_ref },
+  { "ac18 b4",  bench_ac_18bps, 4, window_sizes, bench_ac_18bps_ref },
+  { "ac18 b8",  bench_ac_18bps, 8, window_sizes, bench_ac_18bps_ref },
+  { "ac16s b1", bench_ac_16bps, 1, window_sizes, bench_ac_16bps_ref },
+  { "ac16s b4", bench_ac_16bps, 4, window_sizes, bench_ac_16bps_ref },
+  { "ac16s b8", bench_ac_16bps, 8, window_sizes, bench_ac_16bps_ref },
+  { "cbfifo",   bench_cbfifo,   0, queue_sizes,  bench_cbfifo_check },
+};
+
+
+/**************************************************************************//**
+ * This function measures one kernel at one size, per call, with the cost of
+ * the measurement itself taken out
+ *
+ * @param:
+ *      kernel: Kernel to run
+ *      n: Input size
+ *      result: Result of the last call
+ *
+ * @return:
+ *      Counter ticks per call (instructions, cycles or ns)
+ *****************************************************************************/
+static uint64_t bench_measure (const bench_kernel_t *kernel, uint32_t n, int *result)
+{
+  uint64_t start, empty, elapsed;
+
+  start = bench_now();
+  empty = bench_now() - start;
+
+  start = bench_now();
+  for (int r = 0; r < BENCH_RUNS; r++)
+    *result = kernel->run(n, kernel->arg);
+  elapsed = bench_now() - start;
+
+  elapsed = (elapsed > empty) ? elapsed - empty : 0;
+  return elapsed/BENCH_RUNS;
+}
+
+
+int main()
+{
+  int failures = 0;
+
+  static ppg_synth_t synth;
+  ppg_synth_config_t config;
+  int64_t mean = 0;
+
+  // IR channel of the generator, seeded so every run and every target sees
+  // the same input, and the same beats centred in 16 bit signed
+  PPG_Synth_Default_Config(&config);
+  config.hr_bpm = BENCH_BPM;
+  PPG_Synth_Init(&synth, &config);
+  PPG_Synth_Fill(&synth, 1, BENCH_LED_PA, BENCH_SAMPLE_RATE, samples_18bps, BENCH_MAX_SAMPLES);
+
+  for (int i = 0; i < BENCH_MAX_SAMPLES; i++)
+    mean += samples_18bps[i];
+  mean /= BENCH_MAX_SAMPLES;
+
+  for (int i = 0; i < BENCH_MAX_SAMPLES; i++)
+    samples_16bps[i] = (int16_t)((int64_t)samples_18bps[i] - mean);
+
+  bench_init();
+
+#if defined(__ARM_ARCH_7EM__)
+  printf("%-10s %6s %12s %10s %7s\n", "kernel", "n", "cycles", "us", "result");
+#else
+  printf("%-10s %6s %12s %7s\n", "kernel", "n", "ns", "result");
+#endif
+
+  for (unsigned k = 0; k < sizeof(bench_kernels)/sizeof(bench_kernels[0]); k++)
+  {
+    const bench_kernel_t *kernel = &bench_kernels[k];
+
+    for (const uint32_t *n = kernel->sizes; *n != 0; n++)
+    {
+      int result = 0;
+      uint64_t count = bench_measure(kernel, *n, &result);
+      const char *mark = "";
+
+      if (kernel->check && result != kernel->check(*n, kernel->arg))
+      {
+        mark = " WRONG";
+        failures++;
+      }
+
+#if defined(__ARM_ARCH_7EM__)
+      printf("%-10s %6u %12llu %10llu %7d%s\n", kernel->name, (unsigned)*n,
+             (unsigned long long)count, (unsigned long long)(count*1000000/BENCH_CLOCK_HZ), result, mark);
+#else
+      printf("%-10s %6u %12llu %7d%s\n", kernel->name, (unsigned)*n,
+             (unsigned long long)count, result, mark);
+#endif
+    }
+  }
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
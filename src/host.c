@@ -0,0 +1,669 @@
+/*
+ * host.c
+ *
+ *  Host (Linux) build of the firmware core. Only compiled with HOST_BUILD,
+ *  the file is empty in the Simplicity Studio build.
+ *
+ *  The sources are compiled against the SDK headers of the tree, with the
+ *  same include path and defines as the Studio build; everything that would
+ *  touch the radio or the peripherals is provided here instead:
+ *
+ *    - Bluetooth stack: sl_bt_external_signal() queues the signal for
+ *      Host_Run_Signals(), soft timers are kept for Host_Fire_Soft_Timer(),
+ *      the GATT, advertising and security commands succeed and are counted
+ *    - CORE critical sections, the power manager (EM1 time is accounted)
+ *    - GPIO (LEDs, MAX30101 interrupt enable), LETIMER waits, underflow
+ *      interrupt enable and time stamps on a virtual clock, the display (rows kept in host.display)
+ *    - app_log to stdout
+ *
+ *  Build and run the self test (measurements against the MAX30101 model),
+ *  from the repository root. The SDK directories are system includes, their
+ *  headers do not build warning free for a 64 bit host.
+ *
+ *    SDK_INC=$(grep -o '\-I"[^"]*"' "GNU ARM v10.2.1 - Default/src/subdir.mk" | sort -u | \
+ *              sed "s|-I\"[^\"]*master_SPO2|-isystem \"$PWD|; s|\"||g")
+ *    gcc -std=gnu99 -g -Wall -fsanitize=address,undefined -DHOST_BUILD -DHOST_TEST \
+ *        -DEFR32BG13P632F512GM48=1 -DSL_COMPONENT_CATALOG_PRESENT=1 \
+ *        '-DMBEDTLS_CONFIG_FILE=<mbedtls_config.h>' $SDK_INC -Isrc \
+ *        src/host.c src/scheduler.c src/cbfifo.c src/ble.c src/MAX_30101.c src/MAX_30101_sim.c \
+ *        src/sensor_bus.c src/sensor_capture.c src/autocorrelate.c -lm -o host_test && ./host_test
+ *
+ *  The Makefile of the repository root has these builds: make host_test,
+ *  or make check for every host test (DES, replay, benchmark, self tests).
+ *
+ *  With -DSENSOR_CAPTURE=1 the self test also streams a capture of the model
+ *  (scheduler.c), for host_replay.c.
+ *
+ *  The emlib I2C (i2c.c, irq.c), lcd.c, gpio.c and timers.c stay on target,
+ *  the sensor is reached through a sensor bus on the model (sensor_bus.h).
+ *  The transaction queue of i2c.c is tested on its own, on a scripted
+ *  controller (host_i2c.c).
+ *
+ */
+
+#ifdef HOST_BUILD
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "host.h"
+#include "scheduler.h"
+#include "ble.h"
+#include "em_core.h"
+#include "sl_power_manager.h"
+#include "sl_iostream.h"
+#include "app_log.h"
+
+
+host_t host;
+
+
+/**************************************************************************//**
+ * This function puts the host back to its power on state, the hooks are
+ * kept
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Host_Reset()
+{
+  host_t hooks = host;
+
+  memset(&host, 0, sizeof(host));
+
+  host.wait_hook = hooks.wait_hook;
+  host.wait_ctx = hooks.wait_ctx;
+  host.dispatch_hook = hooks.dispatch_hook;
+  host.dispatch_ctx = hooks.dispatch_ctx;
+  host.indication_hook = hooks.indication_hook;
+  host.indication_ctx = hooks.indication_ctx;
+}
+
+
+/**************************************************************************//**
+ * This function moves the virtual clock forward
+ *
+ * @param:
+ *      us: Time to advance
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Host_Advance (uint64_t us)
+{
+  host.now_us += us;
+
+  if (host.em1_requirements > 0)
+    host.em1_us += us;
+}
+
+
+/**************************************************************************//**
+ * This function takes the pending external signals
+ *
+ * @param:
+ *      signals: Receives the ORed signals
+ *
+ * @return:
+ *      false if none were pending
+ *****************************************************************************/
+bool Host_Pop_Signals (uint32_t *signals)
+{
+  if (host.signals == 0)
+    return false;
+
+  *signals = host.signals;
+  host.signals = 0;
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function hands a stack event to the application, as sl_bt_on_event()
+ * does in app.c
+ *
+ * @param:
+ *      evt: The event
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Host_Dispatch (sl_bt_msg_t *evt)
+{
+  if (host.dispatch_hook)
+    host.dispatch_hook(host.dispatch_ctx, evt, false);
+
+  ble_handler(evt);
+  state_machine_hr(evt);
+
+  if (host.dispatch_hook)
+    host.dispatch_hook(host.dispatch_ctx, evt, true);
+}
+
+
+/**************************************************************************//**
+ * This function hands an external signal event to the application
+ *
+ * @param:
+ *      signals: The signals of the event
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Host_Dispatch_Signals (uint32_t signals)
+{
+  sl_bt_msg_t evt;
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header = sl_bt_evt_system_external_signal_id;
+  evt.data.evt_system_external_signal.extsignals = signals;
+
+  Host_Dispatch(&evt);
+}
+
+
+/**************************************************************************//**
+ * This function runs the application until no signal is pending
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Number of events dispatched
+ *****************************************************************************/
+uint32_t Host_Run_Signals ()
+{
+  uint32_t signals, events = 0;
+
+  while (Host_Pop_Signals(&signals))
+  {
+      Host_Dispatch_Signals(signals);
+      events++;
+  }
+
+  return events;
+}
+
+
+/**************************************************************************//**
+ * This function finds the soft timer that expires first
+ *
+ * @param:
+ *      handle: Receives its handle
+ *
+ * @return:
+ *      Expiry time in us, UINT64_MAX if no timer runs
+ *****************************************************************************/
+uint64_t Host_Next_Soft_Timer (uint8_t *handle)
+{
+  uint64_t next = UINT64_MAX;
+
+  for (uint8_t i = 0; i < HOST_SOFT_TIMERS; i++)
+  {
+      if (host.soft_timer_period_us[i] && (host.soft_timer_next_us[i] < next))
+      {
+          next = host.soft_timer_next_us[i];
+          *handle = i;
+      }
+  }
+
+  return next;
+}
+
+
+/**************************************************************************//**
+ * This function expires a soft timer: it is restarted (or stopped if single
+ * shot) and its event handed to the application
+ *
+ * @param:
+ *      handle: The timer
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Host_Fire_Soft_Timer (uint8_t handle)
+{
+  sl_bt_msg_t evt;
+
+  if (host.soft_timer_single_shot[handle])
+    host.soft_timer_period_us[handle] = 0;
+  else
+    host.soft_timer_next_us[handle] += host.soft_timer_period_us[handle];
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header = sl_bt_evt_system_soft_timer_id;
+  evt.data.evt_system_soft_timer.handle = handle;
+
+  Host_Dispatch(&evt);
+}
+
+
+/**************************************************************************//**
+ * Bluetooth stack
+ *****************************************************************************/
+void sl_bt_external_signal (uint32_t signals)
+{
+  if (host.signals != 0)
+    host.signals_merged++;
+
+  host.signals |= signals;
+  host.signals_raised++;
+}
+
+sl_status_t sl_bt_gatt_server_send_indication (uint8_t connection, uint16_t characteristic, size_t value_len,
+                                               const uint8_t* value)
+{
+  (void)connection;
+
+  host.indications++;
+
+  if (host.indication_hook)
+    return host.indication_hook(host.indication_ctx, characteristic, value, value_len);
+
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_gatt_server_write_attribute_value (uint16_t attribute, uint16_t offset, size_t value_len,
+                                                     const uint8_t* value)
+{
+  (void)attribute;
+  (void)offset;
+  (void)value_len;
+  (void)value;
+
+  host.attribute_writes++;
+
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_system_get_identity_address (bd_addr *address, uint8_t *type)
+{
+  memset(address, 0, sizeof(*address));
+  *type = 0;
+
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_advertiser_create_set (uint8_t *handle)
+{
+  *handle = 0;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_advertiser_set_timing (uint8_t handle, uint32_t interval_min, uint32_t interval_max,
+                                         uint16_t duration, uint8_t maxevents)
+{
+  (void)handle; (void)interval_min; (void)interval_max; (void)duration; (void)maxevents;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_advertiser_start (uint8_t handle, uint8_t discover, uint8_t connect)
+{
+  (void)handle; (void)discover; (void)connect;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_advertiser_stop (uint8_t handle)
+{
+  (void)handle;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_connection_set_parameters (uint8_t connection, uint16_t min_interval, uint16_t max_interval,
+                                             uint16_t latency, uint16_t timeout, uint16_t min_ce_length,
+                                             uint16_t max_ce_length)
+{
+  (void)connection; (void)min_interval; (void)max_interval; (void)latency; (void)timeout;
+  (void)min_ce_length; (void)max_ce_length;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_gatt_discover_primary_services_by_uuid (uint8_t connection, size_t uuid_len, const uint8_t* uuid)
+{
+  (void)connection; (void)uuid_len; (void)uuid;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_gatt_discover_characteristics_by_uuid (uint8_t connection, uint32_t service, size_t uuid_len,
+                                                         const uint8_t* uuid)
+{
+  (void)connection; (void)service; (void)uuid_len; (void)uuid;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_gatt_set_characteristic_notification (uint8_t connection, uint16_t characteristic, uint8_t flags)
+{
+  (void)connection; (void)characteristic; (void)flags;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_sm_configure (uint8_t flags, uint8_t io_capabilities)
+{
+  (void)flags; (void)io_capabilities;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_sm_delete_bondings ()
+{
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_sm_increase_security (uint8_t connection)
+{
+  (void)connection;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_sm_bonding_confirm (uint8_t connection, uint8_t confirm)
+{
+  (void)connection; (void)confirm;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_sm_passkey_confirm (uint8_t connection, uint8_t confirm)
+{
+  (void)connection; (void)confirm;
+  return SL_STATUS_OK;
+}
+
+sl_status_t sl_bt_system_set_soft_timer (uint32_t time, uint8_t handle, uint8_t single_shot)
+{
+  if (handle >= HOST_SOFT_TIMERS)
+    return SL_STATUS_INVALID_HANDLE;
+
+  // time is in 32768 Hz ticks, 0 stops the timer
+  host.soft_timer_period_us[handle] = ((uint64_t)time*1000000)/32768;
+  host.soft_timer_next_us[handle] = host.now_us + host.soft_timer_period_us[handle];
+  host.soft_timer_single_shot[handle] = single_shot;
+
+  return SL_STATUS_OK;
+}
+
+void sl_bt_system_reset (uint8_t dfu)
+{
+  (void)dfu;
+}
+
+
+/**************************************************************************//**
+ * emlib CORE and power manager
+ *****************************************************************************/
+CORE_irqState_t CORE_EnterCritical (void)
+{
+  return 0;
+}
+
+void CORE_ExitCritical (CORE_irqState_t irqState)
+{
+  (void)irqState;
+}
+
+void sli_power_manager_update_em_requirement (sl_power_manager_em_t em, bool add)
+{
+  if (em == SL_POWER_MANAGER_EM1)
+    host.em1_requirements += add ? 1 : -1;
+}
+
+
+/**************************************************************************//**
+ * GPIO, LETIMER, display and logging of the board
+ *****************************************************************************/
+void gpioLed0SetOn() {}
+void gpioLed0SetOff() {}
+void gpioLed1SetOn() {}
+void gpioLed1SetOff() {}
+void RGB_LED(bool red, bool green, bool blue) { (void)red; (void)green; (void)blue; }
+
+void gpioMAX30101IntEnable()
+{
+  host.max30101_int_enabled = true;
+}
+
+void gpioMAX30101IntDisable()
+{
+  host.max30101_int_enabled = false;
+}
+
+void timerUFIntEnable()
+{
+  host.letimer_uf_enabled = true;
+}
+
+void timerUFIntDisable()
+{
+  host.letimer_uf_enabled = false;
+}
+
+void timerWaitUs_blocking (uint32_t us_wait)
+{
+  Host_Advance(us_wait);
+
+  if (host.wait_hook)
+    host.wait_hook(host.wait_ctx, us_wait);
+}
+
+uint32_t letimerMilliseconds()
+{
+  return (uint32_t)(host.now_us/1000);
+}
+
+uint32_t loggerGetTimestamp (void)
+{
+  return (uint32_t)(host.now_us/1000);
+}
+
+void displayInit() {}
+void displayUpdate() {}
+
+void displayPrintf (enum display_row row, const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(host.display[row], sizeof(host.display[row]), format, args);
+  va_end(args);
+}
+
+sl_iostream_t *app_log_iostream = NULL;
+
+void _app_log_time() {}
+void _app_log_counter() {}
+
+sl_status_t sl_iostream_printf (sl_iostream_t *stream, const char *format, ...)
+{
+  va_list args;
+
+  (void)stream;
+
+  if (host.log_muted)
+    return SL_STATUS_OK;
+
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+
+  return SL_STATUS_OK;
+}
+
+int32_t sl_status_get_string_n (sl_status_t status, char *buffer, uint32_t buffer_length)
+{
+  return snprintf(buffer, buffer_length, "0x%04x", (unsigned)status);
+}
+
+
+#ifdef HOST_TEST
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "MAX_30101.h"
+#include "MAX_30101_sim.h"
+
+// The autocorrelation needs about two periods in the window (4 s for the
+// first one) and rates above 120 bpm read as no finger, so the self test
+// pulses at 72 bpm
+#define HOST_TEST_BPM   72
+
+// Light on the photodiode in the second measurement, in % of the default
+// source: puts the DC level above the AGC range. Perfusion index (0.01 %)
+// of the 2 % pulse with its harmonic.
+#define HOST_TEST_BRIGHT_PCT  120
+#define HOST_TEST_MAX_PI      600
+
+// Transfers failed by a stuck SDA in the third measurement, which then
+// only comes from the one after it
+#define HOST_TEST_FAULTS      3
+
+extern uint32_t heart_rate;
+
+static uint32_t host_test_pct = 100;
+
+/**************************************************************************//**
+ * The default finger of the model, host_test_pct as bright
+ *****************************************************************************/
+static uint32_t host_test_source (void *ctx, uint8_t led, uint64_t t_us, uint8_t pa)
+{
+  return (MAX_30101_Sim_Default_Source(ctx, led, t_us, pa)*host_test_pct)/100;
+}
+
+/**************************************************************************//**
+ * Blocking waits in the driver move the model with the virtual clock
+ *****************************************************************************/
+static void advance_sim (void *ctx, uint64_t us)
+{
+  MAX_30101_Sim_Advance(ctx, us);
+}
+
+int main()
+{
+  static max_30101_sim_t sim;
+  static sensor_bus_t bus;
+  static const uint32_t bpm = HOST_TEST_BPM;
+  bool int_pin = false;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  Host_Reset();
+  ble_Init();
+
+  MAX_30101_Sim_Init(&sim, host_test_source, (void *)&bpm);
+  MAX_30101_Sim_Bus_Init(&bus, &sim, 100000);
+  MAX_30101_Attach(&bus, 0x57);
+  captureInit(&bus);
+  diagInit(&bus);
+
+  host.wait_hook = advance_sim;
+  host.wait_ctx = &sim;
+
+  // PWR_RDY holds INT low from power on, the falling edges the firmware
+  // waits for only come once the status has been read
+  uint8_t status;
+  MAX_30101_Sim_Read(&sim, MAX_30101_REG_INT_STATUS_1, &status, sizeof(status));
+
+  // Seven measurement periods of the LETIMER, 1 ms steps: the 4 s windows
+  // outlast a period, so there are measurements every other period. The
+  // second one starts too bright and the AGC steps the LED current in the
+  // middle of it. The bus fails in the third one, the system error drops
+  // it and the fourth one gives the result.
+  uint16_t led_current_ua = MAX_30101_Get_Profile()->led_current_ua[0];
+  uint16_t pi = 0;
+  uint32_t samples_lost = 0;
+
+  for (uint32_t ms = 0; ms < 7*LETIMER_PERIOD_MS; ms++)
+  {
+      if (ms == 2*LETIMER_PERIOD_MS)
+        host_test_pct = HOST_TEST_BRIGHT_PCT;
+
+      if (ms == 4*LETIMER_PERIOD_MS)
+      {
+          assert(sim.samples_lost == 0);
+          pi = getBleDataPtr()->perfusion_index;
+          heart_rate = 0;
+      }
+
+      if (ms == 4*LETIMER_PERIOD_MS + 1000)
+        MAX_30101_Sim_Inject_Fault(&sim, MAX_30101_SIM_FAULT_STUCK_SDA, HOST_TEST_FAULTS);
+
+      if ((ms % LETIMER_PERIOD_MS) == 0)
+        createEventMeasureHRMAX30101();
+
+      Host_Advance(1000);
+      MAX_30101_Sim_Advance(&sim, 1000);
+
+      // Falling edge of the INT line
+      if (MAX_30101_Sim_Int_Asserted(&sim) && !int_pin && host.max30101_int_enabled)
+        createEventMAX30101Int();
+      int_pin = MAX_30101_Sim_Int_Asserted(&sim);
+
+      Host_Run_Signals();
+
+      // The dropped measurement leaves the sensor sampling into a full FIFO
+      // until the next one starts
+      if (ms == 6*LETIMER_PERIOD_MS)
+        samples_lost = sim.samples_lost;
+  }
+
+  printf("Heart rate %d bpm, \"%s\", %s\n", (int)heart_rate, host.display[DISPLAY_ROW_9], host.display[DISPLAY_ROW_8]);
+  printf("%u signals (%u merged), %u transactions, %u bytes, %u us on the bus\n",
+         host.signals_raised, host.signals_merged, bus.stats.transactions, bus.stats.bytes,
+         (unsigned)bus.stats.busy_us);
+
+  assert(abs((int)heart_rate - HOST_TEST_BPM) <= HOST_TEST_BPM/20);
+
+  // Samples are scaled back to the current the window started with, a
+  // sample tagged with the wrong current would be a DC step of the window
+  assert(MAX_30101_Get_Profile()->led_current_ua[0] < led_current_ua);
+  assert(pi < HOST_TEST_MAX_PI && getBleDataPtr()->perfusion_index < HOST_TEST_MAX_PI);
+  assert(strcmp(host.display[DISPLAY_ROW_9], "Normal") == 0);
+  assert(getBleDataPtr()->die_temperature == sim.die_temperature);
+  assert(sim.faults == HOST_TEST_FAULTS && bus.stats.errors == HOST_TEST_FAULTS);
+  assert(sim.samples_lost == samples_lost && sim.illegal_configs == 0);
+  assert(host.em1_requirements == 0);
+
+  // Every transaction is in the diagnostics of its device and the histogram
+  uint8_t diag_buffer[SENSOR_BUS_PACK_MAX];
+  uint32_t histogram = 0;
+
+  for (uint32_t i = 0; i < SENSOR_BUS_HIST_BUCKETS; i++)
+    histogram += bus.diag.hist[i];
+
+  assert(bus.diag.ndevices == 1 && bus.diag.devices[0].addr == 0x57);
+  assert(bus.diag.devices[0].stats.transactions == bus.stats.transactions && histogram == bus.stats.transactions);
+  assert(Sensor_Bus_Trace(&bus, 0)->start_us <= host.now_us);
+  assert(Sensor_Bus_Diag_Pack(&bus, diag_buffer, sizeof(diag_buffer)) ==
+         SENSOR_BUS_PACK_MAX - 13*(SENSOR_BUS_DEVICES - 1));
+
+  // Warm resume from the shadow copy: the INT_STATUS read, the FIFO pointer
+  // burst and MODE_CONFIG. Not in the capture, it ends with the measurements.
+  uint32_t transactions;
+
+  Sensor_Bus_Set_Tap(&bus, NULL, NULL);
+  MAX_30101_ShutDown();
+  transactions = bus.stats.transactions;
+  MAX_30101_Init();
+  assert(bus.stats.transactions - transactions == 3);
+  MAX_30101_ShutDown();
+
+  // Both buttons pressed before the application ran: the stack merges the
+  // signals into one event and each is still seen
+  ble_data_struct_t *ble_data_ptr = getBleDataPtr();
+  bool button_0 = ble_data_ptr->button_0_flag, button_1 = ble_data_ptr->button_1_flag;
+
+  sl_bt_external_signal(event_PB0Pressed_hr);
+  sl_bt_external_signal(event_PB1Pressed_hr);
+  assert(Host_Run_Signals() == 1);
+  assert(ble_data_ptr->button_0_flag != button_0 && ble_data_ptr->button_1_flag != button_1);
+
+  printf("Host build OK\n");
+
+  return 0;
+}
+
+#endif
+
+#endif /* HOST_BUILD */
@@ -0,0 +1,79 @@
+/*
+ * host.h
+ *
+ *  Host (Linux) build of the firmware core: stands in for the Bluetooth
+ *  stack, the power manager, the display, the GPIO and the LETIMER so that
+ *  scheduler.c, ble.c, MAX_30101.c, sensor_bus.c and autocorrelate.c run on
+ *  a PC against the MAX30101 model. Build instructions in host.c.
+ *
+ */
+
+#ifndef SRC_HOST_H_
+#define SRC_HOST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sl_bt_api.h"
+#include "lcd.h"
+
+#define HOST_DISPLAY_ROW_LEN  (DISPLAY_ROW_LEN + 1)
+#define HOST_SOFT_TIMERS      (8)   // Soft timer handles 0 to 7
+
+typedef struct
+{
+  uint64_t now_us;                  // Virtual time, moved by Host_Advance()
+
+  // Run by the blocking waits (timerWaitUs_blocking()) after the clock moved,
+  // e.g. to advance the sensor model by the same time
+  void (*wait_hook) (void *ctx, uint64_t us);
+  void *wait_ctx;
+
+  // Called before (done false) and after (done true) every event handed to
+  // the application
+  void (*dispatch_hook) (void *ctx, sl_bt_msg_t *evt, bool done);
+  void *dispatch_ctx;
+
+  // Called for every indication sent, its status is returned to the caller
+  sl_status_t (*indication_hook) (void *ctx, uint16_t characteristic, const uint8_t *value, size_t len);
+  void *indication_ctx;
+
+  // External signals: like the stack, signals raised before the pending ones
+  // are handled are ORed into the same event
+  uint32_t signals;
+  uint32_t signals_raised;
+  uint32_t signals_merged;
+
+  // Power manager
+  int em1_requirements;
+  uint64_t em1_us;                  // Time spent with an EM1 requirement held
+
+  bool max30101_int_enabled;        // gpioMAX30101IntEnable()
+  bool letimer_uf_enabled;          // timerUFIntEnable()
+
+  // Soft timers of the stack, a period of 0 is a stopped timer
+  uint64_t soft_timer_period_us[HOST_SOFT_TIMERS];
+  uint64_t soft_timer_next_us[HOST_SOFT_TIMERS];
+  bool soft_timer_single_shot[HOST_SOFT_TIMERS];
+
+  uint32_t indications;
+  uint32_t attribute_writes;
+
+  bool log_muted;                   // Drops the app_log output
+
+  char display[DISPLAY_NUMBER_OF_ROWS][HOST_DISPLAY_ROW_LEN];
+} host_t;
+
+extern host_t host;
+
+void Host_Reset();
+void Host_Advance (uint64_t us);
+bool Host_Pop_Signals (uint32_t *signals);
+void Host_Dispatch (sl_bt_msg_t *evt);
+void Host_Dispatch_Signals (uint32_t signals);
+uint32_t Host_Run_Signals ();
+uint64_t Host_Next_Soft_Timer (uint8_t *handle);
+void Host_Fire_Soft_Timer (uint8_t handle);
+
+#endif /* SRC_HOST_H_ */
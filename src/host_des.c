@@ -0,0 +1,835 @@
+/*
+ * host_des.c
+ *
+ *  Discrete event simulation of the firmware on the host build (host.c).
+ *  Only compiled with HOST_BUILD, the file is empty in the Simplicity Studio
+ *  build.
+ *
+ *  Virtual time jumps from one event to the next:
+ *
+ *    - LETIMER underflow every LETIMER_PERIOD_MS, while timerUFIntEnable()
+ *    - falling edges of the MAX30101 INT line, from the sensor model, while
+ *      gpioMAX30101IntEnable()
+ *    - I2C completions: the sensor bus moves the data at the start of an
+ *      interrupt driven transfer and completes it once the transfer time on
+ *      the bus (at the speed of the scenario) has passed, like the I2C0
+ *      interrupt does
+ *    - soft timers of the stack (cbfifo polling)
+ *    - the client: connects, bonds and enables the indications, then
+ *      confirms every indication a connection event after it left the
+ *      device
+ *
+ *  Interrupts raise external signals, which are ORed until the application
+ *  takes them, like on target. Blocking waits and blocking transfers move
+ *  the clock from inside the handlers, the events they overrun are late.
+ *
+ *  BLE load is a chance per connection event that our packet doesn't go
+ *  out (other traffic, retransmissions) and a chance that the client never
+ *  confirms, after which the stack drops the link and the client comes back.
+ *  Everything is seeded, a scenario always gives the same result.
+ *
+ *  The EM1 time of every FIFO batch is reported along with what the same
+ *  interrupt driven transfers would have kept the core in EM1 in standard
+ *  mode, the saving of the fast mode profile of the MAX30101 (i2c.c).
+ *
+ *  Build and run every scenario (each in its own process, the firmware
+ *  keeps its state in globals), from the repository root, SDK_INC as in
+ *  host.c:
+ *
+ *    gcc -std=gnu99 -O2 -Wall -DHOST_BUILD -DHOST_DES \
+ *        -DEFR32BG13P632F512GM48=1 -DSL_COMPONENT_CATALOG_PRESENT=1 \
+ *        '-DMBEDTLS_CONFIG_FILE=<mbedtls_config.h>' $SDK_INC -Isrc \
+ *        src/host_des.c src/host.c src/scheduler.c src/cbfifo.c src/ble.c src/MAX_30101.c \
+ *        src/MAX_30101_sim.c src/sensor_bus.c src/autocorrelate.c -lm -o host_des
+ *    ./host_des          all scenarios
+ *    ./host_des 2        scenario 2 only
+ *
+ *  or make host_des (Makefile of the repository root).
+ *
+ *  A scenario fails (non-zero exit) when the sensor FIFO overflowed or had
+ *  empty batches, or the model was set to a rate it doesn't support, or when
+ *  the pulse stopped and the last reading was never cleared.
+ *
+ */
+
+#ifdef HOST_BUILD
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "host_des.h"
+#include "ble.h"
+#include "MAX_30101_sim.h"
+#include "em_i2c.h"
+
+#define HOST_DES_CONNECTION (1)
+
+// Globals of scheduler.c
+extern uint32_t count;                      // Heart rate results so far
+extern uint32_t heart_rate;
+extern max_30101_fifo_preset_t fifo_preset;
+
+// Globals of cbfifo.c
+extern uint8_t cbfifo_array[ARRAY_CAPACITY];
+extern uint8_t *write;
+
+typedef struct
+{
+  uint16_t characteristic;
+  uint64_t origin_us;                       // FIFO interrupt the value comes from
+} host_des_record_t;
+
+typedef struct
+{
+  const host_des_scenario_t *scenario;
+  host_des_stats_t *stats;
+
+  max_30101_sim_t sim;
+  sensor_bus_t bus;
+  uint32_t rng;
+
+  bool int_pin;                             // INT line pulled down
+  uint64_t last_int_us;                     // Last falling edge taken by the firmware
+
+  uint64_t next_uf_us;
+  uint64_t i2c_done_us;
+
+  // Client and link
+  bool connected;
+  uint64_t connect_us;
+  uint64_t anchor_us;                       // First connection event
+  uint16_t in_flight;                       // Indication waiting for its confirmation, 0 if none
+  uint64_t confirm_us;
+  uint64_t att_timeout_us;
+
+  // Where the records in cbfifo come from, oldest first
+  host_des_record_t queue[HOST_DES_QUEUE_RECORDS];
+  uint32_t queue_head;
+  uint32_t queue_len;
+
+  // Snapshot taken before an event is handed to the application
+  bool indications_on;
+  uint32_t results;
+  uint32_t hr_sent;
+} host_des_t;
+
+static host_des_t des;
+
+
+/**************************************************************************//**
+ * This function returns the next number of the scenario's random sequence
+ * (xorshift32)
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Pseudo random number
+ *****************************************************************************/
+static uint32_t Host_DES_Random()
+{
+  des.rng ^= des.rng << 13;
+  des.rng ^= des.rng >> 17;
+  des.rng ^= des.rng << 5;
+
+  return des.rng;
+}
+
+static bool Host_DES_Chance (uint8_t pct)
+{
+  return (Host_DES_Random() % 100) < pct;
+}
+
+
+/**************************************************************************//**
+ * This function moves the clock and the sensor model forward
+ *
+ * @param:
+ *      us: Time to advance
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void Host_DES_Advance (uint64_t us)
+{
+  Host_Advance(us);
+  MAX_30101_Sim_Advance(&des.sim, us);
+}
+
+static void Host_DES_Wait (void *ctx, uint64_t us)
+{
+  (void)ctx;
+
+  // Host_Advance() was done by timerWaitUs_blocking()
+  MAX_30101_Sim_Advance(&des.sim, us);
+}
+
+
+/**************************************************************************//**
+ * This function follows the INT line of the sensor: a falling edge while
+ * the GPIO interrupt is enabled is the FIFO interrupt of the firmware
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void Host_DES_Sensor_Line()
+{
+  bool pin = MAX_30101_Sim_Int_Asserted(&des.sim);
+
+  if (pin && !des.int_pin && host.max30101_int_enabled)
+  {
+      des.last_int_us = host.now_us;
+      des.stats->wakeups_sensor++;
+      createEventMAX30101Int();
+  }
+
+  des.int_pin = pin;
+}
+
+
+/**************************************************************************//**
+ * Sensor bus on the model: blocking transfers take their time on the bus
+ * right away, interrupt driven ones complete from the event loop
+ *****************************************************************************/
+static void Host_DES_Bus_Move (bool write, uint8_t reg, uint8_t *data, size_t len)
+{
+  if (write)
+    MAX_30101_Sim_Write(&des.sim, reg, data, len);
+  else
+    MAX_30101_Sim_Read(&des.sim, reg, data, len);
+
+  // Reading the status releases the line, the next interrupt is a new edge
+  Host_DES_Sensor_Line();
+}
+
+static sensor_bus_status_t Host_DES_Bus_Transfer (void *ctx, uint8_t addr, bool write, uint8_t reg, uint8_t *data, size_t len)
+{
+  (void)ctx;
+  (void)addr;
+
+  Host_DES_Bus_Move(write, reg, data, len);
+  Host_DES_Advance(MAX_30101_Sim_Transfer_Us(des.scenario->bus_hz, write, len));
+
+  return SENSOR_BUS_OK;
+}
+
+static sensor_bus_status_t Host_DES_Bus_Start (void *ctx, uint8_t addr, bool write, uint8_t reg, uint8_t *data, size_t len)
+{
+  (void)ctx;
+  (void)addr;
+
+  uint32_t transfer_us = MAX_30101_Sim_Transfer_Us(des.scenario->bus_hz, write, len);
+
+  Host_DES_Bus_Move(write, reg, data, len);
+  des.i2c_done_us = host.now_us + transfer_us;
+
+  des.stats->i2c_async_us += transfer_us;
+  des.stats->i2c_async_standard_us += MAX_30101_Sim_Transfer_Us(I2C_FREQ_STANDARD_MAX, write, len);
+
+  return SENSOR_BUS_IN_PROGRESS;
+}
+
+static void Host_DES_Bus_Abort (void *ctx)
+{
+  (void)ctx;
+
+  des.i2c_done_us = UINT64_MAX;
+}
+
+static uint64_t Host_DES_Bus_Now (void *ctx)
+{
+  (void)ctx;
+
+  return host.now_us;
+}
+
+static const sensor_bus_ops_t host_des_bus_ops =
+{
+  .transfer = Host_DES_Bus_Transfer,
+  .start = Host_DES_Bus_Start,
+  .abort = Host_DES_Bus_Abort,
+  .now_us = Host_DES_Bus_Now,
+};
+
+
+/**************************************************************************//**
+ * This function returns the first connection event at or after t that
+ * carries our packet
+ *
+ * @param:
+ *      t: Time the packet is ready
+ *
+ * @return:
+ *      Time of the connection event
+ *****************************************************************************/
+static uint64_t Host_DES_Connection_Event (uint64_t t)
+{
+  uint64_t interval = des.scenario->conn_interval_us;
+  uint64_t event = des.anchor_us + ((t - des.anchor_us + interval - 1)/interval)*interval;
+
+  while (Host_DES_Chance(des.scenario->busy_pct))
+    event += interval;
+
+  return event;
+}
+
+
+/**************************************************************************//**
+ * This function brings the shadow of cbfifo up to date: records taken out
+ * are dropped, new records get the FIFO interrupt they come from
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Number of heart rate records added
+ *****************************************************************************/
+static uint32_t Host_DES_Sync_Queue()
+{
+  uint32_t records = cbfifo_length()/HOST_DES_RECORD_LEN;
+  uint32_t added = 0;
+
+  while (des.queue_len > records)
+  {
+      des.queue_head = (des.queue_head + 1) % HOST_DES_QUEUE_RECORDS;
+      des.queue_len--;
+  }
+
+  while (des.queue_len < records)
+  {
+      // New records end at the write pointer of cbfifo, oldest first
+      uint32_t offset = ((write - cbfifo_array) + ARRAY_CAPACITY -
+                         (records - des.queue_len)*HOST_DES_RECORD_LEN) % ARRAY_CAPACITY;
+      host_des_record_t *record = &des.queue[(des.queue_head + des.queue_len) % HOST_DES_QUEUE_RECORDS];
+
+      record->characteristic = (cbfifo_array[offset] << 8) | cbfifo_array[(offset + 1) % ARRAY_CAPACITY];
+      record->origin_us = des.last_int_us;
+
+      if (record->characteristic == gattdb_heart_rate_measurement)
+        added++;
+
+      des.queue_len++;
+  }
+
+  return added;
+}
+
+
+/**************************************************************************//**
+ * This function is run around every event handed to the application: it
+ * counts the heart rate results, follows cbfifo and its depth
+ *****************************************************************************/
+static void Host_DES_Dispatch_Hook (void *ctx, sl_bt_msg_t *evt, bool done)
+{
+  ble_data_struct_t *ble_data_ptr = getBleDataPtr();
+  host_des_stats_t *stats = des.stats;
+  uint32_t depth;
+
+  (void)ctx;
+  (void)evt;
+
+  if (!done)
+  {
+      des.indications_on = ble_data_ptr->flag_conection && ble_data_ptr->flag_indication_hr;
+      des.results = count;
+      des.hr_sent = stats->hr_sent;
+      return;
+  }
+
+  uint32_t queued = Host_DES_Sync_Queue();
+
+  if (des.indications_on && (count != des.results))
+  {
+      stats->hr_results += count - des.results;
+
+      if ((stats->hr_sent == des.hr_sent) && (queued == 0))
+        stats->hr_dropped++;
+  }
+
+  depth = des.queue_len;
+  stats->queue_hist[depth]++;
+  if (depth > stats->queue_max)
+    stats->queue_max = depth;
+}
+
+
+/**************************************************************************//**
+ * This function is the stack sending an indication: one at a time, it
+ * leaves with the next connection event that has room for it
+ *****************************************************************************/
+static sl_status_t Host_DES_Indication (void *ctx, uint16_t characteristic, const uint8_t *value, size_t len)
+{
+  host_des_stats_t *stats = des.stats;
+  uint64_t origin_us = des.last_int_us, leave_us;
+
+  (void)ctx;
+  (void)value;
+  (void)len;
+
+  // Sent from cbfifo: the soft timer took the oldest record out
+  if (des.queue_len > cbfifo_length()/HOST_DES_RECORD_LEN)
+  {
+      origin_us = des.queue[des.queue_head].origin_us;
+      des.queue_head = (des.queue_head + 1) % HOST_DES_QUEUE_RECORDS;
+      des.queue_len--;
+  }
+
+  if (!des.connected)
+    return SL_STATUS_INVALID_HANDLE;
+
+  // The stack refuses a second indication before the first is confirmed
+  if (des.in_flight)
+  {
+      stats->rejected++;
+      return SL_STATUS_INVALID_STATE;
+  }
+
+  leave_us = Host_DES_Connection_Event(host.now_us);
+
+  if (characteristic == gattdb_heart_rate_measurement)
+  {
+      stats->hr_sent++;
+
+      if (stats->nlatencies < HOST_DES_MAX_LATENCIES)
+        stats->latencies[stats->nlatencies++] = (uint32_t)(leave_us - origin_us);
+  }
+
+  des.in_flight = characteristic;
+
+  if (Host_DES_Chance(des.scenario->confirm_loss_pct))
+    des.att_timeout_us = host.now_us + HOST_DES_ATT_TIMEOUT_US;
+  else
+    des.confirm_us = Host_DES_Connection_Event(leave_us + 1);
+
+  return SL_STATUS_OK;
+}
+
+
+/**************************************************************************//**
+ * This function runs the application on the pending external signals
+ *****************************************************************************/
+static void Host_DES_Run_Signals()
+{
+  Host_Run_Signals();
+  Host_DES_Sensor_Line();
+}
+
+
+/**************************************************************************//**
+ * This function hands a stack event of the client to the application
+ *
+ * @param:
+ *      evt: The event, header set
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void Host_DES_Stack_Event (sl_bt_msg_t *evt)
+{
+  des.stats->wakeups_ble++;
+
+  Host_Dispatch(evt);
+  Host_DES_Run_Signals();
+}
+
+static void Host_DES_Client_Config (uint16_t characteristic, bool on)
+{
+  sl_bt_msg_t evt;
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header = sl_bt_evt_gatt_server_characteristic_status_id;
+  evt.data.evt_gatt_server_characteristic_status.connection = HOST_DES_CONNECTION;
+  evt.data.evt_gatt_server_characteristic_status.characteristic = characteristic;
+  evt.data.evt_gatt_server_characteristic_status.status_flags = sl_bt_gatt_server_client_config;
+  evt.data.evt_gatt_server_characteristic_status.client_config_flags = on ? sl_bt_gatt_server_indication : 0;
+
+  Host_DES_Stack_Event(&evt);
+}
+
+
+/**************************************************************************//**
+ * This function is the client connecting: connection, bonding, then the
+ * indications it wants
+ *****************************************************************************/
+static void Host_DES_Connect()
+{
+  sl_bt_msg_t evt;
+
+  des.connect_us = UINT64_MAX;
+  des.connected = true;
+  des.anchor_us = host.now_us;
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header = sl_bt_evt_connection_opened_id;
+  evt.data.evt_connection_opened.connection = HOST_DES_CONNECTION;
+  evt.data.evt_connection_opened.bonding = 0xFF;
+  Host_DES_Stack_Event(&evt);
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header = sl_bt_evt_sm_bonded_id;
+  evt.data.evt_sm_bonded.connection = HOST_DES_CONNECTION;
+  evt.data.evt_sm_bonded.bonding = 1;
+  Host_DES_Stack_Event(&evt);
+
+  Host_DES_Client_Config(gattdb_heart_rate_measurement, true);
+
+  if (des.scenario->led_indications)
+    Host_DES_Client_Config(gattdb_heart_rate_led, true);
+
+  if (des.scenario->temp_indications)
+    Host_DES_Client_Config(gattdb_temperature_measurement, true);
+}
+
+
+/**************************************************************************//**
+ * This function is the client confirming the indication in flight
+ *****************************************************************************/
+static void Host_DES_Confirm()
+{
+  sl_bt_msg_t evt;
+
+  if (des.in_flight == gattdb_heart_rate_measurement)
+    des.stats->hr_confirmed++;
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header = sl_bt_evt_gatt_server_characteristic_status_id;
+  evt.data.evt_gatt_server_characteristic_status.connection = HOST_DES_CONNECTION;
+  evt.data.evt_gatt_server_characteristic_status.characteristic = des.in_flight;
+  evt.data.evt_gatt_server_characteristic_status.status_flags = sl_bt_gatt_server_confirmation;
+
+  des.in_flight = 0;
+  des.confirm_us = UINT64_MAX;
+
+  Host_DES_Stack_Event(&evt);
+}
+
+
+/**************************************************************************//**
+ * This function is the stack giving up on an unconfirmed indication: the
+ * link is dropped and the client reconnects later
+ *****************************************************************************/
+static void Host_DES_Link_Lost()
+{
+  sl_bt_msg_t evt;
+
+  des.stats->att_timeouts++;
+
+  des.in_flight = 0;
+  des.att_timeout_us = UINT64_MAX;
+  des.connected = false;
+  des.connect_us = host.now_us + des.scenario->reconnect_ms*1000ULL;
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header = sl_bt_evt_connection_closed_id;
+  evt.data.evt_connection_closed.connection = HOST_DES_CONNECTION;
+  evt.data.evt_connection_closed.reason = SL_STATUS_TIMEOUT;
+  Host_DES_Stack_Event(&evt);
+}
+
+
+/**************************************************************************//**
+ * This function is the finger of the scenario: the default source at the
+ * scenario's pulse, a flat DC level once the pulse has stopped
+ *
+ * @param:
+ *      ctx:  Scenario (const host_des_scenario_t *)
+ *      led:  LED being sampled
+ *      t_us: Sample time
+ *      pa:   LEDx_PA of the LED
+ *
+ * @return:
+ *      18 bit ADC count
+ *****************************************************************************/
+static uint32_t Host_DES_Source (void *ctx, uint8_t led, uint64_t t_us, uint8_t pa)
+{
+  const host_des_scenario_t *scenario = ctx;
+  uint32_t bpm = scenario->bpm;
+
+  if (scenario->pulse_stop_s && (t_us >= scenario->pulse_stop_s*1000000ULL))
+    bpm = 0;
+
+  return MAX_30101_Sim_Default_Source(&bpm, led, t_us, pa);
+}
+
+
+/**************************************************************************//**
+ * This function runs a scenario from power on
+ *
+ * @param:
+ *      scenario: What to simulate
+ *      stats:    Receives the results
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Host_DES_Run (const host_des_scenario_t *scenario, host_des_stats_t *stats)
+{
+  uint64_t end_us = scenario->duration_s*1000000ULL;
+  sl_bt_msg_t evt;
+
+  memset(&des, 0, sizeof(des));
+  memset(stats, 0, sizeof(*stats));
+
+  des.scenario = scenario;
+  des.stats = stats;
+  des.rng = scenario->seed ? scenario->seed : 1;
+  des.next_uf_us = LETIMER_PERIOD_MS*1000ULL;
+  des.i2c_done_us = UINT64_MAX;
+  des.confirm_us = UINT64_MAX;
+  des.att_timeout_us = UINT64_MAX;
+  des.connect_us = scenario->connect_ms*1000ULL;
+
+  Host_Reset();
+  host.log_muted = true;
+  host.wait_hook = Host_DES_Wait;
+  host.dispatch_hook = Host_DES_Dispatch_Hook;
+  host.indication_hook = Host_DES_Indication;
+
+  MAX_30101_Sim_Init(&des.sim, Host_DES_Source, (void *)scenario);
+  des.sim.bus_hz = scenario->bus_hz;
+
+  memset(&des.bus, 0, sizeof(des.bus));
+  des.bus.name = "des";
+  des.bus.ops = &host_des_bus_ops;
+  MAX_30101_Attach(&des.bus, 0x57);
+
+  // PWR_RDY holds INT low from power on
+  uint8_t status;
+  MAX_30101_Sim_Read(&des.sim, MAX_30101_REG_INT_STATUS_1, &status, sizeof(status));
+
+  fifo_preset = scenario->fifo_preset;
+
+  ble_Init();
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header = sl_bt_evt_system_boot_id;
+  Host_Dispatch(&evt);
+
+  for (;;)
+  {
+      uint8_t timer = 0;
+      uint64_t timer_us = Host_Next_Soft_Timer(&timer);
+      uint64_t next = MAX_30101_Sim_Next_Event(&des.sim);
+
+      if (des.next_uf_us < next) next = des.next_uf_us;
+      if (des.i2c_done_us < next) next = des.i2c_done_us;
+      if (timer_us < next) next = timer_us;
+      if (des.connect_us < next) next = des.connect_us;
+      if (des.confirm_us < next) next = des.confirm_us;
+      if (des.att_timeout_us < next) next = des.att_timeout_us;
+
+      if (next > end_us)
+        break;
+
+      if (next > host.now_us)
+        Host_DES_Advance(next - host.now_us);
+
+      // Interrupts, their signals are taken together by the next event loop pass
+      Host_DES_Sensor_Line();
+
+      if (des.next_uf_us <= host.now_us)
+      {
+          des.next_uf_us += LETIMER_PERIOD_MS*1000ULL;
+
+          if (host.letimer_uf_enabled)
+          {
+              stats->wakeups_letimer++;
+              createEventMeasureHRMAX30101();
+          }
+      }
+
+      if (des.i2c_done_us <= host.now_us)
+      {
+          des.i2c_done_us = UINT64_MAX;
+          stats->wakeups_i2c++;
+
+          if (!Sensor_Bus_Complete(&des.bus, SENSOR_BUS_OK))
+            createEventI2CTransfer();
+      }
+
+      Host_DES_Run_Signals();
+
+      // Stack events
+      if (des.connect_us <= host.now_us)
+        Host_DES_Connect();
+
+      if (des.att_timeout_us <= host.now_us)
+        Host_DES_Link_Lost();
+
+      if (des.confirm_us <= host.now_us)
+        Host_DES_Confirm();
+
+      if (Host_Next_Soft_Timer(&timer) <= host.now_us)
+      {
+          stats->wakeups_soft_timer++;
+          Host_Fire_Soft_Timer(timer);
+          Host_DES_Run_Signals();
+      }
+  }
+
+  if (end_us > host.now_us)
+    Host_DES_Advance(end_us - host.now_us);
+
+  Host_DES_Sync_Queue();
+
+  for (uint32_t i = 0; i < des.queue_len; i++)
+    if (des.queue[(des.queue_head + i) % HOST_DES_QUEUE_RECORDS].characteristic == gattdb_heart_rate_measurement)
+      stats->hr_pending++;
+
+  if (des.in_flight == gattdb_heart_rate_measurement)
+    stats->hr_pending++;
+
+  stats->sim_us = host.now_us;
+  stats->em1_us = host.em1_us;
+  stats->signals_merged = host.signals_merged;
+  stats->fifo_batches = MAX_30101_Get_FIFO_Stats()->batches;
+  stats->fifo_overflows = MAX_30101_Get_FIFO_Stats()->overflows;
+  stats->fifo_dropped = MAX_30101_Get_FIFO_Stats()->dropped;
+  stats->fifo_empty = MAX_30101_Get_FIFO_Stats()->empty;
+  stats->illegal_configs = des.sim.illegal_configs;
+  stats->hr_final = heart_rate;
+  stats->hr_condition = getBleDataPtr()->heart_rate_status_led_value;
+
+  host.dispatch_hook = NULL;
+  host.indication_hook = NULL;
+  host.wait_hook = NULL;
+}
+
+
+static int Host_DES_Compare (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+
+/**************************************************************************//**
+ * This function prints the results of a scenario
+ *
+ * @param:
+ *      scenario: What was simulated
+ *      stats:    Its results, the latencies get sorted
+ *
+ * @return:
+ *      false if the sensor lost samples, had empty batches or was set to a
+ *      rate it doesn't support, or the reading outlived the pulse
+ *****************************************************************************/
+bool Host_DES_Report (const host_des_scenario_t *scenario, host_des_stats_t *stats)
+{
+  static const char *presets[num_MAX_30101_FIFO_PRESETS] = { "low latency", "balanced", "min wakeups" };
+  double minutes = stats->sim_us/60e6;
+  uint32_t wakeups = stats->wakeups_letimer + stats->wakeups_sensor + stats->wakeups_i2c +
+                     stats->wakeups_soft_timer + stats->wakeups_ble;
+  uint32_t lost = stats->hr_results - stats->hr_confirmed - stats->hr_pending;
+  uint32_t n = stats->nlatencies;
+
+  printf("%s: %s FIFO, %u kHz I2C, %u bpm, %u ms interval, %u %% busy, %u %% unconfirmed, %.0f s\n",
+         scenario->name, presets[scenario->fifo_preset], scenario->bus_hz/1000, scenario->bpm,
+         scenario->conn_interval_us/1000, scenario->busy_pct, scenario->confirm_loss_pct, stats->sim_us/1e6);
+
+  printf("  wakeups     %.1f/min (LETIMER %u, sensor %u, I2C %u, soft timer %u, BLE %u), %u signals merged\n",
+         wakeups/minutes, stats->wakeups_letimer, stats->wakeups_sensor, stats->wakeups_i2c,
+         stats->wakeups_soft_timer, stats->wakeups_ble, stats->signals_merged);
+  printf("  EM1         %.1f ms/min\n", stats->em1_us/1000.0/minutes);
+
+  if (stats->fifo_batches)
+  {
+      uint32_t batches = stats->fifo_batches;
+
+      printf("  I2C EM1     %.2f ms per FIFO batch (%.2f ms on the bus), %.2f ms in standard mode, %.2f ms saved (%u batches)\n",
+             stats->em1_us/1000.0/batches, stats->i2c_async_us/1000.0/batches,
+             stats->i2c_async_standard_us/1000.0/batches,
+             ((double)stats->i2c_async_standard_us - (double)stats->i2c_async_us)/1000.0/batches, batches);
+  }
+  printf("  FIFO        %u overflows, %u samples dropped, %u empty batches, %u illegal rates\n",
+         stats->fifo_overflows, stats->fifo_dropped, stats->fifo_empty, stats->illegal_configs);
+  printf("  HR          %u results, %u sent, %u confirmed, %u pending, %u lost (%u dropped, %u rejected, %u ATT timeouts)\n",
+         stats->hr_results, stats->hr_sent, stats->hr_confirmed, stats->hr_pending, lost,
+         stats->hr_dropped, stats->rejected, stats->att_timeouts);
+
+  if (n)
+  {
+      qsort(stats->latencies, n, sizeof(stats->latencies[0]), Host_DES_Compare);
+
+      printf("  latency     FIFO interrupt to indication, ms: min %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f (%u)\n",
+             stats->latencies[0]/1000.0, stats->latencies[n/2]/1000.0, stats->latencies[(n*9)/10]/1000.0,
+             stats->latencies[(n*99)/100]/1000.0, stats->latencies[n - 1]/1000.0, n);
+  }
+
+  if (scenario->pulse_stop_s)
+    printf("  pulse stop  at %u s, reading at the end %u bpm, status LED %u\n",
+           scenario->pulse_stop_s, stats->hr_final, stats->hr_condition);
+
+  printf("  cbfifo      max %u of %u records, depth:", stats->queue_max, (unsigned)HOST_DES_QUEUE_RECORDS);
+  for (uint32_t i = 0; i <= stats->queue_max; i++)
+    printf(" %u:%u", i, stats->queue_hist[i]);
+  printf("\n");
+
+  return (stats->fifo_overflows == 0) && (stats->fifo_dropped == 0) && (stats->fifo_empty == 0) &&
+         (stats->illegal_configs == 0) &&
+         (!scenario->pulse_stop_s || ((stats->hr_final == 0) && (stats->hr_condition == condition_NotUsed)));
+}
+
+
+#ifdef HOST_DES
+
+static const host_des_scenario_t scenarios[] =
+{
+  //  name             FIFO preset                  I2C                    bpm  time  conn  reconn  interval busy loss  LED    temp   stop  seed
+  { "quiet link",      MAX_30101_FIFO_BALANCED,     I2C_FREQ_FAST_MAX,     96,  600,  500,  2000,   75000,   0,   0,    false, false, 0,    1 },
+  { "quiet link",      MAX_30101_FIFO_LOW_LATENCY,  I2C_FREQ_FAST_MAX,     96,  600,  500,  2000,   75000,   0,   0,    false, false, 0,    1 },
+  { "quiet link",      MAX_30101_FIFO_MIN_WAKEUPS,  I2C_FREQ_FAST_MAX,     96,  600,  500,  2000,   75000,   0,   0,    false, false, 0,    1 },
+  { "all indications", MAX_30101_FIFO_BALANCED,     I2C_FREQ_FAST_MAX,     96,  600,  500,  2000,   75000,   0,   0,    true,  true,  0,    1 },
+  { "busy link",       MAX_30101_FIFO_BALANCED,     I2C_FREQ_FAST_MAX,     96,  600,  500,  2000,   75000,   60,  0,    true,  true,  0,    2 },
+  { "lossy client",    MAX_30101_FIFO_BALANCED,     I2C_FREQ_FAST_MAX,     96,  600,  500,  2000,   75000,   20,  5,    true,  true,  0,    3 },
+  { "standard mode",   MAX_30101_FIFO_BALANCED,     I2C_FREQ_STANDARD_MAX, 96,  600,  500,  2000,   75000,   0,   0,    false, false, 0,    1 },
+  { "pulse stops",     MAX_30101_FIFO_BALANCED,     I2C_FREQ_FAST_MAX,     96,  300,  500,  2000,   75000,   0,   0,    true,  false, 150,  1 },
+};
+
+int main (int argc, char *argv[])
+{
+  static host_des_stats_t stats;
+  int n = sizeof(scenarios)/sizeof(scenarios[0]);
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  if (argc > 1)
+  {
+      int i = atoi(argv[1]);
+
+      if ((i < 0) || (i >= n))
+        return 1;
+
+      Host_DES_Run(&scenarios[i], &stats);
+
+      return Host_DES_Report(&scenarios[i], &stats) ? 0 : 1;
+  }
+
+  // The firmware can't be put back to its power on state, every scenario
+  // gets a fresh process. A failed scenario doesn't stop the others.
+  int failures = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+      char cmd[512];
+
+      snprintf(cmd, sizeof(cmd), "\"%s\" %d", argv[0], i);
+      if (system(cmd) != 0)
+      {
+          printf("%s: FAILED\n", scenarios[i].name);
+          failures++;
+      }
+  }
+
+  return failures ? 1 : 0;
+}
+
+#endif
+
+#endif /* HOST_BUILD */
@@ -0,0 +1,89 @@
+/*
+ * host_des.h
+ *
+ *  Discrete event simulation on the host build: the firmware's own
+ *  ble_handler() and state_machine_hr() run on virtual time, driven by the
+ *  LETIMER underflow, the MAX30101 interrupt line, I2C completions, the
+ *  stack's soft timers and a Bluetooth link that carries and confirms the
+ *  indications. Build instructions in host_des.c.
+ *
+ */
+
+#ifndef SRC_HOST_DES_H_
+#define SRC_HOST_DES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "MAX_30101.h"
+#include "scheduler.h"
+
+#define HOST_DES_RECORD_LEN       (11)  // Bytes per indication queued in cbfifo
+#define HOST_DES_QUEUE_RECORDS    (ARRAY_CAPACITY/HOST_DES_RECORD_LEN)
+#define HOST_DES_MAX_LATENCIES    (4096) // Latency samples kept per run
+#define HOST_DES_ATT_TIMEOUT_US   (30000000ULL) // Unconfirmed indication, the stack drops the link
+
+typedef struct
+{
+  const char *name;
+  max_30101_fifo_preset_t fifo_preset;
+  uint32_t bus_hz;                  // SCL of the MAX30101 bus speed profile
+  uint32_t bpm;                     // Pulse of the finger on the sensor
+  uint32_t duration_s;              // Virtual time simulated
+  uint32_t connect_ms;              // Client connects, bonds and enables the indications
+  uint32_t reconnect_ms;            // Client comes back after the link was dropped
+  uint32_t conn_interval_us;
+  uint8_t busy_pct;                 // Chance a connection event can't carry our packet (BLE load)
+  uint8_t confirm_loss_pct;         // Chance the client never confirms an indication
+  bool led_indications;             // Client also enables the status LED indications
+  bool temp_indications;            // Client also enables the die temperature indications
+  uint32_t pulse_stop_s;            // The pulse stops, something stays on the sensor, 0 for never
+  uint32_t seed;
+} host_des_scenario_t;
+
+typedef struct
+{
+  uint64_t sim_us;
+  uint64_t em1_us;
+
+  // Interrupts and stack events that woke the application up
+  uint32_t wakeups_letimer;
+  uint32_t wakeups_sensor;
+  uint32_t wakeups_i2c;
+  uint32_t wakeups_soft_timer;
+  uint32_t wakeups_ble;
+  uint32_t signals_merged;
+
+  // Interrupt driven transfers, the core is in EM1 while they are on the bus
+  uint32_t fifo_batches;
+  uint32_t fifo_overflows;
+  uint32_t fifo_dropped;            // Samples lost to the overflows
+  uint32_t fifo_empty;              // Batches with no samples
+  uint32_t illegal_configs;         // Rates the model refused (MAX_30101_sim.h)
+  uint64_t i2c_async_us;
+  uint64_t i2c_async_standard_us;   // The same transfers in standard mode
+
+  // Heart rate results while the client had the indications on
+  uint32_t hr_results;
+  uint32_t hr_sent;
+  uint32_t hr_confirmed;
+  uint32_t hr_dropped;              // Neither sent nor queued
+  uint32_t rejected;                // Sent while another indication was in flight
+  uint32_t att_timeouts;            // Not confirmed, link dropped
+  uint32_t hr_pending;              // Still queued or in flight at the end
+  uint32_t hr_final;                // Reading at the end, 0 once cleared
+  uint8_t hr_condition;             // Status LED value at the end
+
+  // cbfifo depth in records, sampled after every event
+  uint32_t queue_max;
+  uint32_t queue_hist[HOST_DES_QUEUE_RECORDS + 1];
+
+  // FIFO interrupt to HR indication leaving the device, us
+  uint32_t latencies[HOST_DES_MAX_LATENCIES];
+  uint32_t nlatencies;
+} host_des_stats_t;
+
+void Host_DES_Run (const host_des_scenario_t *scenario, host_des_stats_t *stats);
+bool Host_DES_Report (const host_des_scenario_t *scenario, host_des_stats_t *stats);
+
+#endif /* SRC_HOST_DES_H_ */
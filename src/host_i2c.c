@@ -0,0 +1,222 @@
+/*
+ * host_i2c.c
+ *
+ *  Test of the interrupt driven I2C transaction queue of i2c.c on the host
+ *  build (host.c). Only compiled with HOST_BUILD, the file is empty in the
+ *  Simplicity Studio build.
+ *
+ *  i2c.c is compiled in as it is, with the I2C0 registers, the NVIC and the
+ *  SCL/SDA pins taken over by a scripted controller: I2C_TransferInit()
+ *  puts a transaction on the bus and I2C_Transfer() returns what the test
+ *  sets in host_i2c.result. The interrupt is i2c_Queue_IRQ() called by the
+ *  test.
+ *
+ *  Build and run, from the repository root, SDK_INC as in host.c:
+ *
+ *    gcc -std=gnu99 -g -Wall -fsanitize=address,undefined -DHOST_BUILD -DHOST_I2C \
+ *        -DEFR32BG13P632F512GM48=1 -DSL_COMPONENT_CATALOG_PRESENT=1 \
+ *        '-DMBEDTLS_CONFIG_FILE=<mbedtls_config.h>' $SDK_INC -Isrc \
+ *        src/host_i2c.c src/host.c src/scheduler.c src/cbfifo.c src/ble.c src/MAX_30101.c \
+ *        src/MAX_30101_sim.c src/sensor_bus.c src/sensor_capture.c src/autocorrelate.c -lm -o host_i2c
+ *    ./host_i2c
+ *
+ *  or make host_i2c (Makefile of the repository root).
+ *
+ */
+
+#ifdef HOST_BUILD
+
+#ifdef HOST_I2C
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "host.h"
+#include "i2c.h"
+
+typedef struct
+{
+  uint32_t starts;                      // I2C_TransferInit() calls
+  uint16_t addr;                        // Address (left shifted) of the last one started
+  I2C_TransferReturn_TypeDef result;    // Returned by I2C_Transfer() in the interrupt
+  bool irq_enabled;                     // I2C0_IRQn in the NVIC
+} host_i2c_t;
+
+static host_i2c_t host_i2c;
+static I2C_TypeDef host_i2c0;
+
+static void Host_NVIC_Enable (IRQn_Type irq, bool enable)
+{
+  if (irq == I2C0_IRQn)
+    host_i2c.irq_enabled = enable;
+}
+
+// What i2c.c touches of the hardware, the lines are idle (high)
+#undef I2C0
+#define I2C0 (&host_i2c0)
+
+#undef NVIC_EnableIRQ
+#undef NVIC_DisableIRQ
+#undef NVIC_ClearPendingIRQ
+#define NVIC_EnableIRQ(irq)         Host_NVIC_Enable((irq), true)
+#define NVIC_DisableIRQ(irq)        Host_NVIC_Enable((irq), false)
+#define NVIC_ClearPendingIRQ(irq)   ((void)(irq))
+
+#define GPIO_PinInGet(port, pin)    ((void)(port), (void)(pin), 1U)
+#define GPIO_PinOutSet(port, pin)   ((void)(port), (void)(pin))
+#define GPIO_PinOutClear(port, pin) ((void)(port), (void)(pin))
+
+#include "i2c.c"
+
+
+/**************************************************************************//**
+ * emlib, I2CSPM and the timers, on the scripted controller
+ *****************************************************************************/
+void I2CSPM_Init (I2CSPM_Init_TypeDef *init)
+{
+  (void)init;
+}
+
+I2C_TransferReturn_TypeDef I2CSPM_Transfer (I2C_TypeDef *i2c, I2C_TransferSeq_TypeDef *seq)
+{
+  (void)i2c;
+  (void)seq;
+
+  return i2cTransferDone;
+}
+
+I2C_TransferReturn_TypeDef I2C_TransferInit (I2C_TypeDef *i2c, I2C_TransferSeq_TypeDef *seq)
+{
+  (void)i2c;
+
+  host_i2c.starts++;
+  host_i2c.addr = seq->addr;
+  host_i2c.result = i2cTransferInProgress;
+
+  return i2cTransferInProgress;
+}
+
+I2C_TransferReturn_TypeDef I2C_Transfer (I2C_TypeDef *i2c)
+{
+  (void)i2c;
+
+  return host_i2c.result;
+}
+
+void I2C_Enable (I2C_TypeDef *i2c, bool enable)
+{
+  (void)i2c;
+  (void)enable;
+}
+
+uint32_t I2C_BusFreqGet (I2C_TypeDef *i2c)
+{
+  (void)i2c;
+
+  return i2c_speed_current->max_hz;
+}
+
+void I2C_BusFreqSet (I2C_TypeDef *i2c, uint32_t freqRef, uint32_t freqScl, I2C_ClockHLR_TypeDef i2cMode)
+{
+  (void)i2c;
+  (void)freqRef;
+  (void)freqScl;
+  (void)i2cMode;
+}
+
+void GPIO_PinModeSet (GPIO_Port_TypeDef port, unsigned int pin, GPIO_Mode_TypeDef mode, unsigned int out)
+{
+  (void)port;
+  (void)pin;
+  (void)mode;
+  (void)out;
+}
+
+void sl_udelay_wait (unsigned us)
+{
+  Host_Advance(us);
+}
+
+uint64_t letimerMicroseconds ()
+{
+  return host.now_us;
+}
+
+
+/**************************************************************************//**
+ * Completions seen by the owners of the transactions
+ *****************************************************************************/
+typedef struct
+{
+  uint32_t completions;
+  I2C_TransferReturn_TypeDef result;
+} host_i2c_owner_t;
+
+static void host_i2c_done (const i2c_transaction_t *transaction, I2C_TransferReturn_TypeDef trans_ret)
+{
+  host_i2c_owner_t *owner = transaction->ctx;
+
+  owner->completions++;
+  owner->result = trans_ret;
+}
+
+
+int main()
+{
+  static host_i2c_owner_t owner_a, owner_b;
+  uint8_t data_a[6];
+
+  i2c_transaction_t transaction_a =
+  {
+    .addr = MAX_30101_ADDRESS,
+    .flags = I2C_FLAG_WRITE_READ,
+    .cmd = { 0x07 },
+    .cmd_len = 1,
+    .data = data_a,
+    .len = sizeof(data_a),
+    .callback = host_i2c_done,
+    .ctx = &owner_a,
+  };
+  i2c_transaction_t transaction_b =
+  {
+    .addr = Si7021_SLAVE_ADDRESS_TEMP,
+    .flags = I2C_FLAG_READ,
+    .len = 2,
+    .callback = host_i2c_done,
+    .ctx = &owner_b,
+  };
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  Host_Reset();
+  i2c_Init();
+
+  // A goes on the bus, B waits behind it
+  assert(i2c_Queue_Submit(&transaction_a) && i2c_Queue_Submit(&transaction_b));
+  assert(host_i2c.starts == 1 && host_i2c.addr == (MAX_30101_ADDRESS << 1));
+  assert(host_i2c.irq_enabled && host.em1_requirements == 1);
+
+  // A byte of A moves, then its owner cancels it in the middle
+  i2c_Queue_IRQ();
+  i2c_Queue_Cancel(&owner_a);
+
+  // The slave gets a STOP, B is started right away
+  assert(host_i2c0.CMD == (I2C_CMD_STOP | I2C_CMD_ABORT));
+  assert(host_i2c.starts == 2 && host_i2c.addr == (Si7021_SLAVE_ADDRESS_TEMP << 1));
+
+  // B completes, A is never reported
+  host_i2c.result = i2cTransferDone;
+  i2c_Queue_IRQ();
+
+  assert(owner_a.completions == 0);
+  assert(owner_b.completions == 1 && owner_b.result == i2cTransferDone);
+  assert(!i2c_Queue_Busy() && !host_i2c.irq_enabled && host.em1_requirements == 0);
+
+  printf("I2C queue OK\n");
+
+  return 0;
+}
+
+#endif
+
+#endif /* HOST_BUILD */
@@ -0,0 +1,238 @@
+/*
+ * host_replay.c
+ *
+ *  Replay of a sensor capture (sensor_capture.h) on the host build (host.c).
+ *  Only compiled with HOST_BUILD, the file is empty in the Simplicity Studio
+ *  build.
+ *
+ *  The captured events are handed to the firmware in order, on virtual time,
+ *  and every register transfer it makes is answered from the capture by the
+ *  replay backend of the sensor bus. The FIFO bursts, pointers and die
+ *  temperature go through the same drain, window and autocorrelation code as
+ *  on the device, so the results are bit-exact. Any transfer that differs
+ *  from the capture (register, length, or the configuration written) is a
+ *  mismatch and fails the replay. There is no waiting, an hour of capture
+ *  replays in well under a second.
+ *
+ *  Captures come from a device built with SENSOR_CAPTURE (scheduler.c), or
+ *  from the self test of host.c built with -DSENSOR_CAPTURE=1:
+ *
+ *    ./host_test | sed -n 's/^SCAP //p' | xxd -r -p > model.scap
+ *
+ *  Build, from the repository root, SDK_INC as in host.c:
+ *
+ *    gcc -std=gnu99 -O2 -Wall -DHOST_BUILD -DHOST_REPLAY \
+ *        -DEFR32BG13P632F512GM48=1 -DSL_COMPONENT_CATALOG_PRESENT=1 \
+ *        '-DMBEDTLS_CONFIG_FILE=<mbedtls_config.h>' $SDK_INC -Isrc \
+ *        src/host_replay.c src/host.c src/scheduler.c src/cbfifo.c src/ble.c src/MAX_30101.c \
+ *        src/MAX_30101_sim.c src/sensor_bus.c src/sensor_capture.c src/autocorrelate.c -lm -o host_replay
+ *    ./host_replay session.scap          one line per heart rate result
+ *    ./host_replay -v session.scap       with the log of the firmware
+ *
+ *  A corpus is a directory of captures with the expected output next to
+ *  them:
+ *
+ *    find corpus -name '*.scap' | while read f; do ./host_replay "$f" | diff -q - "${f%.scap}.out"; done
+ *
+ */
+
+#ifdef HOST_BUILD
+
+#ifdef HOST_REPLAY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host.h"
+#include "ble.h"
+#include "MAX_30101.h"
+#include "sensor_capture.h"
+
+#define HOST_REPLAY_ADDRESS (0x57)
+
+// Globals of scheduler.c
+extern uint32_t count;                      // Heart rate results so far
+extern uint32_t heart_rate;
+extern uint32_t window_len;
+
+static uint32_t last_count = 0;
+
+
+/**************************************************************************//**
+ * Prints every heart rate result as the firmware produces it
+ *****************************************************************************/
+static void replay_result (void *ctx, sl_bt_msg_t *evt, bool done)
+{
+  ble_data_struct_t *ble_data_ptr = getBleDataPtr();
+
+  (void)ctx;
+  (void)evt;
+
+  if (!done || (count == last_count))
+    return;
+
+  last_count = count;
+
+  printf("%10.3f s  HR %3u bpm  PI %2u.%02u %%  DC %6u  AC %6u  window %4u\n",
+         host.now_us/1e6, (unsigned)heart_rate,
+         ble_data_ptr->perfusion_index/100, ble_data_ptr->perfusion_index%100,
+         (unsigned)ble_data_ptr->dc_level, (unsigned)ble_data_ptr->ac_peak_to_peak,
+         (unsigned)window_len);
+}
+
+
+/**************************************************************************//**
+ * This function reads a whole file
+ *
+ * @param:
+ *      path: The file
+ *      len:  Receives the size
+ *
+ * @return:
+ *      The contents (to be freed), NULL on error
+ *****************************************************************************/
+static uint8_t* replay_load (const char *path, size_t *len)
+{
+  FILE *file = fopen(path, "rb");
+  uint8_t *data = NULL;
+  long size;
+
+  if (file == NULL)
+    return NULL;
+
+  if ((fseek(file, 0, SEEK_END) == 0) && ((size = ftell(file)) >= 0) && (fseek(file, 0, SEEK_SET) == 0))
+  {
+      data = malloc(size ? size : 1);
+      if (data && (fread(data, 1, size, file) != (size_t)size))
+      {
+          free(data);
+          data = NULL;
+      }
+      *len = size;
+  }
+
+  fclose(file);
+
+  return data;
+}
+
+
+int main (int argc, char *argv[])
+{
+  static sensor_bus_t bus;
+  static sensor_bus_replay_t replay;
+  sensor_capture_trace_t trace;
+  const char *path = NULL;
+  uint8_t *data;
+  size_t len = 0;
+  uint64_t t_us = 0;
+  uint32_t diverged_at = 0;
+  bool truncated = false;
+  bool verbose = false;
+  struct timespec wall_start, wall_end;
+
+  for (int i = 1; i < argc; i++)
+  {
+      if (strcmp(argv[i], "-v") == 0)
+        verbose = true;
+      else
+        path = argv[i];
+  }
+
+  if (path == NULL)
+  {
+      fprintf(stderr, "usage: %s [-v] capture.scap\n", argv[0]);
+      return 2;
+  }
+
+  data = replay_load(path, &len);
+  if (data == NULL)
+  {
+      fprintf(stderr, "%s: can't read\n", path);
+      return 2;
+  }
+
+  // Every record takes at least a record header
+  trace.max_records = trace.max_signals = len/SENSOR_CAPTURE_RECORD_HEADER + 1;
+  trace.records = malloc(trace.max_records*sizeof(*trace.records));
+  trace.signals = malloc(trace.max_signals*sizeof(*trace.signals));
+
+  if (!trace.records || !trace.signals || !Sensor_Capture_Decode(data, len, &trace))
+  {
+      fprintf(stderr, "%s: not a capture\n", path);
+      free(trace.records);
+      free(trace.signals);
+      free(data);
+      return 2;
+  }
+
+  setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+  Host_Reset();
+  host.log_muted = !verbose;
+  host.dispatch_hook = replay_result;
+  ble_Init();
+
+  Sensor_Bus_Replay_Init(&bus, &replay, trace.records, trace.nrecords);
+  MAX_30101_Attach(&bus, HOST_REPLAY_ADDRESS);
+
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+  for (size_t i = 0; i < trace.nsignals; i++)
+  {
+      if (i > 0)
+        t_us += (uint32_t)(trace.signals[i].t_us - trace.signals[i - 1].t_us);
+
+      // Blocking waits of the firmware may already have gone past it
+      if (t_us > host.now_us)
+        Host_Advance(t_us - host.now_us);
+
+      Host_Dispatch_Signals(trace.signals[i].signal);
+      Host_Run_Signals();
+
+      // A transfer past the last one recorded: the stream was stopped while
+      // this event was handled
+      if (replay.mismatches && (replay.next == trace.nrecords))
+      {
+          truncated = true;
+          break;
+      }
+
+      if (replay.mismatches)
+      {
+          diverged_at = i + 1;
+          break;
+      }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+  double wall_s = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec)/1e9;
+
+  printf("%u events, %u of %u transfers replayed, %u results\n",
+         (unsigned)trace.nsignals, (unsigned)replay.next, (unsigned)trace.nrecords, (unsigned)count);
+  fflush(stdout);
+
+  // Speed goes to stderr, the output on stdout is the same on every run
+  fprintf(stderr, "%.1f s of capture in %.3f s (%.0fx real time)\n",
+          trace.duration_us/1e6, wall_s, wall_s > 0 ? trace.duration_us/1e6/wall_s : 0);
+
+  if (trace.lost)
+    fprintf(stderr, "%s: %u records lost on the device, replayed up to there\n", path, (unsigned)trace.lost);
+  if (truncated)
+    fprintf(stderr, "%s: capture ends in the middle of an event\n", path);
+  if (diverged_at)
+    fprintf(stderr, "%s: diverged from the capture at event %u\n", path, (unsigned)diverged_at);
+
+  free(trace.records);
+  free(trace.signals);
+  free(data);
+
+  return (diverged_at || (replay.next != trace.nrecords)) ? 1 : 0;
+}
+
+#endif
+
+#endif /* HOST_BUILD */
@@ -8,21 +8,78 @@
  */
 
 #include "i2c.h"
+#include "sl_udelay.h"
 
 // Include logging for this file
 #define INCLUDE_LOG_DEBUG 1
 #include "src/log.h"
 #include "scheduler.h"
+#include "irq.h"
 
 
 /**************************************************************************//**
  * GLOBAL Variable Declarations
  *****************************************************************************/
-I2C_TransferReturn_TypeDef transferStatus; // A struct that keeps track of the transfer status
-I2C_TransferSeq_TypeDef transferSequence; // A struct that stores the transfer sequence that the data/command has to be transfered
-uint8_t cmd_data;
-uint16_t read_data;
-uint8_t received_data[2] = {0}; // An array to store the bits that are being received by the master
+uint32_t transaction_count = 0; // Number of blocking transactions issued on the bus
+
+
+/**************************************************************************//**
+ * Queue of the interrupt driven transactions
+ *
+ * Transactions are copied in, so the command bytes and the short data live in
+ * the queue and the caller's descriptor need not outlive the call. The head is
+ * on the bus, I2C0_IRQHandler retires it and starts the next one back to back.
+ * The core sleeps in EM1 while the queue is not empty.
+ *****************************************************************************/
+static i2c_transaction_t i2c_queue[I2C_QUEUE_LEN];
+static volatile uint8_t i2c_queue_head = 0, i2c_queue_count = 0;
+static volatile bool i2c_queue_running = false;     // The head is on the bus
+static volatile bool i2c_queue_dispatching = false; // Completion callbacks are running
+static bool i2c_queue_em1 = false;                  // EM1 requirement taken
+static I2C_TransferSeq_TypeDef i2c_queue_sequence;  // Sequence of the head, emlib keeps a pointer to it
+static uint8_t i2c_queue_attempt = 0;               // Retries of the head so far
+static volatile bool i2c_queue_retrying = false;    // The head failed, i2c_Queue_Signal() puts it back on the bus
+static I2C_TransferReturn_TypeDef i2c_queue_fault;  // Outcome of the failed attempt of the head
+
+static void i2c_Queue_Start_Head();
+
+
+/**************************************************************************//**
+ * Bus speed profiles of the devices
+ *
+ * Devices without a profile get the standard mode timing every device on the
+ * bus supports. A slower device ignores fast traffic to other addresses, so
+ * the speed only has to suit the addressed device.
+ *****************************************************************************/
+const i2c_speed_profile_t i2c_speed_standard = { I2C_FREQ_STANDARD_MAX, i2cClockHLRStandard };
+const i2c_speed_profile_t i2c_speed_fast = { I2C_FREQ_FAST_MAX, i2cClockHLRAsymetric };
+
+typedef struct
+{
+  uint8_t addr;
+  const i2c_speed_profile_t *profile;     // NULL for a free entry
+} i2c_speed_device_t;
+
+static i2c_speed_device_t i2c_speed_devices[I2C_SPEED_DEVICES];
+static const i2c_speed_profile_t *i2c_speed_current = &i2c_speed_standard; // Set by i2c_Init()
+static uint32_t i2c_bus_hz = 0;
+
+
+/**************************************************************************//**
+ * Recovery of transient bus faults
+ *
+ * A failed transaction is attempted again up to I2C_RETRIES times, with a
+ * doubling wait in between. A NACK ends with a STOP and leaves the bus free.
+ * Any other fault may leave a slave in the middle of a byte, holding SDA
+ * low, so the bus is cleared and the controller re-initialised first. Only
+ * a transaction that still fails, or a bus that stays stuck, is reported to
+ * the caller, which escalates to a system error.
+ *
+ * The recovery and the backoff are always done in thread context: the
+ * queue only notes the fault in I2C0_IRQHandler and leaves the retry to
+ * i2c_Queue_Signal().
+ *****************************************************************************/
+static i2c_recovery_stats_t i2c_recovery_stats;
 
 
 /**************************************************************************//**
@@ -48,6 +105,281 @@ void i2c_Init()
   //  Passing the struct to the initialization function
   I2CSPM_Init(&I2C_Config);
 
+  i2c_speed_current = &i2c_speed_standard;
+  i2c_bus_hz = I2C_BusFreqGet(I2C0);
+}
+
+
+/**************************************************************************//**
+ * This function sets the bus speed profile of a device
+ *
+ * @param:
+ *      addr:    7 bit address of the device
+ *      profile: Its timing, NULL for the standard mode default
+ *
+ * @return:
+ *      false if there are already I2C_SPEED_DEVICES profiles
+ *****************************************************************************/
+bool i2c_Set_Speed_Profile (uint8_t addr, const i2c_speed_profile_t *profile)
+{
+  i2c_speed_device_t *free_entry = NULL;
+
+  for (int i = 0; i < I2C_SPEED_DEVICES; i++)
+  {
+      if (i2c_speed_devices[i].profile && (i2c_speed_devices[i].addr == addr))
+      {
+          i2c_speed_devices[i].profile = profile;
+          return true;
+      }
+      if (!i2c_speed_devices[i].profile && !free_entry)
+        free_entry = &i2c_speed_devices[i];
+  }
+
+  if (profile == NULL)
+    return true;
+
+  if (free_entry == NULL)
+  {
+      LOG_ERROR("No room for the bus speed of 0x%02x", addr);
+      return false;
+  }
+
+  free_entry->addr = addr;
+  free_entry->profile = profile;
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function sets the bus to the speed of a device when it is at another
+ * one. Only called between transactions, the bus is idle.
+ *
+ * @param:
+ *      addr: 7 bit address of the device about to be addressed
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void i2c_Apply_Speed (uint8_t addr)
+{
+  const i2c_speed_profile_t *profile = &i2c_speed_standard;
+
+  for (int i = 0; i < I2C_SPEED_DEVICES; i++)
+  {
+      if (i2c_speed_devices[i].profile && (i2c_speed_devices[i].addr == addr))
+      {
+          profile = i2c_speed_devices[i].profile;
+          break;
+      }
+  }
+
+  if (profile == i2c_speed_current)
+    return;
+
+  I2C_BusFreqSet(I2C0, 0, profile->max_hz, profile->clhr);
+
+  i2c_speed_current = profile;
+  i2c_bus_hz = I2C_BusFreqGet(I2C0);
+}
+
+
+/**************************************************************************//**
+ * This function returns the SCL frequency the bus is set to, of the last
+ * device addressed
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Frequency in Hz
+ *****************************************************************************/
+uint32_t i2c_Get_Bus_Hz()
+{
+  return i2c_bus_hz;
+}
+
+
+/**************************************************************************//**
+ * This function clears the bus and re-initialises the controller. The lines
+ * are taken over as GPIOs and SCL is clocked until the slave holding SDA lets
+ * go of it, then a STOP puts every slave back to idle. The bus must not be
+ * in use: called between attempts of a transaction.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      false if SCL or SDA is still held low
+ *****************************************************************************/
+bool i2c_Recover()
+{
+  bool released;
+
+  // The controller lets go of the lines
+  I2C0->CMD = I2C_CMD_ABORT;
+  I2C_Enable(I2C0, false);
+  I2C0->ROUTEPEN = 0;
+
+  GPIO_PinModeSet(SCL_PORT, SCL_PIN, gpioModeWiredAndPullUp, 1);
+  GPIO_PinModeSet(SDA_PORT, SDA_PIN, gpioModeWiredAndPullUp, 1);
+  sl_udelay_wait(I2C_RECOVERY_HALF_US);
+
+  // A slave cut off in a read drives SDA for its 0 bits, it lets go at the
+  // latest after the rest of the byte and the ACK slot
+  for (int i = 0; (i < I2C_RECOVERY_CLOCKS) && !GPIO_PinInGet(SDA_PORT, SDA_PIN); i++)
+  {
+      GPIO_PinOutClear(SCL_PORT, SCL_PIN);
+      sl_udelay_wait(I2C_RECOVERY_HALF_US);
+      GPIO_PinOutSet(SCL_PORT, SCL_PIN);
+      sl_udelay_wait(I2C_RECOVERY_HALF_US);
+  }
+
+  // STOP: SDA rises while SCL is high
+  GPIO_PinOutClear(SCL_PORT, SCL_PIN);
+  sl_udelay_wait(I2C_RECOVERY_HALF_US);
+  GPIO_PinOutClear(SDA_PORT, SDA_PIN);
+  sl_udelay_wait(I2C_RECOVERY_HALF_US);
+  GPIO_PinOutSet(SCL_PORT, SCL_PIN);
+  sl_udelay_wait(I2C_RECOVERY_HALF_US);
+  GPIO_PinOutSet(SDA_PORT, SDA_PIN);
+  sl_udelay_wait(I2C_RECOVERY_HALF_US);
+
+  released = GPIO_PinInGet(SCL_PORT, SCL_PIN) && GPIO_PinInGet(SDA_PORT, SDA_PIN);
+
+  // Pins, routing and controller as after boot, the speed profile of the
+  // next device is applied again before its transaction
+  i2c_Init();
+
+  i2c_recovery_stats.recoveries++;
+
+  if (!released)
+  {
+      i2c_recovery_stats.stuck++;
+      LOG_ERROR("I2C bus stuck: SCL %d SDA %d", GPIO_PinInGet(SCL_PORT, SCL_PIN), GPIO_PinInGet(SDA_PORT, SDA_PIN));
+  }
+
+  return released;
+}
+
+
+/**************************************************************************//**
+ * This function decides whether a failed transaction has a retry left. Safe
+ * in interrupt context, nothing is done on the bus.
+ *
+ * @param:
+ *      trans_ret: Outcome of the attempt
+ *      attempt:   Retries done so far
+ *
+ * @return:
+ *      true to attempt the transaction again, false to report trans_ret
+ *****************************************************************************/
+static bool i2c_Retry_Left (I2C_TransferReturn_TypeDef trans_ret, uint8_t attempt)
+{
+  // A bad sequence fails the same way every time
+  if ((trans_ret == i2cTransferDone) || (trans_ret == i2cTransferInProgress) ||
+      (trans_ret == i2cTransferUsageFault))
+    return false;
+
+  if (attempt >= I2C_RETRIES)
+  {
+      i2c_recovery_stats.failures++;
+      return false;
+  }
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function gets the bus ready for the retry of a failed transaction.
+ * The bus is recovered when the fault may have left it busy, then the
+ * backoff is waited. Thread context only.
+ *
+ * @param:
+ *      trans_ret: Outcome of the attempt
+ *      attempt:   Retries done so far
+ *
+ * @return:
+ *      false if the bus stays stuck, trans_ret is reported
+ *****************************************************************************/
+static bool i2c_Retry_Prepare (I2C_TransferReturn_TypeDef trans_ret, uint8_t attempt)
+{
+  if ((trans_ret != i2cTransferNack) && !i2c_Recover())
+  {
+      i2c_recovery_stats.failures++;
+      return false;
+  }
+
+  LOG_WARN("I2C error %d, retry %d of %d", trans_ret, attempt + 1, I2C_RETRIES);
+
+  sl_udelay_wait(I2C_BACKOFF_US << attempt);
+
+  i2c_recovery_stats.retries++;
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function decides whether a failed polled transaction is attempted
+ * again, and gets the bus ready for it
+ *
+ * @param:
+ *      trans_ret: Outcome of the attempt
+ *      attempt:   Retries done so far
+ *
+ * @return:
+ *      true to attempt the transaction again, false to report trans_ret
+ *****************************************************************************/
+static bool i2c_Retry (I2C_TransferReturn_TypeDef trans_ret, uint8_t attempt)
+{
+  return i2c_Retry_Left(trans_ret, attempt) && i2c_Retry_Prepare(trans_ret, attempt);
+}
+
+
+/**************************************************************************//**
+ * This function returns the retries and recoveries since boot
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      The counters
+ *****************************************************************************/
+const i2c_recovery_stats_t* i2c_Get_Recovery_Stats()
+{
+  return &i2c_recovery_stats;
+}
+
+
+/**************************************************************************//**
+ * This function does a polled transfer at the speed of the addressed device,
+ * with the retries of a transient fault
+ *
+ * @param:
+ *      sequence: The transfer
+ *
+ * @return:
+ *      i2cTransferDone or the error code of the last attempt
+ *****************************************************************************/
+static I2C_TransferReturn_TypeDef i2c_Transfer_blocking (I2C_TransferSeq_TypeDef *sequence)
+{
+  I2C_TransferReturn_TypeDef trans_ret;
+  uint8_t attempt = 0;
+
+  do
+  {
+      i2c_Apply_Speed(sequence->addr >> 1);
+
+      trans_ret = I2CSPM_Transfer(I2C0, sequence);
+
+      // I2CSPM gave up polling, the bus is held
+      if (trans_ret == i2cTransferInProgress)
+        trans_ret = i2cTransferSwFault;
+  } while (i2c_Retry(trans_ret, attempt++));
+
+  return trans_ret;
 }
 
 
@@ -63,14 +395,22 @@ void i2c_Init()
  *****************************************************************************/
 void i2c_Write_blocking()
 {
-  cmd_data = 0xF3; // Measure Temperature, No Hold Master Mode
+  I2C_TransferSeq_TypeDef transferSequence; // A struct that stores the transfer sequence that the data/command has to be transfered
+  uint8_t cmd_data = Si7021_MEASURE_TEMP_NO_HOLD;
+
+  if (i2c_Queue_Busy())
+  {
+      LOG_ERROR("I2C Write error: queue busy");
+      return;
+  }
+
   transferSequence.flags = I2C_FLAG_WRITE, // Write command
   transferSequence.addr = (Si7021_SLAVE_ADDRESS_TEMP<<1), // Slave address needs to be left shift by one bit
   transferSequence.buf[0].data = &cmd_data, // Passing the pointer that has the command data stored
   transferSequence.buf[0].len = sizeof(cmd_data); // Length of the command data
 
   // This will initialize the write command on to the bus
-  I2C_TransferReturn_TypeDef trans_ret = I2CSPM_Transfer(I2C0,&transferSequence);
+  I2C_TransferReturn_TypeDef trans_ret = i2c_Transfer_blocking(&transferSequence);
 
   // Checking if the transfer is done or no.
   if(trans_ret != i2cTransferDone)
@@ -105,6 +445,14 @@ uint16_t i2c_Read_blocking(uint8_t len)
 {
   uint16_t tempvalue=0; // A variable to store the temperature value
   uint8_t received_data[2] = {0}; // An array to store the bits that are being received by the master
+  I2C_TransferSeq_TypeDef transferSequence;
+
+  if (i2c_Queue_Busy())
+  {
+      LOG_ERROR("I2C Read error: queue busy");
+      return 0;
+  }
+
   transferSequence.flags = I2C_FLAG_READ, // Read command
   transferSequence.addr = (Si7021_SLAVE_ADDRESS_TEMP<<1), // Slave address needs to be left shift by one bit
   transferSequence.buf[0].data = received_data, // Passing the array that will store the incoming data
@@ -114,7 +462,7 @@ uint16_t i2c_Read_blocking(uint8_t len)
   timerWaitUs_blocking(10800); // This is the amount of time that the sensor takes to transfer 14 bits of read data to the master
 
   // Initiating the transfer for the master to receive the data from the bus
-  I2C_TransferReturn_TypeDef trans_ret = I2CSPM_Transfer(I2C0, &transferSequence);
+  I2C_TransferReturn_TypeDef trans_ret = i2c_Transfer_blocking(&transferSequence);
 
 
   // If the transfer is not done then log an error
@@ -142,6 +490,42 @@ uint16_t i2c_Read_blocking(uint8_t len)
 }
 
 
+/**************************************************************************//**
+ * This function does a blocking register transfer: the register address is
+ * written, followed by either a write of the data or a repeated start and a
+ * read into it. It must not interleave with the queued transactions, which
+ * own the peripheral until the queue is empty. Transient faults are retried.
+ *
+ * @param:
+ *      addr:  7 bit address of the slave
+ *      write: true to write the data, false to read it
+ *      reg:   The register to start at
+ *      data:  Data to write or buffer for the data read
+ *      len:   Number of bytes
+ *
+ * @return:
+ *      i2cTransferDone or the error code
+ *****************************************************************************/
+static I2C_TransferReturn_TypeDef i2c_Reg_Transfer_blocking (uint8_t addr, bool write, uint8_t reg, uint8_t* data, size_t len)
+{
+  I2C_TransferSeq_TypeDef sequence;
+
+  sequence.flags = write ? I2C_FLAG_WRITE_WRITE : I2C_FLAG_WRITE_READ,
+  sequence.addr = (addr<<1), // Slave address needs to be left shift by one bit
+  sequence.buf[0].data = &reg, // Passing the pointer that has the command data stored
+  sequence.buf[0].len = sizeof(reg); // Length of the command data
+  sequence.buf[1].data = data,
+  sequence.buf[1].len = len;
+
+  if (i2c_Queue_Busy())
+    return i2cTransferUsageFault;
+
+  transaction_count++;
+
+  return i2c_Transfer_blocking(&sequence);
+}
+
+
 /**************************************************************************//**
  * This function sends a command to the bus with the address of the slave
  * and also sends the register to read data from. This also holds a pointer
@@ -153,17 +537,9 @@ uint16_t i2c_Read_blocking(uint8_t len)
  * TransferReturn struct is used to initialize the transfer and also store the
  * status of the transfer.
  *****************************************************************************/
-void i2c_Write_Read_blocking (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data)
+I2C_TransferReturn_TypeDef i2c_Write_Read_blocking (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data)
 {
-  transferSequence.flags = I2C_FLAG_WRITE_READ, // Write command
-  transferSequence.addr = (MAX_30101_ADDRESS<<1), // Slave address needs to be left shift by one bit
-  transferSequence.buf[0].data = &reg, // Passing the pointer that has the command data stored
-  transferSequence.buf[0].len = sizeof(reg); // Length of the command data
-  transferSequence.buf[1].data = read_data, // Passing the pointer that has the command data stored
-  transferSequence.buf[1].len = nbytes_read_data;
-
-  // This will initialize the write command on to the bus
-  I2C_TransferReturn_TypeDef trans_ret = I2CSPM_Transfer(I2C0,&transferSequence);
+  I2C_TransferReturn_TypeDef trans_ret = i2c_Reg_Transfer_blocking(MAX_30101_ADDRESS, false, reg, read_data, nbytes_read_data);
 
   // Checking if the transfer is done or no.
   if(trans_ret != i2cTransferDone)
@@ -171,11 +547,8 @@ void i2c_Write_Read_blocking (uint8_t reg, uint8_t* read_data, size_t nbytes_rea
         LOG_ERROR("I2C Write error: %d", trans_ret); // If transfer is not done then we will log error message
         createEventSystemError();
       }
-//  for (int i = 0; i < nbytes_read_data; i++)
-//    {
-//      printf("Reg 0x%02x :: Read %d:0x%02x\t", reg, i+1, *(read_data+i));
-//    }
-//  printf("\n\n");
+
+  return trans_ret;
 }
 
 
@@ -189,17 +562,9 @@ void i2c_Write_Read_blocking (uint8_t reg, uint8_t* read_data, size_t nbytes_rea
  * TransferReturn struct is used to initialize the transfer and also store the
  * status of the transfer.
  *****************************************************************************/
-void i2c_Write_Write_blocking (uint8_t reg, uint8_t* write_data, size_t nbytes_write_data)
+I2C_TransferReturn_TypeDef i2c_Write_Write_blocking (uint8_t reg, uint8_t* write_data, size_t nbytes_write_data)
 {
-  transferSequence.flags = I2C_FLAG_WRITE_WRITE, // Write command
-  transferSequence.addr = (MAX_30101_ADDRESS<<1), // Slave address needs to be left shift by one bit
-  transferSequence.buf[0].data = &reg, // Passing the pointer that has the command data stored
-  transferSequence.buf[0].len = sizeof(reg); // Length of the command data
-  transferSequence.buf[1].data = write_data, // Passing the pointer that has the command data stored
-  transferSequence.buf[1].len = nbytes_write_data;
-
-  // This will initialize the write command on to the bus
-  I2C_TransferReturn_TypeDef trans_ret = I2CSPM_Transfer(I2C0,&transferSequence);
+  I2C_TransferReturn_TypeDef trans_ret = i2c_Reg_Transfer_blocking(MAX_30101_ADDRESS, true, reg, write_data, nbytes_write_data);
 
   // Checking if the transfer is done or no.
   if(trans_ret != i2cTransferDone)
@@ -207,95 +572,518 @@ void i2c_Write_Write_blocking (uint8_t reg, uint8_t* write_data, size_t nbytes_w
         LOG_ERROR("I2C Write error: %d", trans_ret); // If transfer is not done then we will log error message
         createEventSystemError();
       }
-//  for (int i =0; i < nbytes_write_data; i++)
-//    {
-//      printf("Reg 0x%02x :: Write %d:0x%02x\t", reg, i+1, *(write_data+i));
-//    }
-//  printf("\n");
+
+  return trans_ret;
 }
 
 /**************************************************************************//**
- * This function sends a command to the bus with the address of the slave
- * and also sends a command that needs to be performed by the slave
+ * This function returns the number of blocking write-read and write-write
+ * transactions issued on the bus since boot. Used to measure the bus cost
+ * of the sensor drivers.
  *
- * TrasnferSequence struct is used to make the data in the apt format to send
- * via bus
+ * @param:
+ *      no params
  *
- * TransferReturn struct is used to initialize the transfer and also store the
- * status of the transfer.
+ * @return:
+ *      number of transactions
+ *****************************************************************************/
+uint32_t i2c_Get_Transaction_Count()
+{
+  return transaction_count;
+}
+
+/**************************************************************************//**
+ * This function starts the Si7021 temperature measurement (No Hold Master
+ * Mode) on the interrupt driven path. The result is read about 10.8 ms later
+ * with i2c_Read().
  *
- * This is interrupt driven function. The interrupt is taken care of at
- * I2C0_IRQHandler.
+ * @param:
+ *      callback: Called in the interrupt on completion, NULL for none
+ *      ctx:      Passed to the callback in the transaction
  *
- *  * @param:
+ * @return:
+ *      false if the queue is full
+ *****************************************************************************/
+bool i2c_Write (i2c_callback_t callback, void *ctx)
+{
+  i2c_transaction_t transaction =
+  {
+    .addr = Si7021_SLAVE_ADDRESS_TEMP,
+    .flags = I2C_FLAG_WRITE,
+    .inline_data = { Si7021_MEASURE_TEMP_NO_HOLD },
+    .len = 1,
+    .callback = callback,
+    .ctx = ctx,
+  };
+
+  return i2c_Queue_Submit(&transaction);
+}
+
+
+/**************************************************************************//**
+ * This function reads the Si7021 measurement on the interrupt driven path.
+ * The two bytes (MS byte first) are in inline_data of the transaction handed
+ * to the callback.
+ *
+ * @param:
+ *      callback: Called in the interrupt on completion
+ *      ctx:      Passed to the callback in the transaction
+ *
+ * @return:
+ *      false if the queue is full
+ *****************************************************************************/
+bool i2c_Read (i2c_callback_t callback, void *ctx)
+{
+  i2c_transaction_t transaction =
+  {
+    .addr = Si7021_SLAVE_ADDRESS_TEMP,
+    .flags = I2C_FLAG_READ,
+    .len = 2,
+    .callback = callback,
+    .ctx = ctx,
+  };
+
+  return i2c_Queue_Submit(&transaction);
+}
+
+
+/**************************************************************************//**
+ * This function retires the transaction at the head of the queue and reports
+ * it: the callback is called, or the signal posted when there is none. The
+ * slot is free before the callback runs, so it can queue the next transfer.
+ *
+ * @param:
+ *      trans_ret: Outcome of the transaction
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void i2c_Queue_Complete (I2C_TransferReturn_TypeDef trans_ret)
+{
+  i2c_transaction_t transaction = i2c_queue[i2c_queue_head];
+
+  i2c_queue_head = (i2c_queue_head + 1) % I2C_QUEUE_LEN;
+  i2c_queue_count--;
+  i2c_queue_attempt = 0;
+
+  if (transaction.callback)
+  {
+      i2c_queue_dispatching = true;
+      transaction.callback(&transaction, trans_ret);
+      i2c_queue_dispatching = false;
+  }
+  else if (transaction.signal != event_NoEvent_hr)
+  {
+      sl_bt_external_signal(transaction.signal);
+  }
+}
+
+
+/**************************************************************************//**
+ * This function puts the transaction at the head of the queue on the bus.
+ * Transactions that fail to start are reported and skipped. When the queue
+ * is empty the interrupt is turned off and the EM1 requirement released.
+ * Nothing is started while the head waits for its retry.
+ *
+ * Called with interrupts off: from a critical section in thread context and
+ * from I2C0_IRQHandler.
+ *
+ * @param:
  *      no params
  *
  * @return:
- *      no returns
+ *      no return
  *****************************************************************************/
-void i2c_Write()
+static void i2c_Queue_Start_Head()
 {
-  i2c_Init();
+  while (!i2c_queue_running && !i2c_queue_retrying)
+  {
+      i2c_transaction_t *transaction = &i2c_queue[i2c_queue_head];
+      uint8_t *data;
+      I2C_TransferReturn_TypeDef trans_ret;
 
-  cmd_data = 0xF3; // Measure Temperature, No Hold Master Mode
-  transferSequence.flags = I2C_FLAG_WRITE, // Write command
-  transferSequence.addr = (Si7021_SLAVE_ADDRESS_TEMP<<1), // Slave address needs to be left shift by one bit
-  transferSequence.buf[0].data = &cmd_data, // Passing the pointer that has the command data stored
-  transferSequence.buf[0].len = sizeof(cmd_data); // Length of the command data
+      if (i2c_queue_count == 0)
+      {
+          NVIC_DisableIRQ(I2C0_IRQn);
 
+          if (i2c_queue_em1)
+          {
+              i2c_queue_em1 = false;
+              sl_power_manager_remove_em_requirement(SL_POWER_MANAGER_EM1);
+          }
+          return;
+      }
 
-  NVIC_EnableIRQ(I2C0_IRQn);
+      data = transaction->data ? transaction->data : transaction->inline_data;
 
+      i2c_queue_sequence.flags = transaction->flags;
+      i2c_queue_sequence.addr = (transaction->addr<<1); // Slave address needs to be left shift by one bit
 
-  // This will initialize the write command on to the bus
-  I2C_TransferReturn_TypeDef transferStatus = I2C_TransferInit(I2C0, &transferSequence);
+      if (transaction->flags & (I2C_FLAG_WRITE_READ | I2C_FLAG_WRITE_WRITE))
+      {
+          i2c_queue_sequence.buf[0].data = transaction->cmd;
+          i2c_queue_sequence.buf[0].len = transaction->cmd_len;
+          i2c_queue_sequence.buf[1].data = data;
+          i2c_queue_sequence.buf[1].len = transaction->len;
+      }
+      else
+      {
+          i2c_queue_sequence.buf[0].data = data;
+          i2c_queue_sequence.buf[0].len = transaction->len;
+      }
+
+      i2c_Apply_Speed(transaction->addr);
+
+      NVIC_ClearPendingIRQ(I2C0_IRQn);
+      NVIC_EnableIRQ(I2C0_IRQn);
+
+      // This will initialize the transfer, the rest is done in the interrupt
+      trans_ret = I2C_TransferInit(I2C0, &i2c_queue_sequence);
+
+      if (trans_ret == i2cTransferInProgress)
+      {
+          i2c_queue_running = true;
+          return;
+      }
 
-  if ((transferStatus != i2cTransferDone) && (transferStatus != i2cTransferInProgress))
+      i2c_Queue_Complete(trans_ret);
+  }
+}
+
+
+/**************************************************************************//**
+ * This function adds a transaction to the interrupt driven queue and starts
+ * it when the bus is idle. Transactions run in order, back to back from the
+ * I2C interrupt. Safe from thread context and from completion callbacks.
+ *
+ * @param:
+ *      transaction: The transaction, copied into the queue. An external data
+ *                   buffer must stay valid until completion.
+ *
+ * @return:
+ *      false if the queue is full or the transaction doesn't fit
+ *****************************************************************************/
+bool i2c_Queue_Submit (const i2c_transaction_t *transaction)
+{
+  bool queued = false;
+
+  if ((transaction->cmd_len > I2C_CMD_MAX) ||
+      ((transaction->data == NULL) && (transaction->len > I2C_INLINE_MAX)))
+  {
+      LOG_ERROR("I2C transaction too long for the queue");
+      return false;
+  }
+
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+
+  if (i2c_queue_count < I2C_QUEUE_LEN)
   {
-      LOG_ERROR("I2C Write Error code: %d", transferStatus);
-//      state_machine_temp (event_Error);
+      i2c_queue[(i2c_queue_head + i2c_queue_count) % I2C_QUEUE_LEN] = *transaction;
+      i2c_queue_count++;
+      queued = true;
+
+      // The I2C peripheral is not clocked in EM2
+      if (!i2c_queue_em1)
+      {
+          i2c_queue_em1 = true;
+          sl_power_manager_add_em_requirement(SL_POWER_MANAGER_EM1);
+      }
+
+      // A completion callback queueing more is followed by the next start
+      if (!i2c_queue_dispatching)
+        i2c_Queue_Start_Head();
   }
+
+  CORE_EXIT_CRITICAL();
+
+  if (!queued)
+    LOG_ERROR("I2C transaction queue full");
+
+  return queued;
 }
 
+
 /**************************************************************************//**
- * This function receives the data sent by the slave and stores in a an array
- * this array is then converted into a number based on the number of bits
- * required that is passed
+ * This function drops every transaction of an owner, their callbacks are not
+ * called. A transaction on the bus is aborted with a STOP, sent as soon as
+ * possible (STOP with ABORT), which puts the slave back to idle, and the next
+ * one is started. A slave still holding SDA fails the next start with a bus
+ * error, which recovers the bus before its retry.
  *
- * TrasnferSequence struct is used to make the data in the apt format to send
- * and receive via bus
+ * @param:
+ *      ctx: The owner, ctx of its transactions
  *
- * TransferReturn struct is used to initialize the transfer and also store the
- * status of the transfer.
+ * @return:
+ *      no return
+ *****************************************************************************/
+void i2c_Queue_Cancel (void *ctx)
+{
+  uint8_t kept = 0;
+
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+
+  if (i2c_queue_running && (i2c_queue[i2c_queue_head].ctx == ctx))
+  {
+      I2C0->CMD = I2C_CMD_STOP | I2C_CMD_ABORT;
+      I2C_IntClear(I2C0, _I2C_IF_MASK);
+      NVIC_ClearPendingIRQ(I2C0_IRQn);
+      i2c_queue_running = false;
+      i2c_queue_attempt = 0;
+  }
+
+  // The retry of the head is not done
+  if (i2c_queue_retrying && (i2c_queue[i2c_queue_head].ctx == ctx))
+  {
+      i2c_queue_retrying = false;
+      i2c_queue_attempt = 0;
+  }
+
+  // Compacted in place, in order
+  for (uint8_t i = 0; i < i2c_queue_count; i++)
+  {
+      i2c_transaction_t *transaction = &i2c_queue[(i2c_queue_head + i) % I2C_QUEUE_LEN];
+
+      if (transaction->ctx != ctx)
+      {
+          i2c_queue[(i2c_queue_head + kept) % I2C_QUEUE_LEN] = *transaction;
+          kept++;
+      }
+  }
+  i2c_queue_count = kept;
+
+  if (!i2c_queue_dispatching)
+    i2c_Queue_Start_Head();
+
+  CORE_EXIT_CRITICAL();
+}
+
+
+/**************************************************************************//**
+ * This function tells whether the queue owns the peripheral. The blocking
+ * transfers must not be used meanwhile.
  *
- * The slave sends out a 14 bit data for the command sent above. the first byte
- * received is the MS Byte and the second in the LS Byte
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      true while transactions are queued or on the bus
+ *****************************************************************************/
+bool i2c_Queue_Busy()
+{
+  return i2c_queue_count != 0;
+}
+
+
+/**************************************************************************//**
+ * This function drives the transaction on the bus, called by
+ * I2C0_IRQHandler. A finished transaction is reported and the next one
+ * started before returning, the main loop is not involved in between. A
+ * failed one with retries left stays at the head and the queue stops:
+ * event_I2CRetry_hr hands it to i2c_Queue_Signal(), nothing is logged or
+ * waited here.
  *
  * @param:
- *      len is the number of bytes that is expected to be received from the
- *      slave.
+ *      no params
  *
  * @return:
- *      returns the temperature in degree celsius
+ *      no return
  *****************************************************************************/
-void i2c_Read()
+void i2c_Queue_IRQ()
 {
-  i2c_Init();
+  uint32_t flags = I2C_IntGetEnabled(I2C0);
+  I2C_TransferReturn_TypeDef trans_ret = I2C_Transfer(I2C0);
 
-  transferSequence.flags = I2C_FLAG_READ, // Read command
-  transferSequence.addr = (Si7021_SLAVE_ADDRESS_TEMP<<1), // Slave address needs to be left shift by one bit
-  transferSequence.buf[0].data = &received_data[0], // Passing the array that will store the incoming data
-  transferSequence.buf[0].len = sizeof(received_data); // Passing the size of the array
+  // Flags are cleared before the next transaction is started so that none of
+  // its flags are lost
+  I2C_IntClear(I2C0, flags);
 
+  if ((trans_ret == i2cTransferInProgress) || !i2c_queue_running)
+    return;
 
-  NVIC_EnableIRQ(I2C0_IRQn);
+  i2c_queue_running = false;
+
+  if (i2c_Retry_Left(trans_ret, i2c_queue_attempt))
+  {
+      i2c_queue_retrying = true;
+      i2c_queue_fault = trans_ret;
+      sl_bt_external_signal(event_I2CRetry_hr);
+      return;
+  }
+
+  i2c_Queue_Complete(trans_ret);
+  i2c_Queue_Start_Head();
+}
+
+
+/**************************************************************************//**
+ * This function does the retry of the head of the queue in thread context,
+ * on event_I2CRetry_hr: the bus is recovered and the backoff waited, then
+ * the head goes back on the bus ahead of the others. A bus that stays stuck
+ * fails the head. The queue is stopped until then, nothing else uses the
+ * bus.
+ *
+ * @param:
+ *      evt: Event of the Bluetooth stack, only the external signals are
+ *           looked at
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void i2c_Queue_Signal (sl_bt_msg_t *evt)
+{
+  I2C_TransferReturn_TypeDef trans_ret;
+  uint8_t attempt;
+  bool ready;
+
+  if ((SL_BT_MSG_ID(evt->header) != sl_bt_evt_system_external_signal_id) ||
+      !(evt->data.evt_system_external_signal.extsignals & event_I2CRetry_hr))
+    return;
+
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+  ready = i2c_queue_retrying;
+  trans_ret = i2c_queue_fault;
+  attempt = i2c_queue_attempt;
+  CORE_EXIT_CRITICAL();
+
+  // Cancelled meanwhile
+  if (!ready)
+    return;
+
+  ready = i2c_Retry_Prepare(trans_ret, attempt);
+
+  CORE_ENTER_CRITICAL();
+
+  if (i2c_queue_retrying)
+  {
+      i2c_queue_retrying = false;
+
+      if (ready)
+      {
+          i2c_queue_attempt++;
+      }
+      else
+      {
+          i2c_Queue_Complete(trans_ret);
+      }
+
+      i2c_Queue_Start_Head();
+  }
+
+  CORE_EXIT_CRITICAL();
+}
 
-  // Initiating the transfer for the master to receive the data from the bus
-  transferStatus = I2C_TransferInit(I2C0, &transferSequence);
 
-  if ((transferStatus != i2cTransferDone) && (transferStatus != i2cTransferInProgress))
+/**************************************************************************//**
+ * This function maps an emlib transfer result to the sensor bus status
+ *
+ * @param:
+ *      trans_ret: Result of I2CSPM_Transfer(), I2C_TransferInit() or
+ *                 I2C_Transfer()
+ *
+ * @return:
+ *      The sensor bus status
+ *****************************************************************************/
+sensor_bus_status_t i2c_Bus_Status (I2C_TransferReturn_TypeDef trans_ret)
+{
+  switch (trans_ret)
   {
-      LOG_ERROR("I2C Read Error code: %d", transferStatus);
-//      state_machine_temp (event_Error);
+    case i2cTransferDone:
+      return SENSOR_BUS_OK;
+
+    case i2cTransferInProgress:
+      return SENSOR_BUS_IN_PROGRESS;
+
+    case i2cTransferNack:
+      return SENSOR_BUS_NACK;
+
+    default:
+      return SENSOR_BUS_ERROR;
   }
 }
+
+
+/**************************************************************************//**
+ * Sensor bus backend on I2C0
+ *
+ * Blocking transfers go through I2CSPM. Interrupt driven transfers go
+ * through the transaction queue, shared with the other devices on I2C0, and
+ * their completion is reported with Sensor_Bus_Complete() from the
+ * interrupt. Transactions are timed on the LETIMER for the statistics and
+ * the diagnostics of the sensor bus.
+ *****************************************************************************/
+static sensor_bus_status_t i2c_Bus_Transfer (void *ctx, uint8_t addr, bool write, uint8_t reg, uint8_t *data, size_t len)
+{
+  (void)ctx;
+
+  return i2c_Bus_Status(i2c_Reg_Transfer_blocking(addr, write, reg, data, len));
+}
+
+static void i2c_Bus_Done (const i2c_transaction_t *transaction, I2C_TransferReturn_TypeDef trans_ret)
+{
+  Sensor_Bus_Complete(transaction->ctx, i2c_Bus_Status(trans_ret));
+}
+
+static sensor_bus_status_t i2c_Bus_Start (void *ctx, uint8_t addr, bool write, uint8_t reg, uint8_t *data, size_t len)
+{
+  i2c_transaction_t transaction =
+  {
+    .addr = addr,
+    .flags = write ? I2C_FLAG_WRITE_WRITE : I2C_FLAG_WRITE_READ,
+    .cmd = { reg },
+    .cmd_len = 1,
+    .data = data,
+    .len = len,
+    .callback = i2c_Bus_Done,
+    .ctx = ctx,
+  };
+
+  return i2c_Queue_Submit(&transaction) ? SENSOR_BUS_IN_PROGRESS : SENSOR_BUS_ERROR;
+}
+
+static void i2c_Bus_Abort (void *ctx)
+{
+  i2c_Queue_Cancel(ctx);
+}
+
+static uint64_t i2c_Bus_Now (void *ctx)
+{
+  (void)ctx;
+
+  return letimerMicroseconds();
+}
+
+static const sensor_bus_ops_t i2c_bus_ops =
+{
+  .transfer = i2c_Bus_Transfer,
+  .start = i2c_Bus_Start,
+  .abort = i2c_Bus_Abort,
+  .now_us = i2c_Bus_Now,
+};
+
+static sensor_bus_t i2c_bus =
+{
+  .name = "i2c0",
+  .ops = &i2c_bus_ops,
+  .ctx = &i2c_bus,                        // Owner of its transactions in the queue
+};
+
+
+/**************************************************************************//**
+ * This function returns the sensor bus on I2C0
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      The bus
+ *****************************************************************************/
+sensor_bus_t* i2c_Get_Bus()
+{
+  return &i2c_bus;
+}
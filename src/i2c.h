@@ -15,24 +15,94 @@
 #include "em_cmu.h"
 #include <em_i2c.h>
 #include "sl_i2cspm_instances.h"
+#include "sl_bt_api.h"
 #include "timers.h"
+#include "sensor_bus.h"
 
 // Address of the Si7021 temperature sensor (refer to data sheet)
 #define Si7021_SLAVE_ADDRESS_TEMP 0x40
+#define Si7021_MEASURE_TEMP_NO_HOLD 0xF3
 
 #define MAX_30101_ADDRESS 0x57 // Works fine
 
+#define I2C_QUEUE_LEN   8       // Transactions that can be queued on the interrupt driven path
+#define I2C_CMD_MAX     2       // Command bytes (register address) kept in the queue
+#define I2C_INLINE_MAX  4       // Data bytes kept in the queue when there is no external buffer
+
+#define I2C_SPEED_DEVICES 4       // Devices that can have their own bus speed profile
+
+#define I2C_RETRIES          3  // Attempts after the first one before a transaction fails
+#define I2C_BACKOFF_US       25 // Wait before the first retry, doubled for each next one
+#define I2C_RECOVERY_CLOCKS  9  // SCL pulses for a slave to finish the byte it holds SDA low for
+#define I2C_RECOVERY_HALF_US 5  // Half period of the recovery clock, 100 kHz
+
+// SCL timing a device is talked to at. The bus is switched between
+// transactions when the next one is for a device with another profile.
+typedef struct
+{
+  uint32_t max_hz;                      // Highest SCL frequency, I2CSPM/emlib picks the divider
+  I2C_ClockHLR_TypeDef clhr;            // Low:high ratio of SCL
+} i2c_speed_profile_t;
+
+extern const i2c_speed_profile_t i2c_speed_standard;   // 100 kHz class, 4:4, every device and the default
+extern const i2c_speed_profile_t i2c_speed_fast;       // 400 kHz class, 6:3, for the devices that support fast mode
+
+// Transient faults handled on the bus, a transaction only fails (and the
+// caller escalates) once its retries are used up
+typedef struct
+{
+  uint32_t retries;                     // Transactions attempted again
+  uint32_t recoveries;                  // Bus clear (SCL clock-out and STOP) and controller re-init
+  uint32_t stuck;                       // Recoveries that left SDA or SCL low
+  uint32_t failures;                    // Transactions failed after their retries
+} i2c_recovery_stats_t;
+
+typedef struct i2c_transaction i2c_transaction_t;
+
+// Completion of a queued transaction, runs in I2C0_IRQHandler (in thread
+// context when a retry found the bus stuck). The transaction is a copy that
+// only lives for the call.
+typedef void (*i2c_callback_t) (const i2c_transaction_t *transaction, I2C_TransferReturn_TypeDef trans_ret);
+
+// An interrupt driven transaction. I2C_FLAG_WRITE_READ and
+// I2C_FLAG_WRITE_WRITE send cmd first, I2C_FLAG_WRITE and I2C_FLAG_READ
+// only transfer the data.
+struct i2c_transaction
+{
+  uint8_t addr;                         // 7 bit address of the slave
+  uint16_t flags;                       // I2C_FLAG_WRITE, _READ, _WRITE_READ or _WRITE_WRITE
+  uint8_t cmd[I2C_CMD_MAX];
+  uint8_t cmd_len;
+  uint8_t *data;                        // Data to write or buffer for the read, NULL to use inline_data
+  size_t len;
+  uint8_t inline_data[I2C_INLINE_MAX];  // Short transfers, handed back to the callback
+  i2c_callback_t callback;              // NULL to post the signal instead
+  void *ctx;                            // Owner, for the callback and i2c_Queue_Cancel()
+  uint32_t signal;                      // External signal posted on completion without callback, 0 for none
+};
+
 
 // Function Definitions
 void i2c_Init(); // Function to initialize the I2C protocol
 void sensorEnable(); // Function to enable the sensor
 void i2c_Write_blocking(); // Function to write commands to the slave - Interrupt based
 uint16_t i2c_Read_blocking(uint8_t len); // Function to write commands to the slave - Interrupt based
-void i2c_Write(); // Function to write commands to the slave - Interrupt based
-void i2c_Read(); // Function to read the data sent by the slave - Interrupt based
-void i2c_Write_Read_blocking (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data);
-void i2c_Write_Write_blocking (uint8_t reg, uint8_t* write_data, size_t nbytes_write_data);
-void i2c_Write_Read (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data);
+bool i2c_Write (i2c_callback_t callback, void *ctx); // Function to write commands to the slave - Interrupt based
+bool i2c_Read (i2c_callback_t callback, void *ctx); // Function to read the data sent by the slave - Interrupt based
+I2C_TransferReturn_TypeDef i2c_Write_Read_blocking (uint8_t reg, uint8_t* read_data, size_t nbytes_read_data);
+I2C_TransferReturn_TypeDef i2c_Write_Write_blocking (uint8_t reg, uint8_t* write_data, size_t nbytes_write_data);
+uint32_t i2c_Get_Transaction_Count(); // Number of blocking transactions issued on the bus since boot
+sensor_bus_t* i2c_Get_Bus(); // Sensor bus on I2C0, blocking and interrupt driven register transfers
+sensor_bus_status_t i2c_Bus_Status (I2C_TransferReturn_TypeDef trans_ret);
+bool i2c_Set_Speed_Profile (uint8_t addr, const i2c_speed_profile_t *profile); // Bus speed of a device, NULL for the default
+uint32_t i2c_Get_Bus_Hz(); // SCL frequency the bus is set to
+bool i2c_Recover(); // Clears a stuck bus and re-initialises the controller
+const i2c_recovery_stats_t* i2c_Get_Recovery_Stats(); // Retries and recoveries since boot
+bool i2c_Queue_Submit (const i2c_transaction_t *transaction); // Interrupt driven transaction, run in order with the others
+void i2c_Queue_Cancel (void *ctx); // Drops the transactions of an owner
+bool i2c_Queue_Busy(); // Transactions queued or on the bus
+void i2c_Queue_IRQ(); // Called by I2C0_IRQHandler
+void i2c_Queue_Signal (sl_bt_msg_t *evt); // Retry of a failed transaction, on event_I2CRetry_hr
 
 
 #endif /* SRC_I2C_H_ */
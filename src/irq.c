@@ -11,6 +11,8 @@
 #include "app.h"
 
 #include "scheduler.h"
+#include "MAX_30101.h"
+#include "i2c.h"
 
 #include <stdio.h>
 
@@ -19,7 +21,7 @@
 #define INCLUDE_LOG_DEBUG 1
 #include "src/log.h"
 
-uint8_t cycles=0;
+uint32_t cycles=0; // LETIMER underflows since boot, while the underflow interrupt is on
 
 //Added for Assignment - 2
 /**************************************************************************//**
@@ -155,6 +157,43 @@ uint32_t letimerMilliseconds()
 }
 
 
+/**************************************************************************//**
+ * This function returns the time since boot in microseconds, at the LETIMER
+ * resolution (61 us with the 16384 Hz prescaled LFXO). An underflow not yet
+ * taken by LETIMER0_IRQHandler is accounted for. The time only moves on by
+ * whole periods while the underflow interrupt is on, it is meant for
+ * durations well below LETIMER_PERIOD_MS.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      Time in us
+ *****************************************************************************/
+uint64_t letimerMicroseconds()
+{
+  uint32_t underflows, ticks;
+  uint32_t top = LETIMER_CompareGet(LETIMER0,0);
+
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+
+  underflows = cycles;
+  ticks = top - LETIMER_CounterGet(LETIMER0);
+
+  if ((LETIMER_IntGetEnabled(LETIMER0) & LETIMER_IF_UF))
+  {
+      underflows++;
+      ticks = top - LETIMER_CounterGet(LETIMER0);
+  }
+
+  CORE_EXIT_CRITICAL();
+
+  return underflows*(uint64_t)LETIMER_PERIOD_MS*1000 + ((uint64_t)ticks*1000000)/CMU_ClockFreqGet(cmuClock_LETIMER0);
+}
+
+
 
 // Added for assignment 4
 /**************************************************************************//**
@@ -174,28 +213,9 @@ uint32_t letimerMilliseconds()
  *****************************************************************************/
 void I2C0_IRQHandler(void)
 {
-
-
-  int32_t flags;
-
-  flags = I2C_IntGetEnabled(I2C0);
-
-
-  I2C_TransferReturn_TypeDef trans_ret = I2C_Transfer(I2C0);
-
-  // Checking if the transfer is done or no.
-  if(trans_ret == i2cTransferDone)
-  {
-      NVIC_DisableIRQ(I2C0_IRQn);
-      createEventI2CTransfer();
-  }
-  else if ((trans_ret != i2cTransferDone) && (trans_ret != i2cTransferInProgress))
-  {
-      LOG_ERROR("I2C Error code: %d\n", trans_ret);
-      createEventSystemError();
-  }
-  I2C_IntClear(I2C0, flags);
-
+  // The transaction queue reports the completion (callback or event) and
+  // chains the next transaction
+  i2c_Queue_IRQ();
 }
 
 
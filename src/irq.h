@@ -15,6 +15,7 @@
 //void LETIMER0_IRQInit();                 // Initializing the LETIMER0 IRQ routine
 void LETIMER0_IRQHandler();                // LETIMER0 IRQ handler
 uint32_t letimerMilliseconds();            // Gives the milliseconds since last boot
+uint64_t letimerMicroseconds();            // Gives the microseconds since last boot, for durations
 void I2C0_IRQHandler(void);                // I2C0 IRQ handler
 void GPIO_EVEN_IRQHandler(void);           // Even Pins GPIO handler
 void GPIO_ODD_IRQHandler(void);            // Odd Pins GPIO handler
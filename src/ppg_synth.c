@@ -0,0 +1,602 @@
+/*
+ * ppg_synth.c
+ *
+ *  Synthetic PPG signals (see ppg_synth.h).
+ *
+ *  Every beat is a systolic and a dicrotic wave (two gaussians over the beat
+ *  phase), absorbed from the DC level the LED current sets, so the pulse is
+ *  a dip of PI % of the DC. The beat to beat interval is the mean one,
+ *  modulated by respiration, plus gaussian variability. Respiration also
+ *  moves the baseline and the pulse amplitude. Motion bursts are a few low
+ *  frequency sines under a Hann window, common to all the LEDs. White, pink
+ *  and lighting flicker noise are added, then the count is clipped to the
+ *  18 bits of the ADC.
+ *
+ *  The generator moves forward with the sample times and draws its noise
+ *  for every sample, so the signal depends on the seed and on the samples
+ *  asked for. A time earlier than the last one starts it again from the
+ *  seed.
+ *
+ *  Self test:
+ *      gcc -DTESTING -Isrc src/ppg_synth.c -lm && ./a.out
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "ppg_synth.h"
+#include "MAX_30101.h"
+
+
+#define PPG_SYNTH_PI          3.14159265358979323846
+#define PPG_SYNTH_MIN_RR_US   250000    // 240 bpm
+#define PPG_SYNTH_MAX_RR_US   2500000   // 24 bpm
+#define PPG_SYNTH_PINK_GAIN   3.0       // rms of the pink noise filter for a white input of 1
+#define PPG_SYNTH_LEAKAGE     0.01      // LED light reaching the photodiode with no finger, fraction of the DC level
+
+// Pulse shape over the beat phase: systolic peak and dicrotic wave
+#define PPG_SYNTH_SYS_MU      0.25
+#define PPG_SYNTH_SYS_SIGMA   0.08
+#define PPG_SYNTH_DIC_MU      0.60
+#define PPG_SYNTH_DIC_SIGMA   0.12
+#define PPG_SYNTH_DIC_AMP     0.35
+
+static const uint32_t ppg_synth_sample_rates[8] = { 50, 100, 200, 400, 800, 1000, 1600, 3200 };
+
+
+/**************************************************************************//**
+ * Random numbers: xorshift64* and Box-Muller
+ *****************************************************************************/
+static uint64_t PPG_Synth_Rand (ppg_synth_t *synth)
+{
+  synth->rng ^= synth->rng >> 12;
+  synth->rng ^= synth->rng << 25;
+  synth->rng ^= synth->rng >> 27;
+
+  return synth->rng*0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in (0, 1)
+static double PPG_Synth_Uniform (ppg_synth_t *synth)
+{
+  return ((PPG_Synth_Rand(synth) >> 11) + 0.5)/9007199254740992.0;
+}
+
+static double PPG_Synth_Gauss (ppg_synth_t *synth)
+{
+  double u1 = PPG_Synth_Uniform(synth), u2 = PPG_Synth_Uniform(synth);
+
+  return sqrt(-2*log(u1))*cos(2*PPG_SYNTH_PI*u2);
+}
+
+
+/**************************************************************************//**
+ * This function returns the pulse shape at a phase of the beat, before
+ * normalisation
+ *
+ * @param:
+ *      phase: 0 at the start of the beat, 1 at the next one
+ *
+ * @return:
+ *      Blood volume
+ *****************************************************************************/
+static double PPG_Synth_Shape (double phase)
+{
+  double s = (phase - PPG_SYNTH_SYS_MU)/PPG_SYNTH_SYS_SIGMA;
+  double d = (phase - PPG_SYNTH_DIC_MU)/PPG_SYNTH_DIC_SIGMA;
+
+  return exp(-0.5*s*s) + PPG_SYNTH_DIC_AMP*exp(-0.5*d*d);
+}
+
+
+/**************************************************************************//**
+ * This function fills a configuration with a resting adult: 72 bpm, 50 ms of
+ * variability, 15 breaths per minute, a DC level around half scale at the
+ * default LED current, no motion and little noise
+ *
+ * @param:
+ *      config: The configuration
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void PPG_Synth_Default_Config (ppg_synth_config_t *config)
+{
+  memset(config, 0, sizeof(*config));
+
+  config->seed = 1;
+
+  config->hr_bpm = 72;
+  config->hrv_ms = 50;
+
+  config->resp_bpm = 15;
+  config->resp_rsa = 0.05;
+  config->resp_am = 0.1;
+  config->resp_bw = 0.005;
+
+  config->dc_per_pa[0] = 2400;          // Red
+  config->dc_per_pa[1] = 2800;          // IR goes deeper and comes back stronger
+  config->dc_per_pa[2] = 900;           // Green is mostly absorbed
+  config->pi_pct[0] = 1.5;
+  config->pi_pct[1] = 2.0;
+  config->pi_pct[2] = 4.0;
+  config->ambient = 200;
+
+  config->white_rms = 20;
+  config->pink_rms = 20;
+  config->flicker = 0;
+  config->flicker_hz = 100;
+
+  config->motion_per_min = 0;
+  config->motion_ms = 2000;
+  config->motion_depth = 0.05;
+}
+
+
+/**************************************************************************//**
+ * This function draws the tones of a motion burst
+ *
+ * @param:
+ *      synth:    The generator
+ *      start_us: Start of the burst
+ *      end_us:   End of the burst
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void PPG_Synth_Motion_Start (ppg_synth_t *synth, uint64_t start_us, uint64_t end_us)
+{
+  synth->motion_start_us = start_us;
+  synth->motion_end_us = end_us;
+
+  // Hand and arm movements, 0.5 to 4 Hz
+  for (int i = 0; i < PPG_SYNTH_MOTION_TONES; i++)
+  {
+      synth->motion_hz[i] = 0.5 + 3.5*PPG_Synth_Uniform(synth);
+      synth->motion_phase[i] = 2*PPG_SYNTH_PI*PPG_Synth_Uniform(synth);
+  }
+}
+
+
+/**************************************************************************//**
+ * This function draws the time to the next random motion burst
+ *
+ * @param:
+ *      synth: The generator
+ *      from:  Time the wait starts
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void PPG_Synth_Motion_Schedule (ppg_synth_t *synth, uint64_t from)
+{
+  if (synth->config.motion_per_min <= 0)
+  {
+      synth->next_motion_us = UINT64_MAX;
+      return;
+  }
+
+  // Poisson arrivals
+  synth->next_motion_us = from + (uint64_t)(-log(PPG_Synth_Uniform(synth))*60e6/synth->config.motion_per_min);
+}
+
+
+/**************************************************************************//**
+ * This function draws the length of the beat that starts at a time
+ *
+ * @param:
+ *      synth:   The generator
+ *      beat_us: Start of the beat
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void PPG_Synth_Next_Beat (ppg_synth_t *synth, uint64_t beat_us)
+{
+  const ppg_synth_config_t *config = &synth->config;
+  double rr = 60e6/config->hr_bpm;
+  double resp = sin(2*PPG_SYNTH_PI*(config->resp_bpm/60.0)*beat_us*1e-6 + synth->resp_phase);
+
+  rr *= 1 + config->resp_rsa*resp;
+  rr += config->hrv_ms*1000*PPG_Synth_Gauss(synth);
+
+  if (rr < PPG_SYNTH_MIN_RR_US)
+    rr = PPG_SYNTH_MIN_RR_US;
+  if (rr > PPG_SYNTH_MAX_RR_US)
+    rr = PPG_SYNTH_MAX_RR_US;
+
+  synth->beat_us = beat_us;
+  synth->next_beat_us = beat_us + (uint64_t)rr;
+  synth->last_rr_us = (uint32_t)rr;
+  synth->beats++;
+}
+
+
+/**************************************************************************//**
+ * This function puts the generator at time 0
+ *
+ * @param:
+ *      synth: The generator, its configuration is kept
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void PPG_Synth_Start (ppg_synth_t *synth)
+{
+  double peak = 0;
+
+  synth->rng = 0x9E3779B97F4A7C15ULL ^ synth->config.seed;
+  if (synth->rng == 0)
+    synth->rng = 1;
+
+  synth->started = true;
+  synth->now_us = 0;
+  synth->beats = 0;
+  synth->motion_start_us = synth->motion_end_us = 0;
+  memset(synth->pink, 0, sizeof(synth->pink));
+
+  synth->resp_phase = 2*PPG_SYNTH_PI*PPG_Synth_Uniform(synth);
+
+  for (int i = 0; i <= 1000; i++)
+    if (PPG_Synth_Shape(i/1000.0) > peak)
+      peak = PPG_Synth_Shape(i/1000.0);
+  synth->pulse_scale = 1/peak;
+
+  PPG_Synth_Next_Beat(synth, 0);
+
+  PPG_Synth_Motion_Schedule(synth, 0);
+}
+
+
+/**************************************************************************//**
+ * This function sets a generator up
+ *
+ * @param:
+ *      synth:  The generator
+ *      config: The signal, copied (the periods array is not)
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void PPG_Synth_Init (ppg_synth_t *synth, const ppg_synth_config_t *config)
+{
+  memset(synth, 0, sizeof(*synth));
+
+  synth->config = *config;
+
+  PPG_Synth_Start(synth);
+}
+
+
+/**************************************************************************//**
+ * This function moves the beats and the motion bursts up to a time
+ *
+ * @param:
+ *      synth: The generator
+ *      t_us:  The time
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void PPG_Synth_Advance (ppg_synth_t *synth, uint64_t t_us)
+{
+  if (!synth->started || (t_us < synth->now_us))
+    PPG_Synth_Start(synth);
+
+  synth->now_us = t_us;
+
+  while (synth->next_beat_us <= t_us)
+    PPG_Synth_Next_Beat(synth, synth->next_beat_us);
+
+  while (synth->next_motion_us <= t_us)
+  {
+      uint64_t start = synth->next_motion_us;
+
+      PPG_Synth_Motion_Start(synth, start, start + synth->config.motion_ms*1000ULL);
+      PPG_Synth_Motion_Schedule(synth, synth->motion_end_us);
+  }
+}
+
+
+/**************************************************************************//**
+ * This function returns the scripted period a time is in
+ *
+ * @param:
+ *      synth: The generator
+ *      t_us:  The time
+ *
+ * @return:
+ *      The period, NULL if none
+ *****************************************************************************/
+static const ppg_synth_period_t* PPG_Synth_Period (const ppg_synth_t *synth, uint64_t t_us)
+{
+  uint64_t t_ms = t_us/1000;
+
+  for (size_t i = 0; i < synth->config.nperiods; i++)
+  {
+      const ppg_synth_period_t *period = &synth->config.periods[i];
+
+      if ((t_ms >= period->start_ms) && (t_ms - period->start_ms < period->duration_ms))
+        return period;
+  }
+
+  return NULL;
+}
+
+
+/**************************************************************************//**
+ * This function returns the motion artefact at a time
+ *
+ * @param:
+ *      synth: The generator
+ *      t_us:  The time
+ *
+ * @return:
+ *      Fraction of the DC level
+ *****************************************************************************/
+static double PPG_Synth_Motion (const ppg_synth_t *synth, uint64_t t_us)
+{
+  double t, window, artefact = 0;
+
+  if ((t_us < synth->motion_start_us) || (t_us >= synth->motion_end_us))
+    return 0;
+
+  t = (t_us - synth->motion_start_us)*1e-6;
+  window = 0.5 - 0.5*cos(2*PPG_SYNTH_PI*(t_us - synth->motion_start_us)/(double)(synth->motion_end_us - synth->motion_start_us));
+
+  for (int i = 0; i < PPG_SYNTH_MOTION_TONES; i++)
+    artefact += sin(2*PPG_SYNTH_PI*synth->motion_hz[i]*t + synth->motion_phase[i]);
+
+  return synth->config.motion_depth*window*artefact/PPG_SYNTH_MOTION_TONES;
+}
+
+
+/**************************************************************************//**
+ * This function returns one sample of one LED
+ *
+ * @param:
+ *      synth: The generator
+ *      led:   0 red, 1 IR, 2 green
+ *      t_us:  Sample time
+ *      pa:    LEDx_PA of the LED
+ *
+ * @return:
+ *      18 bit ADC count
+ *****************************************************************************/
+uint32_t PPG_Synth_Sample (ppg_synth_t *synth, uint8_t led, uint64_t t_us, uint8_t pa)
+{
+  const ppg_synth_config_t *config = &synth->config;
+  const ppg_synth_period_t *period;
+  double t = t_us*1e-6, resp, dc, pulse, value, w;
+  double *pink;
+
+  if (led >= PPG_SYNTH_LEDS)
+    led = PPG_SYNTH_LEDS - 1;
+
+  PPG_Synth_Advance(synth, t_us);
+
+  period = PPG_Synth_Period(synth, t_us);
+
+  // A scripted motion period is one long burst
+  if (period && (period->kind == PPG_SYNTH_MOTION) && (synth->motion_end_us <= t_us))
+    PPG_Synth_Motion_Start(synth, period->start_ms*1000ULL, (period->start_ms + (uint64_t)period->duration_ms)*1000ULL);
+
+  resp = config->resp_bpm ? sin(2*PPG_SYNTH_PI*(config->resp_bpm/60.0)*t + synth->resp_phase) : 0;
+  dc = config->dc_per_pa[led]*pa;
+
+  pulse = synth->pulse_scale*PPG_Synth_Shape((double)(t_us - synth->beat_us)/(synth->next_beat_us - synth->beat_us));
+
+  if (period && (period->kind == PPG_SYNTH_SENSOR_OFF))
+  {
+      value = PPG_SYNTH_LEAKAGE*dc;
+  }
+  else
+  {
+      value = dc*(1 + config->resp_bw*resp);
+      value -= dc*(config->pi_pct[led]/100)*(1 + config->resp_am*resp)*pulse;
+      value += dc*PPG_Synth_Motion(synth, t_us);
+  }
+
+  value += config->ambient + config->flicker*sin(2*PPG_SYNTH_PI*config->flicker_hz*t);
+
+  // White noise and pink noise (Paul Kellett's economy filter)
+  w = PPG_Synth_Gauss(synth);
+  pink = synth->pink[led];
+  pink[0] = 0.99765*pink[0] + w*0.0990460;
+  pink[1] = 0.96300*pink[1] + w*0.2965164;
+  pink[2] = 0.57000*pink[2] + w*1.0526913;
+
+  value += config->pink_rms*(pink[0] + pink[1] + pink[2] + w*0.1848)/PPG_SYNTH_PINK_GAIN;
+  value += config->white_rms*PPG_Synth_Gauss(synth);
+
+  if (period && (period->kind == PPG_SYNTH_SATURATED))
+    value = MAX_30101_ADC_FULL_SCALE;
+
+  if (value < 0)
+    value = 0;
+  if (value > MAX_30101_ADC_FULL_SCALE)
+    value = MAX_30101_ADC_FULL_SCALE;
+
+  return (uint32_t)value;
+}
+
+
+/**************************************************************************//**
+ * Source of the sensor model (max_30101_sim_source_t), ctx is the generator
+ *****************************************************************************/
+uint32_t PPG_Synth_Source (void *ctx, uint8_t led, uint64_t t_us, uint8_t pa)
+{
+  return PPG_Synth_Sample(ctx, led, t_us, pa);
+}
+
+
+/**************************************************************************//**
+ * This function produces samples the way the MAX30101 FIFO holds them:
+ * 3 bytes per active slot, most significant first, 18 bits left justified
+ * with the bits below the resolution cleared
+ *
+ * @param:
+ *      synth:    The generator
+ *      fifo:     Sampling, fifo->sample is moved past the samples produced
+ *      data:     Receives nsamples*fifo->nleds*3 bytes
+ *      nsamples: Number of samples
+ *
+ * @return:
+ *      false if the sample rate or the resolution isn't one of the sensor
+ *****************************************************************************/
+bool PPG_Synth_FIFO (ppg_synth_t *synth, ppg_synth_fifo_t *fifo, uint8_t *data, size_t nsamples)
+{
+  bool rate_ok = false;
+  uint32_t lsb_mask;
+
+  for (size_t i = 0; i < sizeof(ppg_synth_sample_rates)/sizeof(ppg_synth_sample_rates[0]); i++)
+    if (fifo->sample_rate == ppg_synth_sample_rates[i])
+      rate_ok = true;
+
+  if (!rate_ok || (fifo->resolution < 15) || (fifo->resolution > 18) || (fifo->nleds > PPG_SYNTH_LEDS))
+    return false;
+
+  lsb_mask = (1u << (18 - fifo->resolution)) - 1;
+
+  for (size_t n = 0; n < nsamples; n++, fifo->sample++)
+  {
+      uint64_t t_us = fifo->sample*1000000/fifo->sample_rate;
+
+      for (uint8_t slot = 0; slot < fifo->nleds; slot++)
+      {
+          uint32_t value = PPG_Synth_Sample(synth, fifo->led[slot], t_us, fifo->pa[slot]) & ~lsb_mask;
+
+          *data++ = (uint8_t)(value >> 16);
+          *data++ = (uint8_t)(value >> 8);
+          *data++ = (uint8_t)(value >> 0);
+      }
+  }
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function fills a buffer with the 18 bit samples of one LED, from
+ * time 0, as the firmware's heart rate window holds them (kAC_18bps_unsigned)
+ *
+ * @param:
+ *      synth:       The generator, started again
+ *      led:         0 red, 1 IR, 2 green
+ *      pa:          LEDx_PA of the LED
+ *      sample_rate: Samples per second
+ *      samples:     Receives the samples
+ *      nsamples:    Number of samples
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void PPG_Synth_Fill (ppg_synth_t *synth, uint8_t led, uint8_t pa, uint32_t sample_rate, uint32_t *samples, size_t nsamples)
+{
+  PPG_Synth_Start(synth);
+
+  for (size_t n = 0; n < nsamples; n++)
+    samples[n] = PPG_Synth_Sample(synth, led, (uint64_t)n*1000000/sample_rate, pa);
+}
+
+
+//#define TESTING
+
+#ifdef TESTING
+
+#include <stdio.h>
+#include <assert.h>
+
+#define TEST_RATE   400
+#define TEST_LEN    (TEST_RATE*30)
+
+int main()
+{
+  static uint32_t a[TEST_LEN], b[TEST_LEN];
+  static ppg_synth_t synth;
+  ppg_synth_config_t config;
+  uint8_t fifo_data[4*2*MAX_30101_BYTES_PER_LED];
+
+  PPG_Synth_Default_Config(&config);
+
+  // Same seed, same signal; another seed, another noise
+  PPG_Synth_Init(&synth, &config);
+  PPG_Synth_Fill(&synth, 1, 0x1F, TEST_RATE, a, TEST_LEN);
+  PPG_Synth_Fill(&synth, 1, 0x1F, TEST_RATE, b, TEST_LEN);
+  assert(memcmp(a, b, sizeof(a)) == 0);
+  config.seed = 2;
+  PPG_Synth_Init(&synth, &config);
+  PPG_Synth_Fill(&synth, 1, 0x1F, TEST_RATE, b, TEST_LEN);
+  assert(memcmp(a, b, sizeof(a)) != 0);
+
+  // Beats at the configured rate, DC level and perfusion index as set
+  // (no noise, no respiration)
+  PPG_Synth_Default_Config(&config);
+  config.hr_bpm = 90;
+  config.resp_bpm = 0;
+  config.white_rms = config.pink_rms = config.ambient = 0;
+  PPG_Synth_Init(&synth, &config);
+  PPG_Synth_Fill(&synth, 1, 0x1F, TEST_RATE, a, TEST_LEN);
+
+  uint32_t min = UINT32_MAX, max = 0;
+  uint64_t sum = 0;
+  for (int i = 0; i < TEST_LEN; i++)
+  {
+      sum += a[i];
+      min = a[i] < min ? a[i] : min;
+      max = a[i] > max ? a[i] : max;
+  }
+  double bpm = synth.beats*60.0/(TEST_LEN/(double)TEST_RATE);
+  double pi = 100.0*(max - min)/max;
+  printf("%u beats, %.1f bpm, DC %u, PI %.2f %%\n", (unsigned)synth.beats, bpm, (unsigned)(sum/TEST_LEN), pi);
+  assert(fabs(bpm - 90) < 4);
+  assert(max <= (uint32_t)(2800*0x1F) && max > (uint32_t)(2800*0x1F*0.995) && fabs(pi - 2.0) < 0.1);
+
+  // Sensor off and saturation
+  static const ppg_synth_period_t periods[] = {
+    { PPG_SYNTH_SENSOR_OFF, 1000, 1000 },
+    { PPG_SYNTH_SATURATED,  3000, 500 },
+  };
+  PPG_Synth_Default_Config(&config);
+  config.periods = periods;
+  config.nperiods = 2;
+  PPG_Synth_Init(&synth, &config);
+  PPG_Synth_Fill(&synth, 0, 0x1F, TEST_RATE, a, 4*TEST_RATE);
+  assert(a[TEST_RATE + TEST_RATE/2] < 2400*0x1F/20);
+  assert(a[3*TEST_RATE + TEST_RATE/10] == MAX_30101_ADC_FULL_SCALE);
+  assert(a[2*TEST_RATE + TEST_RATE/2] > 2400*0x1F/2 && a[2*TEST_RATE + TEST_RATE/2] < MAX_30101_ADC_FULL_SCALE);
+
+  // Motion bursts leave the pulse far behind
+  PPG_Synth_Default_Config(&config);
+  config.motion_per_min = 6;
+  config.motion_depth = 0.2;
+  PPG_Synth_Init(&synth, &config);
+  PPG_Synth_Fill(&synth, 1, 0x1F, TEST_RATE, a, TEST_LEN);
+  min = UINT32_MAX; max = 0;
+  for (int i = 0; i < TEST_LEN; i++)
+  {
+      min = a[i] < min ? a[i] : min;
+      max = a[i] > max ? a[i] : max;
+  }
+  assert(100.0*(max - min)/max > 10);
+
+  // FIFO bytes: two slots, 16 bit resolution, any rate of the sensor only
+  ppg_synth_fifo_t fifo = { .sample_rate = 100, .resolution = 16, .nleds = 2, .led = { 0, 1 }, .pa = { 0x1F, 0x1F } };
+  PPG_Synth_Default_Config(&config);
+  PPG_Synth_Init(&synth, &config);
+  assert(PPG_Synth_FIFO(&synth, &fifo, fifo_data, 4) && fifo.sample == 4);
+  for (int i = 0; i < 8; i++)
+  {
+      uint32_t value = ((uint32_t)fifo_data[3*i] << 16) | (fifo_data[3*i + 1] << 8) | fifo_data[3*i + 2];
+      assert((value <= MAX_30101_ADC_FULL_SCALE) && ((value & 0x3) == 0) && (value > 0));
+  }
+  fifo.sample_rate = 300;
+  assert(!PPG_Synth_FIFO(&synth, &fifo, fifo_data, 4));
+
+  printf("PPG synth OK\n");
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * ppg_synth.h
+ *
+ *  Synthetic PPG signals for the DSP benchmarks, the sensor model and the
+ *  host tests: red, IR and green channels with heart rate variability,
+ *  respiration, perfusion index, DC level, noise, motion, saturation and
+ *  sensor off periods, as 18 bit ADC counts or MAX30101 FIFO bytes. The
+ *  same configuration and seed always give the same signal.
+ *
+ */
+
+#ifndef SRC_PPG_SYNTH_H_
+#define SRC_PPG_SYNTH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PPG_SYNTH_LEDS          3       // 0 red, 1 IR, 2 green, as the MAX30101 LEDs
+#define PPG_SYNTH_MOTION_TONES  3       // Sines summed into a motion artefact
+
+typedef enum
+{
+  PPG_SYNTH_SENSOR_OFF,                 // Finger lifted: ambient light and a little LED leakage
+  PPG_SYNTH_SATURATED,                  // Ambient light floods the photodiode, the ADC is at full scale
+  PPG_SYNTH_MOTION,                     // A motion burst for the whole period
+} ppg_synth_period_kind_t;
+
+// A scripted period, on top of the random motion bursts
+typedef struct
+{
+  ppg_synth_period_kind_t kind;
+  uint32_t start_ms;
+  uint32_t duration_ms;
+} ppg_synth_period_t;
+
+typedef struct
+{
+  uint32_t seed;
+
+  // Heart
+  double hr_bpm;                        // Mean heart rate
+  double hrv_ms;                        // Standard deviation of the beat to beat interval
+
+  // Respiration, 0 for none
+  double resp_bpm;                      // Breaths per minute
+  double resp_rsa;                      // Beat to beat interval modulation (sinus arrhythmia), fraction
+  double resp_am;                       // Pulse amplitude modulation, fraction
+  double resp_bw;                       // Baseline wander, fraction of the DC level
+
+  // Optics, per LED
+  double dc_per_pa[PPG_SYNTH_LEDS];     // ADC counts per LEDx_PA step that come back from the finger
+  double pi_pct[PPG_SYNTH_LEDS];        // Perfusion index, AC/DC in %
+  double ambient;                       // ADC counts of ambient light left after cancellation
+
+  // Noise spectrum, ADC counts rms
+  double white_rms;
+  double pink_rms;                      // 1/f, shaped at the sample rate
+  double flicker;                       // Amplitude of the lighting flicker
+  double flicker_hz;                    // Twice the mains frequency
+
+  // Random motion bursts
+  double motion_per_min;                // Mean bursts per minute, 0 for none
+  uint32_t motion_ms;                   // Length of a burst
+  double motion_depth;                  // Artefact amplitude, fraction of the DC level
+
+  const ppg_synth_period_t *periods;
+  size_t nperiods;
+} ppg_synth_config_t;
+
+typedef struct
+{
+  ppg_synth_config_t config;
+
+  uint64_t rng;
+  bool started;
+  uint64_t now_us;                      // Time of the last sample, times may not go back
+
+  double resp_phase;
+  double pulse_scale;                   // Normalises the pulse shape to a peak of 1
+
+  // Beats, beats and last_rr_us are the ground truth for the estimators
+  uint64_t beat_us;                     // Start of the current beat
+  uint64_t next_beat_us;
+  uint32_t beats;
+  uint32_t last_rr_us;
+
+  // Motion burst, random or scripted
+  uint64_t next_motion_us;
+  uint64_t motion_start_us;
+  uint64_t motion_end_us;
+  double motion_hz[PPG_SYNTH_MOTION_TONES];
+  double motion_phase[PPG_SYNTH_MOTION_TONES];
+
+  double pink[PPG_SYNTH_LEDS][3];       // Pink noise filter state
+} ppg_synth_t;
+
+// Sampling of PPG_Synth_FIFO(), as configured in the sensor
+typedef struct
+{
+  uint32_t sample_rate;                 // 50 to 3200 sps, one of the SPO2_SR rates
+  uint32_t resolution;                  // ADC bits, 15 to 18 (LED pulse width)
+  uint8_t nleds;                        // Active slots
+  uint8_t led[PPG_SYNTH_LEDS];          // LED of each slot
+  uint8_t pa[PPG_SYNTH_LEDS];           // LEDx_PA of each slot
+  uint64_t sample;                      // Index of the next sample, moved by PPG_Synth_FIFO()
+} ppg_synth_fifo_t;
+
+void PPG_Synth_Default_Config (ppg_synth_config_t *config);
+void PPG_Synth_Init (ppg_synth_t *synth, const ppg_synth_config_t *config);
+uint32_t PPG_Synth_Sample (ppg_synth_t *synth, uint8_t led, uint64_t t_us, uint8_t pa);
+uint32_t PPG_Synth_Source (void *ctx, uint8_t led, uint64_t t_us, uint8_t pa);
+bool PPG_Synth_FIFO (ppg_synth_t *synth, ppg_synth_fifo_t *fifo, uint8_t *data, size_t nsamples);
+void PPG_Synth_Fill (ppg_synth_t *synth, uint8_t led, uint8_t pa, uint32_t sample_rate, uint32_t *samples, size_t nsamples);
+
+#endif /* SRC_PPG_SYNTH_H_ */
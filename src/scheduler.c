@@ -17,51 +17,388 @@
 #include "autocorrelate.h"
 #include "MAX_30101.h"
 #include "gpio.h"
+#include "sensor_capture.h"
 
 /**************************************************************************//**
  * GLOBAL variable declaration
  *****************************************************************************/
 uint32_t eventHandler=0;
 
-uint8_t cbfifo_array[ARRAY_CAPACITY];
-uint8_t *write = cbfifo_array;
-uint8_t *read = cbfifo_array;
-uint8_t capacity_full = 0;
-
-#define MASTER_BUFFER (31*10)
+#define FIFO_PRESET (MAX_30101_FIFO_BALANCED)            // Latency vs. wakeups trade off of the sensor FIFO
+#define PROXIMITY_GATING (true)                           // Sample only once the sensor sees a finger
+#define LED_AGC (true)                                    // Step the LED current to keep the ADC in range
+#define MIN_WINDOW_MS (2000)                              // Shortest window, used for clean signals
+#define DEFAULT_WINDOW_MS (4000)
+#define MAX_WINDOW_MS (8000)                              // Longest window, used for noisy signals
+#define MAX_WINDOW_RATE (400)                             // Fastest sample rate (after averaging) the longest window is sized for
+#define MASTER_BUFFER (MAX_WINDOW_MS*MAX_WINDOW_RATE/1000 + MAX_30101_FIFO_DEPTH) // Statically allocated for the longest window, rounded up to a FIFO batch
+#define PI_CLEAN_SIGNAL (50)                              // Perfusion index (0.01 %) above which the signal is treated as clean
 #define FINGER_PRESS_BUFFER (3)
+#define EMPTY_WINDOWS_CLEAR (2)                           // Windows in a row without a beat before the reading is cleared
+#ifndef SENSOR_CAPTURE
+#define SENSOR_CAPTURE (false)                            // Streams the sensor traffic over VCOM for replay on a host (sensor_capture.h)
+#endif
+#define CAPTURE_RING_SIZE (2048)                          // Two seconds of a three LED FIFO at 400 sps
+#define CAPTURE_LINE_BYTES (32)                           // Capture bytes per VCOM line
+#define BUS_DIAG_DUMP_RESULTS (20)                        // Heart rate results between two dumps of the sensor bus diagnostics on VCOM, 0 for none
 
 uint32_t hr_buffer[MASTER_BUFFER];
 uint32_t *hr_buffer_ptr = hr_buffer;
+max_30101_fifo_preset_t fifo_preset = FIFO_PRESET;     // Applied at the start of every measurement
+uint32_t fifo_batch = MAX_30101_FIFO_DEPTH;              // Samples per FIFO almost full interrupt, set by the preset
+uint32_t window_ms = DEFAULT_WINDOW_MS;                // Length of the next measurement
+uint32_t window_len = DEFAULT_WINDOW_MS*MAX_WINDOW_RATE/1000; // Samples collected for the current measurement
+
+uint32_t hr_marks[(MASTER_BUFFER + 31)/32];            // Bit set for samples scaled after an LED current step
+uint8_t window_led_pa = 0;                              // LED1_PA of the first batch of the window
+uint32_t marked_samples = 0;
 
 uint32_t finger_press[FINGER_PRESS_BUFFER];
 
-uint32_t calc_hr, heart_rate = 0, count = 0;
+uint8_t fifo_data[MAX_30101_FIFO_DEPTH*MAX_30101_BYTES_PER_LED*MAX_30101_NUM_LEDS]; // One FIFO burst
+
+// Filled by the interrupt driven I2C transfers, must outlive the state machine call
+uint8_t fifo_status[MAX_30101_FIFO_STATUS_LEN];
+uint8_t data_to_read = 0;
+
+uint8_t die_temp_data[MAX_30101_DIE_TEMP_LEN];
+bool die_temp_pending = false; // Conversion started, not collected yet
+bool die_temp_ready = false;   // DIE_TEMP_RDY seen, read with the next FIFO drain
+
+max_30101_batch_t fifo_batch_info;
+uint32_t next_sample_index = 0; // Index the next drained sample should have if none were lost
+
+#if SENSOR_CAPTURE
+uint8_t capture_ring[CAPTURE_RING_SIZE];
+sensor_capture_t capture;
+#endif
+
+sensor_bus_t *diag_bus = NULL; // Bus whose diagnostics are published, set by diagInit()
+
+uint32_t calc_hr, heart_rate = 0, prev_calc_hr = 0, count = 0;
+uint32_t empty_windows = 0; // Windows in a row the autocorrelation found no beat in
+
+// Accumulated while the FIFO is drained so the perfusion index needs no second pass over hr_buffer
+uint32_t dc_sum = 0, ac_min = UINT32_MAX, ac_max = 0;
+
+
+/**************************************************************************//**
+ * This function sizes the acquisition window of the next measurement from the
+ * quality of the one that just finished. A clean signal (good perfusion index
+ * and an estimate that agrees with the previous one) halves the window so the
+ * sensor is turned off sooner, a noisy or failed one doubles it. The window
+ * stays between MIN_WINDOW_MS and MAX_WINDOW_MS and is never shrunk below two
+ * periods of the estimate, so the autocorrelation always sees a second beat.
+ *
+ * @param:
+ *      period:          Period returned by the autocorrelation, -1 on failure
+ *      estimate:        Heart rate computed from the period
+ *      perfusion_index: Perfusion index of the window in units of 0.01 %
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void updateWindowLength(int period, uint32_t estimate, uint16_t perfusion_index)
+{
+  uint32_t ms = window_ms;
+  uint32_t floor_ms = MIN_WINDOW_MS;
+  bool estimate_valid = (period > 0) && (estimate <= 180);
+  bool estimate_stable = estimate_valid && (prev_calc_hr != 0) &&
+                         ((estimate > prev_calc_hr ? estimate - prev_calc_hr : prev_calc_hr - estimate) <= (prev_calc_hr/10));
+
+  // Two periods of the estimate
+  if (estimate_valid && ((2000*(uint32_t)period)/MAX_30101_Get_Sample_Rate() > floor_ms))
+    floor_ms = (2000*(uint32_t)period)/MAX_30101_Get_Sample_Rate();
+
+  if (estimate_stable && perfusion_index >= PI_CLEAN_SIGNAL)
+  {
+      ms = (ms/2 < floor_ms) ? floor_ms : ms/2;
+  }
+  else if (!estimate_valid || perfusion_index < PI_CLEAN_SIGNAL)
+  {
+      ms = ms*2;
+  }
+
+  if (ms < floor_ms)
+    ms = floor_ms;
+  if (ms > MAX_WINDOW_MS)
+    ms = MAX_WINDOW_MS;
+
+  if (ms != window_ms)
+  {
+      LOG_INFO("Window length changed to %d ms", (int)ms);
+      window_ms = ms;
+  }
+}
+
+
+/**************************************************************************//**
+ * This function clears the heart rate reading once nobody is on the sensor:
+ * the status LED characteristic goes to condition_NotUsed and the display
+ * shows "Not Pressed". Nothing is written if the reading is already cleared.
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void clearHeartRate()
+{
+  ble_data_struct_t *ble_data_ptr = getBleDataPtr();
+  sl_status_t sc;
+
+  if (heart_rate == 0)
+    return;
+
+  heart_rate = 0;
+  ble_data_ptr->heart_rate_status_led_value = condition_NotUsed;
+  displayPrintf(DISPLAY_ROW_9, "Not Pressed");
+
+  // Writing attribute value to the GATT server
+  sc = sl_bt_gatt_server_write_attribute_value(gattdb_heart_rate_led,
+                                               0,
+                                               sizeof(ble_data_ptr->heart_rate_status_led_value),
+                                               &(ble_data_ptr->heart_rate_status_led_value));
+
+  // Printing the error message if the Server Write Failed fails
+  if (sc != 0)
+    LOG_ERROR("!!! Server Write Failed !!!\nError Code: 0x%x",sc);
+}
+
+
+#if SENSOR_CAPTURE
+/**************************************************************************//**
+ * Time stamp of the capture records
+ *****************************************************************************/
+static uint32_t captureNow()
+{
+  return letimerMilliseconds()*1000;
+}
+
+
+/**************************************************************************//**
+ * Sensor bus tap of the capture, may run in the I2C interrupt
+ *****************************************************************************/
+static void captureTap(void *ctx, uint8_t addr, bool write, uint8_t reg, const uint8_t *data, size_t len,
+                       sensor_bus_status_t status)
+{
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+
+  Sensor_Capture_Tap(ctx, addr, write, reg, data, len, status);
+
+  CORE_EXIT_CRITICAL();
+}
+
+
+/**************************************************************************//**
+ * This function records an event handed to the heart rate state machine
+ *
+ * @param:
+ *      event: The external signal
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void captureSignal(uint32_t event)
+{
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+
+  Sensor_Capture_Signal(&capture, event);
+
+  CORE_EXIT_CRITICAL();
+}
+
+
+/**************************************************************************//**
+ * Output of the capture, lines of hex on VCOM
+ *****************************************************************************/
+static void captureOut(void *ctx, const uint8_t *data, size_t len)
+{
+  char line[2*CAPTURE_LINE_BYTES + 1];
+
+  (void)ctx;
+
+  while (len)
+  {
+      size_t n = (len < CAPTURE_LINE_BYTES) ? len : CAPTURE_LINE_BYTES;
+
+      for (size_t i = 0; i < n; i++)
+      {
+          line[2*i] = "0123456789abcdef"[data[i] >> 4];
+          line[2*i + 1] = "0123456789abcdef"[data[i] & 0x0F];
+      }
+      line[2*n] = '\0';
+
+      app_log("SCAP %s\n", line);
+
+      data += n;
+      len -= n;
+  }
+}
+#endif
+
+
+/**************************************************************************//**
+ * This function starts capturing the traffic of a sensor bus when
+ * SENSOR_CAPTURE is on. The capture is streamed over VCOM from the main loop
+ * as lines of hex, "SCAP " followed by up to CAPTURE_LINE_BYTES bytes, so it
+ * survives the log lines around it. The capture file is recovered from a
+ * terminal log with
+ *
+ *    sed -n 's/^SCAP //p' vcom.log | xxd -r -p > session.scap
+ *
+ * and replayed on a host with host_replay (host_replay.c).
+ *
+ * @param:
+ *      bus: The bus of the heart rate sensor
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void captureInit(sensor_bus_t *bus)
+{
+#if SENSOR_CAPTURE
+  Sensor_Capture_Init(&capture, capture_ring, sizeof(capture_ring), captureNow);
+  Sensor_Bus_Set_Tap(bus, captureTap, &capture);
+#else
+  (void)bus;
+#endif
+}
+
+
+/**************************************************************************//**
+ * This function selects the bus whose statistics and diagnostics (per device
+ * counters, duration histogram and last transactions, sensor_bus.h) are
+ * published with every heart rate result
+ *
+ * @param:
+ *      bus: The bus of the heart rate sensor
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void diagInit(sensor_bus_t *bus)
+{
+  diag_bus = bus;
+}
+
+
+/**************************************************************************//**
+ * This function dumps the diagnostics of the bus on VCOM
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void diagDump()
+{
+  static sensor_bus_stats_t stats;
+  static sensor_bus_diag_t diag;
+
+  CORE_DECLARE_IRQ_STATE;
+
+  // A snapshot, the I2C interrupt keeps counting meanwhile
+  CORE_ENTER_CRITICAL();
+  stats = diag_bus->stats;
+  diag = diag_bus->diag;
+  CORE_EXIT_CRITICAL();
+
+  LOG_INFO("Bus %s: %lu transactions, %lu bytes, %lu NACKs, %lu errors, %lu ms busy", diag_bus->name,
+           (unsigned long)stats.transactions, (unsigned long)stats.bytes, (unsigned long)stats.nacks,
+           (unsigned long)stats.errors, (unsigned long)(stats.busy_us/1000));
+
+  for (uint8_t i = 0; i < diag.ndevices; i++)
+    LOG_INFO("  0x%02x: %lu transactions, %lu bytes, %lu NACKs, %lu errors, %lu ms busy", diag.devices[i].addr,
+             (unsigned long)diag.devices[i].stats.transactions, (unsigned long)diag.devices[i].stats.bytes,
+             (unsigned long)diag.devices[i].stats.nacks, (unsigned long)diag.devices[i].stats.errors,
+             (unsigned long)(diag.devices[i].stats.busy_us/1000));
+
+  for (uint32_t i = 0; i < SENSOR_BUS_HIST_BUCKETS; i++)
+  {
+      if (i < SENSOR_BUS_HIST_BUCKETS - 1)
+        LOG_INFO("  < %5lu us: %lu", (unsigned long)(SENSOR_BUS_HIST_BASE_US << i), (unsigned long)diag.hist[i]);
+      else
+        LOG_INFO("  >= %4lu us: %lu", (unsigned long)(SENSOR_BUS_HIST_BASE_US << (i - 1)), (unsigned long)diag.hist[i]);
+  }
+
+  for (uint32_t age = 0; (age < SENSOR_BUS_TRACE_LEN) && (age < diag.traced); age++)
+  {
+      const sensor_bus_trace_t *trace = &diag.trace[(diag.traced - 1 - age) % SENSOR_BUS_TRACE_LEN];
+
+      LOG_INFO("  %10lu us: 0x%02x %s 0x%02x, %u bytes, %lu us, status %d", (unsigned long)trace->start_us, trace->addr,
+               trace->write ? "write" : "read ", trace->reg, trace->len, (unsigned long)trace->duration_us, trace->status);
+  }
+}
+
+
+/**************************************************************************//**
+ * This function publishes the diagnostics of the bus: the GATT
+ * characteristic is updated and, every BUS_DIAG_DUMP_RESULTS heart rate
+ * results, they are dumped on VCOM
+ *
+ * @param:
+ *      no params
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void diagPublish()
+{
+  if (diag_bus == NULL)
+    return;
+
+  uint8_t diag_buffer[SENSOR_BUS_PACK_MAX];
+  size_t len;
+  sl_status_t sc;
+
+  CORE_DECLARE_IRQ_STATE;
+
+  CORE_ENTER_CRITICAL();
+  len = Sensor_Bus_Diag_Pack(diag_bus, diag_buffer, sizeof(diag_buffer));
+  CORE_EXIT_CRITICAL();
+
+  // Writing attribute value to the GATT server
+  sc = sl_bt_gatt_server_write_attribute_value(gattdb_i2c_diagnostics, 0, len, diag_buffer);
+
+  // Printing the error message if the Server Write Failed fails
+  if (sc != 0)
+    LOG_ERROR("!!! Server Write Failed !!!\nError Code: 0x%x",sc);
+
+  if ((BUS_DIAG_DUMP_RESULTS != 0) && ((count % BUS_DIAG_DUMP_RESULTS) == 0))
+    diagDump();
+}
 
 
 /**************************************************************************//**
  * This is a state machine that is designed for measuring the heart rate at
- * regular intervals.
+ * regular intervals. It takes one event at a time, see state_machine_hr().
  *
  * Note: When any of the events fail then we will do a standard reset of the
  * controller. This will clear up the stack and reset the state informations
  * too.
  *
  * @param:
- *      no params
+ *      event: A single event flag of eventList_hr
  *
  * @return:
- *      returns the event that is next in line
+ *      no return
  *****************************************************************************/
-void state_machine_hr (sl_bt_msg_t *evt)
+static void state_machine_hr_event (uint32_t event)
 {
 
-  int32_t event = evt->data.evt_system_external_signal.extsignals, sc=0;
+  int32_t sc=0;
 
   ble_data_struct_t *ble_data_ptr = getBleDataPtr();
 
   uint8_t hrm_heartrate_buffer[5]={0}, cb_buffer_load[11]={0};
-  uint8_t *p = &hrm_heartrate_buffer[1], finger_present, write_ptr, read_ptr;
+  uint8_t *p = &hrm_heartrate_buffer[1], finger_present;
 
   State_t_hr currentState;
   static State_t_hr nextState = state_Idle_hr;
@@ -69,35 +406,50 @@ void state_machine_hr (sl_bt_msg_t *evt)
   currentState = nextState;
 
 //  printf("%d, %d\n",event, currentState);
-  // DOS your state machine is indexing into that BT stack union for all events
-  // passed to your state machine and you are failing to check for
-  // event == sl_bt_evt_system_external_signal_id first !!!
-  // evt->data.evt_system_external_signal.extsignals is only valid for
-  // sl_bt_evt_system_external_signal_id
-  if (SL_BT_MSG_ID(evt->header) != sl_bt_evt_system_external_signal_id) {
-      return;
-  }
+
+#if SENSOR_CAPTURE
+  // The I2C completions are not captured, the replay makes its own
+  if (!(event & event_I2CTransfer_IRQ_hr))
+    captureSignal(event);
+#endif
 
   switch (currentState)
   {
     /****************************State 1****************************/
     case state_Idle_hr:
       nextState = state_Idle_hr; // default
-      if (event == event_measureMAX30101_hr) //When LETIMER_UF happens
+      if (event & event_measureMAX30101_hr) //When LETIMER_UF happens
       {
           sl_power_manager_add_em_requirement(SL_POWER_MANAGER_EM1);
 
           gpioMAX30101IntEnable();
 
+          MAX_30101_Set_FIFO_Preset(fifo_preset);
+          MAX_30101_Set_Proximity(PROXIMITY_GATING);
+          MAX_30101_Set_AGC(LED_AGC);
+
+          // The window is window_ms at the profile rate, rounded up to a
+          // whole number of FIFO batches of the preset
+          fifo_batch = MAX_30101_Get_FIFO_Batch();
+          window_len = window_ms*MAX_30101_Get_Sample_Rate()/1000;
+          window_len = ((window_len + fifo_batch - 1)/fifo_batch)*fifo_batch;
+          if (window_len > MASTER_BUFFER)
+            window_len = (MASTER_BUFFER/fifo_batch)*fifo_batch;
+
           MAX_30101_Init();
 
+          // Converts while the first batch is collected
+          MAX_30101_Start_Temperature();
+          die_temp_pending = true;
+          die_temp_ready = false;
+
           sl_power_manager_remove_em_requirement(SL_POWER_MANAGER_EM1);
 
 //          printf("\nState 1 : Powered Up\n");
 
           nextState = state_Init_hr;
       }
-      if (event == event_SystemError_hr)
+      if (event & event_SystemError_hr)
       {
           nextState = state_Idle_hr;
       }
@@ -107,33 +459,149 @@ void state_machine_hr (sl_bt_msg_t *evt)
     case state_Init_hr:
       nextState = state_Init_hr; // default
 
-      if (event == event_bufferFullMAX30101_hr) //When LETIMER_UF happens
+      if (event & event_bufferFullMAX30101_hr) //When LETIMER_UF happens
       {
 //          printf("State 2 : Buffer full clear it\n");
-          sl_power_manager_add_em_requirement(SL_POWER_MANAGER_EM1);
-          i2c_Write_Read_blocking(0x06, &read_ptr, sizeof(read_ptr));
 
-          i2c_Write_Read_blocking(0x04, &write_ptr, sizeof(write_ptr));
+          // Interrupt status, FIFO pointers and overflow counter in one burst,
+          // reading the status also clears the interrupt. The transfer runs
+          // from the I2C interrupt and event_I2CTransfer_IRQ_hr is posted
+          // once it is done
+          MAX_30101_Queue_Read_FIFO_Status(fifo_status);
+          MAX_30101_Async_Submit();
 
-          int8_t data_to_read = (write_ptr-read_ptr);
+          nextState = state_Read_Pointers_hr;
+      }
+      if ((event & event_measureMAX30101_hr) && MAX_30101_Get_Proximity() &&
+          (hr_buffer_ptr == hr_buffer))
+      {
+          // Still in proximity mode a whole period later, nobody is on the
+          // sensor. It stays armed, only the reading is cleared.
+          clearHeartRate();
+      }
+      if (event & event_SystemError_hr)
+      {
+          nextState = state_Idle_hr;
+      }
+    break;
 
-          if (data_to_read<0)
-            data_to_read = (32 + data_to_read);
+    /****************************State 3****************************/
+    case state_Read_Pointers_hr:
+      nextState = state_Read_Pointers_hr; // default
 
+      if (event & event_I2CTransfer_IRQ_hr)
+      {
+          if (fifo_status[MAX_30101_REG_INT_STATUS_1] & MAX_30101_INT_PROX)
+            LOG_INFO("Finger detected, sampling");
 
+          // The status read clears DIE_TEMP_RDY, it is kept until TINT and
+          // TFRAC are read. Before it, they still hold the last conversion.
+          if (die_temp_pending &&
+              (fifo_status[MAX_30101_REG_INT_STATUS_2] & MAX_30101_INT_DIE_TEMP_RDY))
+            die_temp_ready = true;
+
+          if (!(fifo_status[MAX_30101_REG_INT_STATUS_1] & MAX_30101_INT_A_FULL))
+          {
+              // Not an almost full interrupt, keep waiting for the next one
+              nextState = state_Init_hr;
+              break;
+          }
+
+          data_to_read = MAX_30101_FIFO_Account(fifo_status, &fifo_batch_info);
 
 //          printf("\nInterrupt Hit. The difference is : %d\n", (data_to_read));
 
+          // The whole batch is read in one transaction and unpacked in the next state
+          MAX_30101_Queue_Read_FIFO(fifo_data, data_to_read);
+
+          // Picked up by the same wakeup
+          if (die_temp_ready)
+            MAX_30101_Queue_Read_Temperature(die_temp_data);
+
+          MAX_30101_Async_Submit();
+
+          nextState = state_Read_FIFO_hr;
+      }
+      if (event & event_SystemError_hr)
+      {
+          MAX_30101_Async_Abort();
+
+          gpioMAX30101IntDisable();
+
+          nextState = state_Idle_hr;
+      }
+    break;
+
+    /****************************State 4****************************/
+    case state_Read_FIFO_hr:
+      nextState = state_Read_FIFO_hr; // default
+
+      if (event & event_I2CTransfer_IRQ_hr)
+      {
+          if (die_temp_ready)
+          {
+              die_temp_pending = false;
+              die_temp_ready = false;
+              ble_data_ptr->die_temperature = MAX_30101_Temperature_Centi(die_temp_data);
+          }
+
+          // Samples lost to a FIFO overflow in the middle of a window are
+          // stood in for by the last sample so the window keeps its time base
+          if (hr_buffer_ptr != hr_buffer)
+          {
+              for (uint32_t gap = fifo_batch_info.first_index - next_sample_index;
+                   (gap > 0) && ((uint32_t)(hr_buffer_ptr - hr_buffer) < window_len); gap--)
+              {
+                  *(hr_buffer_ptr) = *(hr_buffer_ptr - 1);
+                  dc_sum += *(hr_buffer_ptr);
+                  hr_buffer_ptr++;
+              }
+          }
+          next_sample_index = fifo_batch_info.first_index + fifo_batch_info.nsamples;
+
+          if (hr_buffer_ptr == hr_buffer)
+            window_led_pa = fifo_batch_info.led_pa_from ? fifo_batch_info.led_pa_before : fifo_batch_info.led_pa;
+
+          uint32_t batch_sum = 0;
+
           for (int i = 0; i<(data_to_read); i++)
           {
-            uint8_t result[3]={0};
+            uint8_t *result = &fifo_data[i*MAX_30101_Get_Bytes_Per_Sample()];
+
+            uint32_t reading = ((uint32_t)result[0]<<16 | (uint32_t)result[1]<<8 | (uint32_t)result[2]);
+
+            // The batch after an LED current step starts with samples taken at the old current
+            uint8_t led_pa = (i < fifo_batch_info.led_pa_from) ? fifo_batch_info.led_pa_before : fifo_batch_info.led_pa;
 
-            i2c_Write_Read_blocking(0x07, result, sizeof(result));
+            batch_sum += reading;
 
-            int32_t reading = ((uint32_t)result[0]<<16 | (uint32_t)result[1]<<8 | (uint32_t)result[2]);
+            // The FIFO still has to be drained once the window is full, but the extra samples are dropped
+            if ((uint32_t)(hr_buffer_ptr - hr_buffer) >= window_len)
+              continue;
+
+            // Samples taken after an LED current step are scaled back to the
+            // current the window started with so the window has no DC step
+            if ((led_pa != window_led_pa) && (led_pa != 0))
+            {
+                uint32_t index = hr_buffer_ptr - hr_buffer;
+
+                reading = ((uint64_t)reading*window_led_pa)/led_pa;
+                if (reading > MAX_30101_ADC_FULL_SCALE)
+                  reading = MAX_30101_ADC_FULL_SCALE;
+
+                hr_marks[index/32] |= (uint32_t)1 << (index%32);
+                marked_samples++;
+            }
 
             *(hr_buffer_ptr) = reading;
 
+            // DC level and AC peak-to-peak for the perfusion index
+            dc_sum += reading;
+            if (reading < ac_min)
+              ac_min = reading;
+            if (reading > ac_max)
+              ac_max = reading;
+
 //            i2c_Write_Read_blocking(0x06, &read_ptr, sizeof(read_ptr));
 //            i2c_Write_Read_blocking(0x04, &write_ptr, sizeof(write_ptr));
 //
@@ -142,209 +610,333 @@ void state_machine_hr (sl_bt_msg_t *evt)
             hr_buffer_ptr++;
           }
 
-          sl_power_manager_remove_em_requirement(SL_POWER_MANAGER_EM1);
-
 //          i2c_Write_Read_blocking(0x06, &read_ptr, sizeof(read_ptr));
 //          i2c_Write_Read_blocking(0x04, &write_ptr, sizeof(write_ptr));
 //
 //          printf("\nRd : %d\t Wr : %d\t Diff : %d\n", read_ptr, write_ptr, (hr_buffer_ptr - hr_buffer));
 
-          if ((hr_buffer_ptr - hr_buffer) == MASTER_BUFFER)
+          // LED current for the next batch, goes out while this one is
+          // processed. Not after the last batch, the sensor is shut down
+          // with a blocking write below.
+          if ((data_to_read > 0) && ((uint32_t)(hr_buffer_ptr - hr_buffer) < window_len) &&
+              MAX_30101_AGC_Update(batch_sum/data_to_read))
+            MAX_30101_Async_Submit();
+
+          if ((uint32_t)(hr_buffer_ptr - hr_buffer) >= window_len)
           {
             hr_buffer_ptr = hr_buffer;
 
-            calc_hr = ((12000*2)/(autocorrelate_detect_period(hr_buffer, MASTER_BUFFER, kAC_32bps_unsigned))) - (ble_data_ptr->factor);
+            // Perfusion index = AC/DC, stored in units of 0.01 %
+            ble_data_ptr->dc_level = dc_sum / window_len;
+            ble_data_ptr->ac_peak_to_peak = ac_max - ac_min;
+            if (ble_data_ptr->dc_level == 0)
+            {
+                ble_data_ptr->perfusion_index = 0;
+            }
+            else
+            {
+                uint64_t pi = ((uint64_t)ble_data_ptr->ac_peak_to_peak * 10000) / ble_data_ptr->dc_level;
+                ble_data_ptr->perfusion_index = (pi > UINT16_MAX) ? UINT16_MAX : (uint16_t)pi;
+            }
 
-            if ((calc_hr == 0) || (calc_hr<=180))
-              {
-                heart_rate = calc_hr;
-              }
+            dc_sum = 0;
+            ac_min = UINT32_MAX;
+            ac_max = 0;
 
-            finger_press[(count%FINGER_PRESS_BUFFER)] = calc_hr;
+            int period = autocorrelate_detect_period(hr_buffer, window_len, kAC_18bps_unsigned);
 
-            for (int i = 0; i < FINGER_PRESS_BUFFER; i++)
+            if (period <= 0)
             {
-              if ((finger_press[i] == 0) || (finger_press[i]<=120))
+                // No beat in the window: the last reading stands and the
+                // next window is longer. Something is on the sensor (it left
+                // proximity mode) but has no pulse, after a few windows the
+                // reading is cleared as if nobody was there.
+                LOG_INFO("No heart rate found in the window");
+                updateWindowLength(period, 0, ble_data_ptr->perfusion_index);
+
+                if (++empty_windows >= EMPTY_WINDOWS_CLEAR)
+                  clearHeartRate();
+            }
+            else
+            {
+                empty_windows = 0;
+                calc_hr = ((int)(60*MAX_30101_Get_Sample_Rate())/period) - (ble_data_ptr->factor);
+
+                updateWindowLength(period, calc_hr, ble_data_ptr->perfusion_index);
+
+                prev_calc_hr = calc_hr;
+
+                if ((calc_hr == 0) || (calc_hr<=180))
+                  {
+                    heart_rate = calc_hr;
+                  }
+
+                finger_press[(count%FINGER_PRESS_BUFFER)] = calc_hr;
+
+                for (int i = 0; i < FINGER_PRESS_BUFFER; i++)
                 {
-                  finger_present = 1;
-                  break;
+                  if ((finger_press[i] == 0) || (finger_press[i]<=120))
+                    {
+                      finger_present = 1;
+                      break;
+                    }
+                  else if (i == (FINGER_PRESS_BUFFER-1))
+                    finger_present = 0;
                 }
-              else if (i == (FINGER_PRESS_BUFFER-1))
-                finger_present = 0;
-            }
 
-            if (!finger_present)
-            {
-              heart_rate = 0;
-            }
+                if (!finger_present)
+                {
+                  heart_rate = 0;
+                }
 
-            count++;
+                count++;
 
-            LOG_INFO ("Heart Rate:  %d", heart_rate);
+                LOG_INFO ("Heart Rate:  %d", heart_rate);
 
-            UINT32_TO_BITSTREAM(p, heart_rate);
+                UINT32_TO_BITSTREAM(p, heart_rate);
 
-            if (heart_rate == 0)
-            {
-                ble_data_ptr->heart_rate_status_led_value = condition_NotUsed;
-                displayPrintf(DISPLAY_ROW_9, "Not Pressed");
-            }
-            else if ((0 < heart_rate) && (heart_rate <= 60))
-            {
-                ble_data_ptr->heart_rate_status_led_value = condition_Bradycardia;
-                displayPrintf(DISPLAY_ROW_9, "Bradycardia");
-            }
-            else if ((60 < heart_rate) && (heart_rate <= 100))
-            {
-                ble_data_ptr->heart_rate_status_led_value = condition_Normal;
-                displayPrintf(DISPLAY_ROW_9, "Normal");
-            }
-            else if (100 <= heart_rate)
-            {
-                ble_data_ptr->heart_rate_status_led_value = condition_Tachycardia;
-                displayPrintf(DISPLAY_ROW_9, "Tachycardia");
-            }
+                if (heart_rate == 0)
+                {
+                    ble_data_ptr->heart_rate_status_led_value = condition_NotUsed;
+                    displayPrintf(DISPLAY_ROW_9, "Not Pressed");
+                }
+                else if ((0 < heart_rate) && (heart_rate <= 60))
+                {
+                    ble_data_ptr->heart_rate_status_led_value = condition_Bradycardia;
+                    displayPrintf(DISPLAY_ROW_9, "Bradycardia");
+                }
+                else if ((60 < heart_rate) && (heart_rate <= 100))
+                {
+                    ble_data_ptr->heart_rate_status_led_value = condition_Normal;
+                    displayPrintf(DISPLAY_ROW_9, "Normal");
+                }
+                else if (100 <= heart_rate)
+                {
+                    ble_data_ptr->heart_rate_status_led_value = condition_Tachycardia;
+                    displayPrintf(DISPLAY_ROW_9, "Tachycardia");
+                }
 
 
-  //          displayPrintf(DISPLAY_ROW_TEMPVALUE, "");
-
-            if (ble_data_ptr->flag_conection == true &&
-                ble_data_ptr->flag_indication_hr == true &&
-                ble_data_ptr->flag_bonded == true &&
-                ble_data_ptr->flag_indication_in_progress == true &&
-                cbfifo_length() == cbfifo_capacity())
-             {
-               LOG_ERROR("Buffer Full!! This indication will not be stored and will be lost.");
-             }
-            // If indications are in flight then we will execute the below
-            else if ((ble_data_ptr->flag_indication_hr == true) &&
-                (ble_data_ptr->flag_conection == true) &&
-                (ble_data_ptr->flag_indication_in_progress == false) &&
-                cbfifo_length() != cbfifo_capacity())
-            {
+      //          displayPrintf(DISPLAY_ROW_TEMPVALUE, "");
+
+                if (ble_data_ptr->flag_conection == true &&
+                    ble_data_ptr->flag_indication_hr == true &&
+                    ble_data_ptr->flag_bonded == true &&
+                    ble_data_ptr->flag_indication_in_progress == true &&
+                    cbfifo_length() == cbfifo_capacity())
+                 {
+                   LOG_ERROR("Buffer Full!! This indication will not be stored and will be lost.");
+                 }
+                // If indications are in flight then we will execute the below
+                else if ((ble_data_ptr->flag_indication_hr == true) &&
+                    (ble_data_ptr->flag_conection == true) &&
+                    (ble_data_ptr->flag_indication_in_progress == false) &&
+                    cbfifo_length() != cbfifo_capacity())
+                {
 
-                // Sending indication
-                sc = sl_bt_gatt_server_send_indication(ble_data_ptr->connectionHandle,
-                                                       gattdb_heart_rate_measurement,
-                                                       sizeof(hrm_heartrate_buffer),
-                                                       hrm_heartrate_buffer);
-  //              LOG_INFO("Indication Sent");
-                ble_data_ptr->flag_indication_in_progress = true;
+                    // Sending indication
+                    sc = sl_bt_gatt_server_send_indication(ble_data_ptr->connectionHandle,
+                                                           gattdb_heart_rate_measurement,
+                                                           sizeof(hrm_heartrate_buffer),
+                                                           hrm_heartrate_buffer);
+      //              LOG_INFO("Indication Sent");
+                    ble_data_ptr->flag_indication_in_progress = true;
 
-                // Printing the error message if the Sending Indication fails
-                if (sc != 0)
-                  LOG_ERROR("!!! Sending Indication Failed !!!\nError Code: 0x%x",sc);
+                    // Printing the error message if the Sending Indication fails
+                    if (sc != 0)
+                      LOG_ERROR("!!! Sending Indication Failed !!!\nError Code: 0x%x",sc);
 
-                displayPrintf(DISPLAY_ROW_TEMPVALUE, "%d bpm", (int)heart_rate);
-            }
-            else if ((ble_data_ptr->flag_indication_hr == true) &&
-                     (ble_data_ptr->flag_conection == true) &&
-                     (ble_data_ptr->flag_indication_in_progress == true))
-            {
-  //              printf("%x\n%x\n%x\n",gattdb_temperature_type, sizeof(htm_temperature_buffer), htm_temperature_buffer[1]);
-                cb_buffer_load[0] = (uint8_t) ((gattdb_heart_rate_measurement >> 8) & 0x00FF);
-                cb_buffer_load[1] = (uint8_t) ((gattdb_heart_rate_measurement >> 0) & 0x00FF);
-                cb_buffer_load[2] = (uint8_t) ((sizeof(hrm_heartrate_buffer) >> 24) & 0x000000FF);
-                cb_buffer_load[3] = (uint8_t) ((sizeof(hrm_heartrate_buffer) >> 16) & 0x000000FF);
-                cb_buffer_load[4] = (uint8_t) ((sizeof(hrm_heartrate_buffer) >> 8) & 0x000000FF);
-                cb_buffer_load[5] = (uint8_t) ((sizeof(hrm_heartrate_buffer) >> 0) & 0x000000FF);
-                cb_buffer_load[6] = hrm_heartrate_buffer[0];
-                cb_buffer_load[7] = hrm_heartrate_buffer[1];
-                cb_buffer_load[8] = hrm_heartrate_buffer[2];
-                cb_buffer_load[9] = hrm_heartrate_buffer[3];
-                cb_buffer_load[10] = hrm_heartrate_buffer[4];
-
-  //              // For debugging purpose only
-  //              printf("\nOriginal\n%d\t%d\t%d\t%d\t%d\n%d\n%d\n\n", cb_buffer_load[6],
-  //                     cb_buffer_load[7],
-  //                     cb_buffer_load[8],
-  //                     cb_buffer_load[9],
-  //                     cb_buffer_load[10],
-  //                     sizeof(htm_temperature_buffer),
-  //                     gattdb_temperature_type);
-  //
-  //              printf("%d", (sizeof(cb_buffer_load)/sizeof(uint8_t))); // For debugging purpose only
-                cbfifo_enqueue(cb_buffer_load, (sizeof(cb_buffer_load)/sizeof(uint8_t)));
-
-                LOG_INFO("Heart Rate indication added to buffer : %d indications left in the buffer", (cbfifo_length()/11));
-            }
+                    displayPrintf(DISPLAY_ROW_TEMPVALUE, "%d bpm", (int)heart_rate);
+                }
+                else if ((ble_data_ptr->flag_indication_hr == true) &&
+                         (ble_data_ptr->flag_conection == true) &&
+                         (ble_data_ptr->flag_indication_in_progress == true))
+                {
+      //              printf("%x\n%x\n%x\n",gattdb_temperature_type, sizeof(htm_temperature_buffer), htm_temperature_buffer[1]);
+                    cb_buffer_load[0] = (uint8_t) ((gattdb_heart_rate_measurement >> 8) & 0x00FF);
+                    cb_buffer_load[1] = (uint8_t) ((gattdb_heart_rate_measurement >> 0) & 0x00FF);
+                    cb_buffer_load[2] = (uint8_t) ((sizeof(hrm_heartrate_buffer) >> 24) & 0x000000FF);
+                    cb_buffer_load[3] = (uint8_t) ((sizeof(hrm_heartrate_buffer) >> 16) & 0x000000FF);
+                    cb_buffer_load[4] = (uint8_t) ((sizeof(hrm_heartrate_buffer) >> 8) & 0x000000FF);
+                    cb_buffer_load[5] = (uint8_t) ((sizeof(hrm_heartrate_buffer) >> 0) & 0x000000FF);
+                    cb_buffer_load[6] = hrm_heartrate_buffer[0];
+                    cb_buffer_load[7] = hrm_heartrate_buffer[1];
+                    cb_buffer_load[8] = hrm_heartrate_buffer[2];
+                    cb_buffer_load[9] = hrm_heartrate_buffer[3];
+                    cb_buffer_load[10] = hrm_heartrate_buffer[4];
+
+      //              // For debugging purpose only
+      //              printf("\nOriginal\n%d\t%d\t%d\t%d\t%d\n%d\n%d\n\n", cb_buffer_load[6],
+      //                     cb_buffer_load[7],
+      //                     cb_buffer_load[8],
+      //                     cb_buffer_load[9],
+      //                     cb_buffer_load[10],
+      //                     sizeof(htm_temperature_buffer),
+      //                     gattdb_temperature_type);
+      //
+      //              printf("%d", (sizeof(cb_buffer_load)/sizeof(uint8_t))); // For debugging purpose only
+                    cbfifo_enqueue(cb_buffer_load, (sizeof(cb_buffer_load)/sizeof(uint8_t)));
+
+                    LOG_INFO("Heart Rate indication added to buffer : %d indications left in the buffer", (cbfifo_length()/11));
+                }
 
 
 
-            // Writing attribute value to the GATT server
-            sc = sl_bt_gatt_server_write_attribute_value(gattdb_heart_rate_led,
-                                                         0,
-                                                         sizeof(ble_data_ptr->heart_rate_status_led_value),
-                                                         &(ble_data_ptr->heart_rate_status_led_value));
+                // Writing attribute value to the GATT server
+                sc = sl_bt_gatt_server_write_attribute_value(gattdb_heart_rate_led,
+                                                             0,
+                                                             sizeof(ble_data_ptr->heart_rate_status_led_value),
+                                                             &(ble_data_ptr->heart_rate_status_led_value));
 
-            // Printing the error message if the Server Write Failed fails
-            if (sc != 0)
-              LOG_ERROR("!!! Server Write Failed !!!\nError Code: 0x%x",sc);
+                // Printing the error message if the Server Write Failed fails
+                if (sc != 0)
+                  LOG_ERROR("!!! Server Write Failed !!!\nError Code: 0x%x",sc);
 
+                displayPrintf(DISPLAY_ROW_8, "PI: %d.%02d %%", (int)(ble_data_ptr->perfusion_index/100), (int)(ble_data_ptr->perfusion_index%100));
 
-            if (ble_data_ptr->flag_conection == true &&
-                ble_data_ptr->flag_indication_hr_led == true &&
-                ble_data_ptr->flag_bonded == true &&
-                ble_data_ptr->flag_indication_in_progress == true &&
-                cbfifo_length() == cbfifo_capacity())
-             {
-               LOG_ERROR("Buffer Full!! This indication will not be stored and will be lost.");
-             }
-            // If indications are in flight then we will execute the below
-            else if ((ble_data_ptr->flag_indication_hr_led == true) &&
-                (ble_data_ptr->flag_conection == true) &&
-                (ble_data_ptr->flag_indication_in_progress == false) &&
-                cbfifo_length() != cbfifo_capacity())
-            {
-                // Sending indication
-                sc = sl_bt_gatt_server_send_indication(ble_data_ptr->connectionHandle,
-                                                       gattdb_heart_rate_led,
-                                                       sizeof(ble_data_ptr->heart_rate_status_led_value),
-                                                       &(ble_data_ptr->heart_rate_status_led_value));
-  //              LOG_INFO("Indication Sent");
-                ble_data_ptr->flag_indication_in_progress = true;
-
-                // Printing the error message if the Sending Indication fails
+                // Die temperature on the Health Thermometer service, IEEE-11073 FLOAT in 0.01 C
+                uint8_t htm_temperature_buffer[5];
+                uint8_t *htm_p = htm_temperature_buffer;
+
+                UINT8_TO_BITSTREAM(htm_p, 0x00); // Flags: Celsius, no time stamp, no type
+                UINT32_TO_BITSTREAM(htm_p, UINT32_TO_FLOAT(ble_data_ptr->die_temperature, -2));
+
+                // Writing attribute value to the GATT server
+                sc = sl_bt_gatt_server_write_attribute_value(gattdb_temperature_measurement,
+                                                             0,
+                                                             sizeof(htm_temperature_buffer),
+                                                             htm_temperature_buffer);
+
+                // Printing the error message if the Server Write Failed fails
                 if (sc != 0)
-                  LOG_ERROR("!!! Sending Indication Failed !!!\nError Code: 0x%x",sc);
+                  LOG_ERROR("!!! Server Write Failed !!!\nError Code: 0x%x",sc);
 
-                displayPrintf(DISPLAY_ROW_TEMPVALUE, "%d bpm", (int)heart_rate);
-            }
-            else if ((ble_data_ptr->flag_indication_hr_led == true) &&
-                     (ble_data_ptr->flag_conection == true) &&
-                     (ble_data_ptr->flag_indication_in_progress == true))
-            {
-  //              printf("%x\n%x\n%x\n",gattdb_temperature_type, sizeof(htm_temperature_buffer), htm_temperature_buffer[1]);
-                cb_buffer_load[0] = (uint8_t) ((gattdb_heart_rate_led >> 8) & 0x00FF);
-                cb_buffer_load[1] = (uint8_t) ((gattdb_heart_rate_led >> 0) & 0x00FF);
-                cb_buffer_load[2] = (uint8_t) ((sizeof(ble_data_ptr->heart_rate_status_led_value) >> 24) & 0x000000FF);
-                cb_buffer_load[3] = (uint8_t) ((sizeof(ble_data_ptr->heart_rate_status_led_value) >> 16) & 0x000000FF);
-                cb_buffer_load[4] = (uint8_t) ((sizeof(ble_data_ptr->heart_rate_status_led_value) >> 8) & 0x000000FF);
-                cb_buffer_load[5] = (uint8_t) ((sizeof(ble_data_ptr->heart_rate_status_led_value) >> 0) & 0x000000FF);
-                cb_buffer_load[6] = ble_data_ptr->heart_rate_status_led_value;
-                cb_buffer_load[7] = 0;
-                cb_buffer_load[8] = 0;
-                cb_buffer_load[9] = 0;
-                cb_buffer_load[10] = 0;
-
-  //              // For debugging purpose only
-  //              printf("\nOriginal\n%d\t%d\t%d\t%d\t%d\n%d\n%d\n\n", cb_buffer_load[6],
-  //                     cb_buffer_load[7],
-  //                     cb_buffer_load[8],
-  //                     cb_buffer_load[9],
-  //                     cb_buffer_load[10],
-  //                     sizeof(htm_temperature_buffer),
-  //                     gattdb_temperature_type);
-  //
-  //              printf("%d", (sizeof(cb_buffer_load)/sizeof(uint8_t))); // For debugging purpose only
-                cbfifo_enqueue(cb_buffer_load, (sizeof(cb_buffer_load)/sizeof(uint8_t)));
-
-                LOG_INFO("LED indication added to buffer : %d indications left in the buffer", (cbfifo_length()/11));
+                if ((ble_data_ptr->flag_indication_temp == true) &&
+                    (ble_data_ptr->flag_conection == true) &&
+                    (ble_data_ptr->flag_indication_in_progress == false))
+                {
+                    // Sending indication
+                    sc = sl_bt_gatt_server_send_indication(ble_data_ptr->connectionHandle,
+                                                           gattdb_temperature_measurement,
+                                                           sizeof(htm_temperature_buffer),
+                                                           htm_temperature_buffer);
+                    ble_data_ptr->flag_indication_in_progress = true;
+
+                    // Printing the error message if the Sending Indication fails
+                    if (sc != 0)
+                      LOG_ERROR("!!! Sending Indication Failed !!!\nError Code: 0x%x",sc);
+                }
+                else if ((ble_data_ptr->flag_indication_temp == true) &&
+                         (ble_data_ptr->flag_conection == true) &&
+                         (cbfifo_length() != cbfifo_capacity()))
+                {
+                    cb_buffer_load[0] = (uint8_t) ((gattdb_temperature_measurement >> 8) & 0x00FF);
+                    cb_buffer_load[1] = (uint8_t) ((gattdb_temperature_measurement >> 0) & 0x00FF);
+                    cb_buffer_load[2] = (uint8_t) ((sizeof(htm_temperature_buffer) >> 24) & 0x000000FF);
+                    cb_buffer_load[3] = (uint8_t) ((sizeof(htm_temperature_buffer) >> 16) & 0x000000FF);
+                    cb_buffer_load[4] = (uint8_t) ((sizeof(htm_temperature_buffer) >> 8) & 0x000000FF);
+                    cb_buffer_load[5] = (uint8_t) ((sizeof(htm_temperature_buffer) >> 0) & 0x000000FF);
+                    cb_buffer_load[6] = htm_temperature_buffer[0];
+                    cb_buffer_load[7] = htm_temperature_buffer[1];
+                    cb_buffer_load[8] = htm_temperature_buffer[2];
+                    cb_buffer_load[9] = htm_temperature_buffer[3];
+                    cb_buffer_load[10] = htm_temperature_buffer[4];
+
+                    cbfifo_enqueue(cb_buffer_load, (sizeof(cb_buffer_load)/sizeof(uint8_t)));
+
+                    LOG_INFO("Die temperature indication added to buffer : %d indications left in the buffer", (cbfifo_length()/11));
+                }
+
+                uint8_t perfusion_buffer[10];
+                uint8_t *pi_p = perfusion_buffer;
+
+                UINT8_TO_BITSTREAM(pi_p, (ble_data_ptr->perfusion_index & 0xFF));
+                UINT8_TO_BITSTREAM(pi_p, (ble_data_ptr->perfusion_index >> 8));
+                UINT32_TO_BITSTREAM(pi_p, ble_data_ptr->dc_level);
+                UINT32_TO_BITSTREAM(pi_p, ble_data_ptr->ac_peak_to_peak);
+
+                // Writing attribute value to the GATT server
+                sc = sl_bt_gatt_server_write_attribute_value(gattdb_perfusion_index,
+                                                             0,
+                                                             sizeof(perfusion_buffer),
+                                                             perfusion_buffer);
+
+                // Printing the error message if the Server Write Failed fails
+                if (sc != 0)
+                  LOG_ERROR("!!! Server Write Failed !!!\nError Code: 0x%x",sc);
+
+                diagPublish();
+
+
+                if (ble_data_ptr->flag_conection == true &&
+                    ble_data_ptr->flag_indication_hr_led == true &&
+                    ble_data_ptr->flag_bonded == true &&
+                    ble_data_ptr->flag_indication_in_progress == true &&
+                    cbfifo_length() == cbfifo_capacity())
+                 {
+                   LOG_ERROR("Buffer Full!! This indication will not be stored and will be lost.");
+                 }
+                // If indications are in flight then we will execute the below
+                else if ((ble_data_ptr->flag_indication_hr_led == true) &&
+                    (ble_data_ptr->flag_conection == true) &&
+                    (ble_data_ptr->flag_indication_in_progress == false) &&
+                    cbfifo_length() != cbfifo_capacity())
+                {
+                    // Sending indication
+                    sc = sl_bt_gatt_server_send_indication(ble_data_ptr->connectionHandle,
+                                                           gattdb_heart_rate_led,
+                                                           sizeof(ble_data_ptr->heart_rate_status_led_value),
+                                                           &(ble_data_ptr->heart_rate_status_led_value));
+      //              LOG_INFO("Indication Sent");
+                    ble_data_ptr->flag_indication_in_progress = true;
+
+                    // Printing the error message if the Sending Indication fails
+                    if (sc != 0)
+                      LOG_ERROR("!!! Sending Indication Failed !!!\nError Code: 0x%x",sc);
+
+                    displayPrintf(DISPLAY_ROW_TEMPVALUE, "%d bpm", (int)heart_rate);
+                }
+                else if ((ble_data_ptr->flag_indication_hr_led == true) &&
+                         (ble_data_ptr->flag_conection == true) &&
+                         (ble_data_ptr->flag_indication_in_progress == true))
+                {
+      //              printf("%x\n%x\n%x\n",gattdb_temperature_type, sizeof(htm_temperature_buffer), htm_temperature_buffer[1]);
+                    cb_buffer_load[0] = (uint8_t) ((gattdb_heart_rate_led >> 8) & 0x00FF);
+                    cb_buffer_load[1] = (uint8_t) ((gattdb_heart_rate_led >> 0) & 0x00FF);
+                    cb_buffer_load[2] = (uint8_t) ((sizeof(ble_data_ptr->heart_rate_status_led_value) >> 24) & 0x000000FF);
+                    cb_buffer_load[3] = (uint8_t) ((sizeof(ble_data_ptr->heart_rate_status_led_value) >> 16) & 0x000000FF);
+                    cb_buffer_load[4] = (uint8_t) ((sizeof(ble_data_ptr->heart_rate_status_led_value) >> 8) & 0x000000FF);
+                    cb_buffer_load[5] = (uint8_t) ((sizeof(ble_data_ptr->heart_rate_status_led_value) >> 0) & 0x000000FF);
+                    cb_buffer_load[6] = ble_data_ptr->heart_rate_status_led_value;
+                    cb_buffer_load[7] = 0;
+                    cb_buffer_load[8] = 0;
+                    cb_buffer_load[9] = 0;
+                    cb_buffer_load[10] = 0;
+
+      //              // For debugging purpose only
+      //              printf("\nOriginal\n%d\t%d\t%d\t%d\t%d\n%d\n%d\n\n", cb_buffer_load[6],
+      //                     cb_buffer_load[7],
+      //                     cb_buffer_load[8],
+      //                     cb_buffer_load[9],
+      //                     cb_buffer_load[10],
+      //                     sizeof(htm_temperature_buffer),
+      //                     gattdb_temperature_type);
+      //
+      //              printf("%d", (sizeof(cb_buffer_load)/sizeof(uint8_t))); // For debugging purpose only
+                    cbfifo_enqueue(cb_buffer_load, (sizeof(cb_buffer_load)/sizeof(uint8_t)));
+
+                    LOG_INFO("LED indication added to buffer : %d indications left in the buffer", (cbfifo_length()/11));
+                }
             }
 
 
 
+            if (marked_samples != 0)
+              LOG_INFO("%d samples of the window scaled after an LED current step", (int)marked_samples);
+
             memset(hr_buffer, 0, (MASTER_BUFFER*sizeof(uint32_t)));
+            memset(hr_marks, 0, sizeof(hr_marks));
+            marked_samples = 0;
 
             MAX_30101_ShutDown();
 
@@ -359,15 +951,54 @@ void state_machine_hr (sl_bt_msg_t *evt)
             nextState = state_Init_hr;
           }
       }
-      if (event == event_SystemError_hr)
+      if (event & event_SystemError_hr)
       {
+          MAX_30101_Async_Abort();
+
+          gpioMAX30101IntDisable();
+
           nextState = state_Idle_hr;
       }
     break;
   }
+
+#if SENSOR_CAPTURE
+  Sensor_Capture_Flush(&capture, captureOut, NULL);
+#endif
 } // state_machine()
 
 
+/**************************************************************************//**
+ * This function hands the external signals of a stack event to the heart
+ * rate state machine. Signals raised before the application got to them are
+ * merged by the stack, every one is handled in the state the one before it
+ * left, lowest bit first.
+ *
+ * @param:
+ *      evt is the pointer that points to the union that holds all the events
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void state_machine_hr (sl_bt_msg_t *evt)
+{
+  uint32_t signals;
+
+  // evt->data.evt_system_external_signal.extsignals is only valid for
+  // sl_bt_evt_system_external_signal_id
+  if (SL_BT_MSG_ID(evt->header) != sl_bt_evt_system_external_signal_id)
+    return;
+
+  signals = evt->data.evt_system_external_signal.extsignals;
+
+  for (uint32_t bit = 0; bit < num_Events_hr; bit++)
+  {
+      if (signals & (1u << bit))
+        state_machine_hr_event(1u << bit);
+  }
+}
+
+
 /**************************************************************************//**
  * This is a state machine that is designed for discovering the services and
  * characteristics when a connection between two BLE devices are established.
@@ -384,6 +1015,8 @@ void state_machine_discovery (sl_bt_msg_t *evt)
   // Changed for Assignment 5
   // Since the evt is a pointer, we will drill into the data structure to get the event code
   int32_t event = SL_BT_MSG_ID(evt->header), sc=0;
+  bool system_error = (event == sl_bt_evt_system_external_signal_id) &&
+                      (evt->data.evt_system_external_signal.extsignals & event_SystemError_hr);
 
   ble_data_struct_t *ble_data_ptr = getBleDataPtr();
 
@@ -414,7 +1047,7 @@ void state_machine_discovery (sl_bt_msg_t *evt)
 
           nextState = state_Service_hr_disc;
       }
-      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || event == event_SystemError_hr)
+      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || system_error)
       {
 //          sl_bt_system_reset(sl_bt_system_boot_mode_normal);
           nextState = state_Idle_disc;
@@ -443,7 +1076,7 @@ void state_machine_discovery (sl_bt_msg_t *evt)
 
           nextState = state_Characteristic_hr_disc;
       }
-      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || event == event_SystemError_hr)
+      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || system_error)
       {
 //          sl_bt_system_reset(sl_bt_system_boot_mode_normal);
           nextState = state_Idle_disc;
@@ -472,7 +1105,7 @@ void state_machine_discovery (sl_bt_msg_t *evt)
 
           nextState = state_Service_hr_led_disc;
       }
-      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || event == event_SystemError_hr)
+      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || system_error)
       {
 //          sl_bt_system_reset(sl_bt_system_boot_mode_normal);
           nextState = state_Idle_disc;
@@ -509,7 +1142,7 @@ void state_machine_discovery (sl_bt_msg_t *evt)
 
           nextState = state_Characteristic_hr_led_disc;
       }
-      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || event == event_SystemError_hr)
+      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || system_error)
       {
 //          sl_bt_system_reset(sl_bt_system_boot_mode_normal);
           nextState = state_Idle_disc;
@@ -545,7 +1178,7 @@ void state_machine_discovery (sl_bt_msg_t *evt)
 
           nextState = state_Indication_hr_disc;
       }
-      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || event == event_SystemError_hr)
+      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || system_error)
       {
 //          sl_bt_system_reset(sl_bt_system_boot_mode_normal);
           nextState = state_Idle_disc;
@@ -587,7 +1220,7 @@ void state_machine_discovery (sl_bt_msg_t *evt)
 
           nextState = state_Indication_wait_disc;
       }
-      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || event == event_SystemError_hr)
+      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || system_error)
       {
 //          sl_bt_system_reset(sl_bt_system_boot_mode_normal);
           nextState = state_Idle_disc;
@@ -614,7 +1247,7 @@ void state_machine_discovery (sl_bt_msg_t *evt)
 
           nextState = state_Idle_disc;
       }
-      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || event == event_SystemError_hr)
+      if (event == event_Error_disc || event == sl_bt_evt_connection_closed_id || system_error)
       {
 //          sl_bt_system_reset(sl_bt_system_boot_mode_normal);
           nextState = state_Idle_disc;
@@ -639,21 +1272,19 @@ void state_machine_discovery (sl_bt_msg_t *evt)
  *****************************************************************************/
 uint32_t nextEvent () {
   uint32_t i=0;
-  for (i=0; i<=num_Events_hr ;i++)
+  for (i=0; i<num_Events_hr ;i++)
   {
-      if (eventHandler & (1<<(i-1)))
+      if (eventHandler & (1<<i))
       {
           CORE_DECLARE_IRQ_STATE;
 
           CORE_ENTER_CRITICAL();
 
-          eventHandler = (eventHandler & (~(1<<(i-1))));
-
-          eventHandler=0;
+          eventHandler = (eventHandler & (~(1<<i)));
 
           CORE_EXIT_CRITICAL();
 //          int32_t returning = i; // For the purpose of debugging
-          return i;
+          return (1<<i);
       }
   }
 //  int32_t returning=0; // For the purpose of debugging
@@ -806,16 +1437,9 @@ void createEventMAX30101Int()
 
     CORE_ENTER_CRITICAL();
 
-    uint8_t int_reg_0;
-
-    sl_power_manager_add_em_requirement(SL_POWER_MANAGER_EM1);
-    i2c_Write_Read_blocking(0x00, &int_reg_0, sizeof(int_reg_0));
-    sl_power_manager_remove_em_requirement(SL_POWER_MANAGER_EM1);
-
-    if (int_reg_0 &  0x80)
-    {
-      sl_bt_external_signal(event_bufferFullMAX30101_hr);
-    }
+    // The interrupt status is read by the state machine on the interrupt
+    // driven I2C path, no bus traffic is done from the ISR
+    sl_bt_external_signal(event_bufferFullMAX30101_hr);
 
     CORE_EXIT_CRITICAL();
 }
@@ -843,187 +1467,3 @@ void createEventSystemError()
 
     CORE_EXIT_CRITICAL();
 }
-
-
-/**************************************************************************//**
- * Enqueues data onto the FIFO, up to the limit of the available FIFO
- * capacity.
- *
- * This is to say that there is an error that has  during the temperature
- * state machine. This will be encountered by reseting the device.
- *
- * @param:
- *   buf      Pointer to the data
- *   nbyte    Max number of bytes to enqueue
- *
- * @return:
- *   The number of bytes actually enqueued, which could be 0. In case
- *   of an error, returns -1.
- *****************************************************************************/
-size_t cbfifo_enqueue(void *buf, size_t nbyte)
-{
-    /* checks for the capacity of the array buffer */
-    uint16_t available_capacity = ARRAY_CAPACITY - (cbfifo_length());
-    size_t count = 0;
-    if(buf == NULL)
-    {
-        return -1;
-    }
-
-    if(available_capacity > ZERO)
-    {
-        if(nbyte <= available_capacity)
-        {
-           while(nbyte--)
-            {
-                /*write pointer writes to the memory location and increments */
-                *write++ = *(uint8_t*)buf++;
-                count++;
-                if(write == (cbfifo_array + ARRAY_CAPACITY))
-                {
-                    write = cbfifo_array;
-                }
-
-            }
-        }
-        else
-        {
-           /*if enough space is not available, only enqueue as much as possible */
-            while(available_capacity--)
-            {
-
-                *write++ = *(uint8_t*)buf++;
-                count++;
-                if(write == (cbfifo_array + ARRAY_CAPACITY))
-                {
-                    write = cbfifo_array;
-                }
-
-            }
-        }
-        /* write pointer has gone around and filled all the array spaces,
-        set the capacity full flag */
-        if(write == read)
-        {
-            capacity_full = ONE;
-        }
-    }
-    else
-    {
-        count = 0;
-    }
-    return count;
-}
-
-
-/**************************************************************************//**
- * Attempts to remove ("dequeue") up to nbyte bytes of data from the
- * FIFO. Removed data will be copied into the buffer pointed to by buf.
- *
- * To further explain the behavior: If the FIFO's current length is 24
- * bytes, and the caller requests 30 bytes, cbfifo_dequeue should
- * return the 24 bytes it has, and the new FIFO length will be 0. If
- * the FIFO is empty (current length is 0 bytes), a request to dequeue
- * any number of bytes will result in a return of 0 from
- * cbfifo_dequeue.
- *
- * @param:
- *   buf      Destination for the dequeued data
- *   nbyte    Bytes of data requested
- *
- * @return:
- *   The number of bytes actually copied, which will be between 0 and
- *   nbyte.
- *****************************************************************************/
-size_t cbfifo_dequeue(void *buf, size_t nbyte)
-{
-    uint16_t available_dequeue = cbfifo_length();
-    uint16_t count = 0;
-    if(buf == NULL)
-    {
-        return -1;
-    }
-    if(available_dequeue > ZERO)
-    {
-        /* if bytes are available to dequeue, check the nbyte requirement */
-        if(nbyte <= available_dequeue )
-        {
-            while(nbyte--)
-            {
-                /*read from pointer into the buffer and increment, go around if 128th loc is reached */
-                *(uint8_t*)buf++ = *read;
-                *read++ = 0;
-                count++;
-                if(read == (cbfifo_array + ARRAY_CAPACITY))
-                {
-                    read = cbfifo_array;
-                }
-            }
-      }
-      else
-      {
-        while(available_dequeue--)
-        {
-           *(uint8_t*)buf++ = *read;
-            *read++ = 0;
-            count++;
-            if(read == (cbfifo_array + ARRAY_CAPACITY))
-            {
-                read = cbfifo_array;
-            }
-        }
-      }
-        capacity_full = ZERO;
-    }
-    else
-    {
-        count = 0;
-    }
-    return count;
-}
-
-
-/**************************************************************************//**
- *
- * Returns the number of bytes currently on the FIFO.
- *
- * @param:
- *      no params
- *
- * @return:
- *      Number of bytes currently available to be dequeued from the FIFO
- *****************************************************************************/
-size_t cbfifo_length()
-{
-    uint16_t ret;
-    if((capacity_full) == 1)
-    {
-        return ARRAY_CAPACITY;
-    }
-    if(write < read)
-    {
-        /*since write address value is less than read, read has to go around till 128 to get length  */
-        ret = ((cbfifo_array + ARRAY_CAPACITY) - read) + (write - cbfifo_array);
-    }
-    else
-    {
-       ret = write - read;
-    }
-    return ret;
-}
-
-
-/**************************************************************************//**
- *
- * Returns the FIFO's capacity
- *
- * @param:
- *      no params
- *
- * @return:
- *      The capacity, in bytes, for the FIFO
- *****************************************************************************/
-size_t cbfifo_capacity()
-{
-    return sizeof(cbfifo_array);
-}
@@ -16,6 +16,8 @@
 #include <stdint.h>
 #include "ble.h"
 #include "lcd.h"
+#include "cbfifo.h"
+#include "sensor_bus.h"
 
 void createEventI2CTransfer();
 void createEventTimerWaitUs_IRQ();                    // Function for creating an event to say that the timer is up
@@ -29,22 +31,8 @@ void createEventPB0Pressed();                         // Creating an event to ha
 void createEventPB1Pressed();                         // Creating an event to handle the Push Button 1 event
 void createEventSystemError();
 void createEventMAX30101Int();
-
-
-// Definitions for CB FIFO
-size_t cbfifo_enqueue(void *buf, size_t nbyte);       // Enqueue nbytes from the buf array
-size_t cbfifo_dequeue(void *buf, size_t nbyte);       // Dequeue nbytes from the buf array
-size_t cbfifo_length();                               // Length of the buffer that has data in it
-size_t cbfifo_capacity();                             // Capacity of the buffer
-
-
-/*capacity of the static buffer is 176 bytes
- * 2 bytes for the characteristic +
- * 4 bytes for the number of bytes to transfer +
- * 5 bytes for the buffer (5 bytes for temperature and 1 byte for button state)*/
-#define ARRAY_CAPACITY 176
-#define ZERO 0
-#define ONE 1
+void captureInit(sensor_bus_t *bus);                 // Streams the sensor traffic when SENSOR_CAPTURE is on
+void diagInit(sensor_bus_t *bus);                    // Publishes the bus diagnostics with every heart rate result
 
 
 //extern enum eventList;
@@ -65,23 +53,30 @@ size_t cbfifo_capacity();                             // Capacity of the buffer
 //};
 
 
+// One bit per event, the stack ORs the external signals raised before the
+// application takes them. Lower bits are handled first, so a finished
+// transfer comes before a new FIFO interrupt.
 enum eventList_hr {
   event_NoEvent_hr = 0,                   // No Event
-  event_timerWaitUS_IRQ_hr,
-  event_measureMAX30101_hr,
-  event_bufferFullMAX30101_hr,
-  event_I2CTransfer_IRQ_hr,
-  event_PB0Pressed_hr,                 // Push Button 0 is pressed
-  event_PB1Pressed_hr,                 // Push Button 1 is pressed
-  event_SystemError_hr,
-  num_Events_hr
+  event_timerWaitUS_IRQ_hr = (1 << 0),
+  event_I2CTransfer_IRQ_hr = (1 << 1),
+  event_measureMAX30101_hr = (1 << 2),
+  event_bufferFullMAX30101_hr = (1 << 3),
+  event_PB0Pressed_hr = (1 << 4),      // Push Button 0 is pressed
+  event_PB1Pressed_hr = (1 << 5),      // Push Button 1 is pressed
+  event_SystemError_hr = (1 << 6),
+  event_I2CRetry_hr = (1 << 7),           // Failed I2C transaction to retry, taken by i2c_Queue_Signal() (i2c.c)
 //  event_LEDON=2
 };
 
+#define num_Events_hr (7)                 // Number of event bits of the heart rate state machine
+
 typedef enum
 {
       state_Idle_hr,                      // Idle State
-      state_Init_hr
+      state_Init_hr,
+      state_Read_Pointers_hr,             // Waiting for the FIFO pointers (interrupt driven I2C)
+      state_Read_FIFO_hr                  // Waiting for the FIFO burst (interrupt driven I2C)
 } State_t_hr;
 
 
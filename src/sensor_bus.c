@@ -0,0 +1,557 @@
+/*
+ * sensor_bus.c
+ *
+ *  Register access to the sensors through a backend: the I2C peripheral on
+ *  target (i2c.c), the sensor model (MAX_30101_sim.c) or a recorded trace
+ *  (below). Every backend gets the same transaction statistics.
+ *
+ *  Nothing here depends on the SDK, the file builds on a host as is.
+ *
+ */
+
+#include <string.h>
+
+#include "sensor_bus.h"
+
+
+/**************************************************************************//**
+ * This function returns the time of the backend for the statistics
+ *
+ * @param:
+ *      bus: The bus
+ *
+ * @return:
+ *      Time in us, 0 when the backend has no time base
+ *****************************************************************************/
+static uint64_t Sensor_Bus_Now (const sensor_bus_t *bus)
+{
+  return bus->ops->now_us ? bus->ops->now_us(bus->ctx) : 0;
+}
+
+
+/**************************************************************************//**
+ * This function adds a transaction to a set of counters
+ *
+ * @param:
+ *      stats:       The counters
+ *      nbytes:      Payload bytes
+ *      status:      Outcome
+ *      duration_us: Time on the bus
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void Sensor_Bus_Count (sensor_bus_stats_t *stats, size_t nbytes, sensor_bus_status_t status, uint64_t duration_us)
+{
+  stats->transactions++;
+  stats->busy_us += duration_us;
+
+  if (status == SENSOR_BUS_OK)
+    stats->bytes += nbytes;
+  else if (status == SENSOR_BUS_NACK)
+    stats->nacks++;
+  else
+    stats->errors++;
+}
+
+
+/**************************************************************************//**
+ * This function returns the counters of a device, the first transaction to
+ * a new address takes a free entry
+ *
+ * @param:
+ *      diag: The diagnostics
+ *      addr: 7 bit address
+ *
+ * @return:
+ *      The counters, NULL when all SENSOR_BUS_DEVICES entries are taken
+ *****************************************************************************/
+static sensor_bus_stats_t* Sensor_Bus_Dev_Stats (sensor_bus_diag_t *diag, uint8_t addr)
+{
+  for (uint8_t i = 0; i < diag->ndevices; i++)
+    if (diag->devices[i].addr == addr)
+      return &diag->devices[i].stats;
+
+  if (diag->ndevices == SENSOR_BUS_DEVICES)
+    return NULL;
+
+  diag->devices[diag->ndevices].addr = addr;
+
+  return &diag->devices[diag->ndevices++].stats;
+}
+
+
+/**************************************************************************//**
+ * This function adds a finished transaction to the statistics and the
+ * diagnostics
+ *
+ * @param:
+ *      bus:      The bus
+ *      addr:     7 bit address
+ *      write:    true for a write
+ *      reg:      The register
+ *      nbytes:   Payload bytes
+ *      status:   Outcome
+ *      start_us: Time the transaction started
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void Sensor_Bus_Account (sensor_bus_t *bus, uint8_t addr, bool write, uint8_t reg, size_t nbytes,
+                                sensor_bus_status_t status, uint64_t start_us)
+{
+  sensor_bus_diag_t *diag = &bus->diag;
+  sensor_bus_stats_t *dev_stats = Sensor_Bus_Dev_Stats(diag, addr);
+  sensor_bus_trace_t *trace = &diag->trace[diag->traced % SENSOR_BUS_TRACE_LEN];
+  uint64_t now_us = Sensor_Bus_Now(bus);
+  uint64_t duration_us = (now_us > start_us) ? now_us - start_us : 0;  // A time base that wrapped counts nothing
+  uint32_t bucket = 0;
+
+  Sensor_Bus_Count(&bus->stats, nbytes, status, duration_us);
+
+  if (dev_stats)
+    Sensor_Bus_Count(dev_stats, nbytes, status, duration_us);
+
+  while ((bucket < SENSOR_BUS_HIST_BUCKETS - 1) && (duration_us >= ((uint64_t)SENSOR_BUS_HIST_BASE_US << bucket)))
+    bucket++;
+  diag->hist[bucket]++;
+
+  trace->start_us = (uint32_t)start_us;
+  trace->duration_us = (duration_us > UINT32_MAX) ? UINT32_MAX : (uint32_t)duration_us;
+  trace->len = (nbytes > UINT16_MAX) ? UINT16_MAX : nbytes;
+  trace->addr = addr;
+  trace->reg = reg;
+  trace->write = write;
+  trace->status = status;
+  diag->traced++;
+}
+
+
+/**************************************************************************//**
+ * This function does a blocking register transfer
+ *
+ * @param:
+ *      dev:   The device
+ *      write: true to write, false to read
+ *      reg:   The register to start at
+ *      data:  Data to write or buffer for the data read
+ *      len:   Number of bytes
+ *
+ * @return:
+ *      SENSOR_BUS_OK or the error
+ *****************************************************************************/
+static sensor_bus_status_t Sensor_Bus_Transfer (const sensor_dev_t *dev, bool write, uint8_t reg, uint8_t *data, size_t len)
+{
+  sensor_bus_t *bus = dev->bus;
+  uint64_t start_us = Sensor_Bus_Now(bus);
+  sensor_bus_status_t status = bus->ops->transfer(bus->ctx, dev->addr, write, reg, data, len);
+
+  Sensor_Bus_Account(bus, dev->addr, write, reg, len, status, start_us);
+
+  if (bus->tap)
+    bus->tap(bus->tap_ctx, dev->addr, write, reg, data, len, status);
+
+  return status;
+}
+
+
+/**************************************************************************//**
+ * This function reads consecutive registers and waits for the transfer
+ *
+ * @param:
+ *      dev:              The device
+ *      reg:              The register to start reading from
+ *      read_data:        Buffer for the data
+ *      nbytes_read_data: Number of bytes to read
+ *
+ * @return:
+ *      SENSOR_BUS_OK or the error
+ *****************************************************************************/
+sensor_bus_status_t Sensor_Bus_Read (const sensor_dev_t *dev, uint8_t reg, uint8_t *read_data, size_t nbytes_read_data)
+{
+  return Sensor_Bus_Transfer(dev, false, reg, read_data, nbytes_read_data);
+}
+
+
+/**************************************************************************//**
+ * This function writes consecutive registers and waits for the transfer
+ *
+ * @param:
+ *      dev:               The device
+ *      reg:               The register to start writing to
+ *      write_data:        Data to write
+ *      nbytes_write_data: Number of bytes to write
+ *
+ * @return:
+ *      SENSOR_BUS_OK or the error
+ *****************************************************************************/
+sensor_bus_status_t Sensor_Bus_Write (const sensor_dev_t *dev, uint8_t reg, const uint8_t *write_data, size_t nbytes_write_data)
+{
+  return Sensor_Bus_Transfer(dev, true, reg, (uint8_t *)write_data, nbytes_write_data);
+}
+
+
+/**************************************************************************//**
+ * This function starts an interrupt driven register transfer. Backends
+ * without interrupts (model, replay) complete it before returning, the
+ * callback then runs from inside this call.
+ *
+ * @param:
+ *      dev:      The device
+ *      write:    true to write, false to read
+ *      reg:      The register to start at
+ *      data:     Data to write or buffer for the data read, valid until
+ *                completion
+ *      len:      Number of bytes
+ *      callback: Called on completion
+ *
+ * @return:
+ *      SENSOR_BUS_IN_PROGRESS when the callback will be (or was) called,
+ *      the error otherwise
+ *****************************************************************************/
+static sensor_bus_status_t Sensor_Bus_Start (const sensor_dev_t *dev, bool write, uint8_t reg, uint8_t *data, size_t len,
+                                             sensor_bus_callback_t callback)
+{
+  sensor_bus_t *bus = dev->bus;
+  sensor_bus_status_t status;
+
+  if (bus->busy)
+    return SENSOR_BUS_ERROR;
+
+  bus->busy = true;
+  bus->callback = callback;
+  bus->start_us = Sensor_Bus_Now(bus);
+  bus->addr = dev->addr;
+  bus->write = write;
+  bus->reg = reg;
+  bus->data = data;
+  bus->len = len;
+
+  status = bus->ops->start(bus->ctx, dev->addr, write, reg, data, len);
+
+  if (status == SENSOR_BUS_OK)
+  {
+      Sensor_Bus_Complete(bus, SENSOR_BUS_OK);
+      status = SENSOR_BUS_IN_PROGRESS;
+  }
+  else if (status != SENSOR_BUS_IN_PROGRESS)
+  {
+      bus->busy = false;
+      bus->callback = NULL;
+      Sensor_Bus_Account(bus, dev->addr, write, reg, 0, status, bus->start_us);
+
+      if (bus->tap)
+        bus->tap(bus->tap_ctx, dev->addr, write, reg, data, len, status);
+  }
+
+  return status;
+}
+
+
+/**************************************************************************//**
+ * This function starts an interrupt driven register read
+ *
+ * @param:
+ *      dev:              The device
+ *      reg:              The register to start reading from
+ *      read_data:        Buffer for the data, valid until completion
+ *      nbytes_read_data: Number of bytes to read
+ *      callback:         Called on completion
+ *
+ * @return:
+ *      SENSOR_BUS_IN_PROGRESS or the error
+ *****************************************************************************/
+sensor_bus_status_t Sensor_Bus_Start_Read (const sensor_dev_t *dev, uint8_t reg, uint8_t *read_data, size_t nbytes_read_data,
+                                           sensor_bus_callback_t callback)
+{
+  return Sensor_Bus_Start(dev, false, reg, read_data, nbytes_read_data, callback);
+}
+
+
+/**************************************************************************//**
+ * This function starts an interrupt driven register write
+ *
+ * @param:
+ *      dev:               The device
+ *      reg:               The register to start writing to
+ *      write_data:        Data to write, valid until completion
+ *      nbytes_write_data: Number of bytes to write
+ *      callback:          Called on completion
+ *
+ * @return:
+ *      SENSOR_BUS_IN_PROGRESS or the error
+ *****************************************************************************/
+sensor_bus_status_t Sensor_Bus_Start_Write (const sensor_dev_t *dev, uint8_t reg, uint8_t *write_data, size_t nbytes_write_data,
+                                            sensor_bus_callback_t callback)
+{
+  return Sensor_Bus_Start(dev, true, reg, write_data, nbytes_write_data, callback);
+}
+
+
+/**************************************************************************//**
+ * This function finishes the interrupt driven transfer in flight. Called by
+ * the backend, from the I2C interrupt on target.
+ *
+ * @param:
+ *      bus:    The bus
+ *      status: Outcome of the transfer
+ *
+ * @return:
+ *      false if no transfer was started through the bus (the caller
+ *      handles the completion itself)
+ *****************************************************************************/
+bool Sensor_Bus_Complete (sensor_bus_t *bus, sensor_bus_status_t status)
+{
+  sensor_bus_callback_t callback = bus->callback;
+
+  if (!bus->busy)
+    return false;
+
+  Sensor_Bus_Account(bus, bus->addr, bus->write, bus->reg, bus->len, status, bus->start_us);
+
+  // Before the callback, which may start the next transfer
+  if (bus->tap)
+    bus->tap(bus->tap_ctx, bus->addr, bus->write, bus->reg, bus->data, bus->len, status);
+
+  bus->busy = false;
+  bus->callback = NULL;
+
+  if (callback)
+    callback(status);
+
+  return true;
+}
+
+
+/**************************************************************************//**
+ * This function drops the interrupt driven transfer in flight, its callback
+ * is not called
+ *
+ * @param:
+ *      bus: The bus
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Sensor_Bus_Abort (sensor_bus_t *bus)
+{
+  if (bus->ops->abort)
+    bus->ops->abort(bus->ctx);
+
+  bus->busy = false;
+  bus->callback = NULL;
+}
+
+
+/**************************************************************************//**
+ * This function clears the transaction statistics and the diagnostics
+ *
+ * @param:
+ *      bus: The bus
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Sensor_Bus_Reset_Stats (sensor_bus_t *bus)
+{
+  memset(&bus->stats, 0, sizeof(bus->stats));
+  memset(&bus->diag, 0, sizeof(bus->diag));
+}
+
+
+/**************************************************************************//**
+ * This function sets the tap that sees every finished transaction
+ *
+ * @param:
+ *      bus: The bus
+ *      tap: The tap, NULL to remove it
+ *      ctx: Passed to the tap
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Sensor_Bus_Set_Tap (sensor_bus_t *bus, sensor_bus_tap_t tap, void *ctx)
+{
+  bus->tap = tap;
+  bus->tap_ctx = ctx;
+}
+
+
+/**************************************************************************//**
+ * This function returns a transaction of the trace
+ *
+ * @param:
+ *      bus: The bus
+ *      age: 0 for the newest, up to SENSOR_BUS_TRACE_LEN - 1
+ *
+ * @return:
+ *      The transaction, NULL if there is none that old
+ *****************************************************************************/
+const sensor_bus_trace_t* Sensor_Bus_Trace (const sensor_bus_t *bus, uint32_t age)
+{
+  if ((age >= SENSOR_BUS_TRACE_LEN) || (age >= bus->diag.traced))
+    return NULL;
+
+  return &bus->diag.trace[(bus->diag.traced - 1 - age) % SENSOR_BUS_TRACE_LEN];
+}
+
+
+/**************************************************************************//**
+ * This function writes little endian values
+ *****************************************************************************/
+static uint8_t* Sensor_Bus_Put (uint8_t *p, uint32_t value, size_t nbytes)
+{
+  while (nbytes--)
+  {
+      *p++ = value;
+      value >>= 8;
+  }
+
+  return p;
+}
+
+
+/**************************************************************************//**
+ * This function packs the statistics and the diagnostics for a GATT
+ * characteristic, little endian:
+ *
+ *      version, devices, histogram buckets, traced transactions   4 x u8
+ *      bus transactions, bytes, NACKs, errors, busy ms             5 x u32
+ *      per device: address u8, transactions u32, bytes u32,
+ *                  NACKs u16, errors u16 (saturated)
+ *      histogram                                                   u32 each
+ *      per transaction, newest first: start us u32, duration us
+ *                  u16 (saturated), address u8, register u8,
+ *                  length u16, status u8 (bit 7 set for a write)
+ *
+ * @param:
+ *      bus:  The bus
+ *      buf:  Receives the data
+ *      size: Size of buf, SENSOR_BUS_PACK_MAX takes everything
+ *
+ * @return:
+ *      Number of bytes packed, 0 if size can't even take the counters
+ *****************************************************************************/
+size_t Sensor_Bus_Diag_Pack (const sensor_bus_t *bus, uint8_t *buf, size_t size)
+{
+  const sensor_bus_diag_t *diag = &bus->diag;
+  uint8_t *p = buf;
+  uint32_t ntrace = 0;
+  size_t fixed = 24 + 13*diag->ndevices + 4*SENSOR_BUS_HIST_BUCKETS;
+
+  if (size < fixed)
+    return 0;
+
+  while ((ntrace < SENSOR_BUS_PACK_TRACE) && Sensor_Bus_Trace(bus, ntrace) && (fixed + 11*(ntrace + 1) <= size))
+    ntrace++;
+
+  p = Sensor_Bus_Put(p, SENSOR_BUS_PACK_VERSION, 1);
+  p = Sensor_Bus_Put(p, diag->ndevices, 1);
+  p = Sensor_Bus_Put(p, SENSOR_BUS_HIST_BUCKETS, 1);
+  p = Sensor_Bus_Put(p, ntrace, 1);
+
+  p = Sensor_Bus_Put(p, bus->stats.transactions, 4);
+  p = Sensor_Bus_Put(p, bus->stats.bytes, 4);
+  p = Sensor_Bus_Put(p, bus->stats.nacks, 4);
+  p = Sensor_Bus_Put(p, bus->stats.errors, 4);
+  p = Sensor_Bus_Put(p, (uint32_t)(bus->stats.busy_us/1000), 4);
+
+  for (uint8_t i = 0; i < diag->ndevices; i++)
+  {
+      const sensor_bus_stats_t *stats = &diag->devices[i].stats;
+
+      p = Sensor_Bus_Put(p, diag->devices[i].addr, 1);
+      p = Sensor_Bus_Put(p, stats->transactions, 4);
+      p = Sensor_Bus_Put(p, stats->bytes, 4);
+      p = Sensor_Bus_Put(p, (stats->nacks > UINT16_MAX) ? UINT16_MAX : stats->nacks, 2);
+      p = Sensor_Bus_Put(p, (stats->errors > UINT16_MAX) ? UINT16_MAX : stats->errors, 2);
+  }
+
+  for (uint32_t i = 0; i < SENSOR_BUS_HIST_BUCKETS; i++)
+    p = Sensor_Bus_Put(p, diag->hist[i], 4);
+
+  for (uint32_t i = 0; i < ntrace; i++)
+  {
+      const sensor_bus_trace_t *trace = Sensor_Bus_Trace(bus, i);
+
+      p = Sensor_Bus_Put(p, trace->start_us, 4);
+      p = Sensor_Bus_Put(p, (trace->duration_us > UINT16_MAX) ? UINT16_MAX : trace->duration_us, 2);
+      p = Sensor_Bus_Put(p, trace->addr, 1);
+      p = Sensor_Bus_Put(p, trace->reg, 1);
+      p = Sensor_Bus_Put(p, trace->len, 2);
+      p = Sensor_Bus_Put(p, (trace->status & 0x7F) | (trace->write ? 0x80 : 0), 1);
+  }
+
+  return p - buf;
+}
+
+
+/**************************************************************************//**
+ * Replay backend
+ *
+ * Plays a recorded trace back: every transaction must match the next record
+ * (address, direction, register, length and, for writes with data, the
+ * bytes). Reads return the recorded data and status. A mismatch is counted
+ * and reported as SENSOR_BUS_ERROR, the trace does not advance.
+ *****************************************************************************/
+static sensor_bus_status_t Sensor_Bus_Replay_Transfer (void *ctx, uint8_t addr, bool write, uint8_t reg, uint8_t *data, size_t len)
+{
+  sensor_bus_replay_t *replay = ctx;
+  const sensor_bus_record_t *record;
+
+  if (replay->next >= replay->len)
+  {
+      replay->mismatches++;
+      return SENSOR_BUS_ERROR;
+  }
+
+  record = &replay->trace[replay->next];
+
+  if ((record->addr != addr) || (record->write != write) || (record->reg != reg) || (record->len != len) ||
+      (write && record->data && memcmp(record->data, data, len)))
+  {
+      replay->mismatches++;
+      return SENSOR_BUS_ERROR;
+  }
+
+  if (!write && record->data)
+    memcpy(data, record->data, len);
+
+  replay->next++;
+
+  return record->status;
+}
+
+static const sensor_bus_ops_t sensor_bus_replay_ops =
+{
+  .transfer = Sensor_Bus_Replay_Transfer,
+  .start = Sensor_Bus_Replay_Transfer,
+  .abort = NULL,
+  .now_us = NULL,
+};
+
+
+/**************************************************************************//**
+ * This function sets a bus up to replay a trace
+ *
+ * @param:
+ *      bus:    The bus
+ *      replay: Replay state, must outlive the bus
+ *      trace:  The recorded transactions
+ *      len:    Number of records
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Sensor_Bus_Replay_Init (sensor_bus_t *bus, sensor_bus_replay_t *replay, const sensor_bus_record_t *trace, size_t len)
+{
+  memset(bus, 0, sizeof(*bus));
+  memset(replay, 0, sizeof(*replay));
+
+  replay->trace = trace;
+  replay->len = len;
+
+  bus->name = "replay";
+  bus->ops = &sensor_bus_replay_ops;
+  bus->ctx = replay;
+}
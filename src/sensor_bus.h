@@ -0,0 +1,151 @@
+/*
+ * sensor_bus.h
+ *
+ *  Register access to the sensors, independent of what is behind it: the
+ *  I2C peripheral on target, the sensor model or a recorded trace on a host.
+ *
+ */
+
+#ifndef SRC_SENSOR_BUS_H_
+#define SRC_SENSOR_BUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum
+{
+  SENSOR_BUS_OK = 0,
+  SENSOR_BUS_IN_PROGRESS,           // Started, completion comes through Sensor_Bus_Complete()
+  SENSOR_BUS_NACK,                  // Address or data not acknowledged
+  SENSOR_BUS_ERROR,                 // Bus error, arbitration lost, trace mismatch...
+} sensor_bus_status_t;
+
+// Completion of an interrupt driven transfer, may run in interrupt context
+typedef void (*sensor_bus_callback_t) (sensor_bus_status_t status);
+
+// Sees every finished transaction, after the statistics (e.g. to capture it,
+// sensor_capture.h). May run in interrupt context.
+typedef void (*sensor_bus_tap_t) (void *ctx, uint8_t addr, bool write, uint8_t reg, const uint8_t *data, size_t len,
+                                  sensor_bus_status_t status);
+
+// Backend operations. A register transfer writes the register address and
+// then either writes or (after a repeated start) reads len bytes.
+typedef struct
+{
+  sensor_bus_status_t (*transfer) (void *ctx, uint8_t addr, bool write, uint8_t reg, uint8_t *data, size_t len);
+  sensor_bus_status_t (*start) (void *ctx, uint8_t addr, bool write, uint8_t reg, uint8_t *data, size_t len);
+  void (*abort) (void *ctx);
+  uint64_t (*now_us) (void *ctx);   // Time base of the statistics, NULL if there is none
+} sensor_bus_ops_t;
+
+#define SENSOR_BUS_DEVICES        4     // Devices counted on their own, the others only in the bus totals
+#define SENSOR_BUS_HIST_BUCKETS   8     // Bucket n holds durations below SENSOR_BUS_HIST_BASE_US << n, the last one the rest
+#define SENSOR_BUS_HIST_BASE_US   125
+#define SENSOR_BUS_TRACE_LEN      16    // Last transactions kept
+#define SENSOR_BUS_PACK_TRACE     8     // Of which Sensor_Bus_Diag_Pack() takes the newest
+#define SENSOR_BUS_PACK_VERSION   1
+#define SENSOR_BUS_PACK_MAX       (24 + 13*SENSOR_BUS_DEVICES + 4*SENSOR_BUS_HIST_BUCKETS + 11*SENSOR_BUS_PACK_TRACE)
+
+typedef struct
+{
+  uint32_t transactions;
+  uint32_t bytes;                   // Payload bytes, without address and register
+  uint32_t nacks;
+  uint32_t errors;
+  uint64_t busy_us;                 // Time spent in transfers
+} sensor_bus_stats_t;
+
+typedef struct
+{
+  uint8_t addr;
+  sensor_bus_stats_t stats;
+} sensor_bus_dev_stats_t;
+
+typedef struct
+{
+  uint32_t start_us;                // Backend time, low 32 bits
+  uint32_t duration_us;
+  uint16_t len;
+  uint8_t addr;
+  uint8_t reg;
+  bool write;
+  sensor_bus_status_t status;
+} sensor_bus_trace_t;
+
+// Per device counters, duration histogram and the last transactions, kept
+// for every transaction like the statistics
+typedef struct
+{
+  sensor_bus_dev_stats_t devices[SENSOR_BUS_DEVICES];
+  uint8_t ndevices;
+  uint32_t hist[SENSOR_BUS_HIST_BUCKETS];
+  sensor_bus_trace_t trace[SENSOR_BUS_TRACE_LEN];
+  uint32_t traced;                  // Transactions traced, the newest is at (traced - 1) % SENSOR_BUS_TRACE_LEN
+} sensor_bus_diag_t;
+
+typedef struct
+{
+  const char *name;
+  const sensor_bus_ops_t *ops;
+  void *ctx;
+
+  sensor_bus_stats_t stats;
+  sensor_bus_diag_t diag;
+
+  sensor_bus_tap_t tap;
+  void *tap_ctx;
+
+  // Interrupt driven transfer in flight
+  volatile bool busy;
+  sensor_bus_callback_t callback;
+  uint64_t start_us;
+  uint8_t addr;
+  bool write;
+  uint8_t reg;
+  uint8_t *data;
+  size_t len;
+} sensor_bus_t;
+
+// A device on a bus
+typedef struct
+{
+  sensor_bus_t *bus;
+  uint8_t addr;                     // 7 bit address
+} sensor_dev_t;
+
+// Recorded transaction, replayed by the trace backend
+typedef struct
+{
+  uint8_t addr;
+  bool write;
+  uint8_t reg;
+  uint16_t len;                     // A FIFO burst of three LEDs is 288 bytes
+  const uint8_t *data;              // Data read, or expected data written (NULL: not checked)
+  sensor_bus_status_t status;
+} sensor_bus_record_t;
+
+typedef struct
+{
+  const sensor_bus_record_t *trace;
+  size_t len;
+  size_t next;
+  uint32_t mismatches;
+} sensor_bus_replay_t;
+
+sensor_bus_status_t Sensor_Bus_Read (const sensor_dev_t *dev, uint8_t reg, uint8_t *read_data, size_t nbytes_read_data);
+sensor_bus_status_t Sensor_Bus_Write (const sensor_dev_t *dev, uint8_t reg, const uint8_t *write_data, size_t nbytes_write_data);
+sensor_bus_status_t Sensor_Bus_Start_Read (const sensor_dev_t *dev, uint8_t reg, uint8_t *read_data, size_t nbytes_read_data,
+                                           sensor_bus_callback_t callback);
+sensor_bus_status_t Sensor_Bus_Start_Write (const sensor_dev_t *dev, uint8_t reg, uint8_t *write_data, size_t nbytes_write_data,
+                                            sensor_bus_callback_t callback);
+bool Sensor_Bus_Complete (sensor_bus_t *bus, sensor_bus_status_t status);
+void Sensor_Bus_Abort (sensor_bus_t *bus);
+void Sensor_Bus_Reset_Stats (sensor_bus_t *bus);
+void Sensor_Bus_Set_Tap (sensor_bus_t *bus, sensor_bus_tap_t tap, void *ctx);
+const sensor_bus_trace_t* Sensor_Bus_Trace (const sensor_bus_t *bus, uint32_t age);
+size_t Sensor_Bus_Diag_Pack (const sensor_bus_t *bus, uint8_t *buf, size_t size);
+
+void Sensor_Bus_Replay_Init (sensor_bus_t *bus, sensor_bus_replay_t *replay, const sensor_bus_record_t *trace, size_t len);
+
+#endif /* SRC_SENSOR_BUS_H_ */
@@ -0,0 +1,309 @@
+/*
+ * sensor_capture.c
+ *
+ *  Capture of the sensor bus traffic (format in sensor_capture.h): a bus tap
+ *  and the application events fill a ring, the main loop streams it out.
+ *  On the host a capture is decoded into a trace for the replay backend of
+ *  sensor_bus.c and the list of events to hand to the application.
+ *
+ *  Nothing here depends on the SDK, the file builds on a host as is.
+ *
+ */
+
+#include <string.h>
+
+#include "sensor_capture.h"
+
+
+/**************************************************************************//**
+ * This function returns the free space of the ring, one byte is kept free
+ * to tell a full ring from an empty one
+ *
+ * @param:
+ *      capture: The capture
+ *
+ * @return:
+ *      Free bytes
+ *****************************************************************************/
+static size_t Sensor_Capture_Free (const sensor_capture_t *capture)
+{
+  return (capture->tail + capture->size - capture->head - 1) % capture->size;
+}
+
+
+/**************************************************************************//**
+ * This function copies bytes into the ring at a position
+ *
+ * @param:
+ *      capture: The capture
+ *      pos:     Position in the ring
+ *      data:    The bytes
+ *      len:     Number of bytes
+ *
+ * @return:
+ *      Position after the bytes
+ *****************************************************************************/
+static size_t Sensor_Capture_Put (sensor_capture_t *capture, size_t pos, const uint8_t *data, size_t len)
+{
+  while (len--)
+  {
+      capture->ring[pos] = *data++;
+      pos = (pos + 1) % capture->size;
+  }
+
+  return pos;
+}
+
+
+/**************************************************************************//**
+ * This function adds a record to the ring, or counts it as lost when it
+ * doesn't fit. Lost records are reported by a SENSOR_CAPTURE_LOST record
+ * ahead of the next one that fits.
+ *
+ * @param:
+ *      capture: The capture
+ *      type:    Record type
+ *      addr:    Device address
+ *      reg:     Register
+ *      status:  Transfer status
+ *      data:    Record data
+ *      len:     Number of bytes of data
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+static void Sensor_Capture_Record (sensor_capture_t *capture, sensor_capture_type_t type, uint8_t addr, uint8_t reg,
+                                   sensor_bus_status_t status, const uint8_t *data, size_t len)
+{
+  uint8_t header[SENSOR_CAPTURE_RECORD_HEADER];
+  uint32_t t_us = capture->now_us ? capture->now_us() : 0;
+  size_t needed = sizeof(header) + len;
+  size_t pos = capture->head;
+
+  if (capture->lost)
+    needed += sizeof(header) + sizeof(capture->lost);
+
+  if ((len > UINT16_MAX) || (needed > Sensor_Capture_Free(capture)))
+  {
+      capture->lost++;
+      capture->lost_total++;
+      return;
+  }
+
+  if (capture->lost)
+  {
+      uint8_t lost[4] = { capture->lost, capture->lost >> 8, capture->lost >> 16, capture->lost >> 24 };
+      uint8_t lost_header[SENSOR_CAPTURE_RECORD_HEADER] = { SENSOR_CAPTURE_LOST, 0, 0, SENSOR_BUS_OK,
+                                                            t_us, t_us >> 8, t_us >> 16, t_us >> 24,
+                                                            sizeof(lost), 0 };
+
+      pos = Sensor_Capture_Put(capture, pos, lost_header, sizeof(lost_header));
+      pos = Sensor_Capture_Put(capture, pos, lost, sizeof(lost));
+      capture->lost = 0;
+  }
+
+  header[0] = type;
+  header[1] = addr;
+  header[2] = reg;
+  header[3] = status;
+  header[4] = t_us;
+  header[5] = t_us >> 8;
+  header[6] = t_us >> 16;
+  header[7] = t_us >> 24;
+  header[8] = len;
+  header[9] = len >> 8;
+
+  pos = Sensor_Capture_Put(capture, pos, header, sizeof(header));
+  pos = Sensor_Capture_Put(capture, pos, data, len);
+
+  // Published once the whole record is in
+  capture->head = pos;
+}
+
+
+/**************************************************************************//**
+ * This function sets a capture up, the file header is the first thing
+ * flushed
+ *
+ * @param:
+ *      capture: The capture
+ *      ring:    Ring buffer for the records not yet flushed
+ *      size:    Size of the ring, at least the largest record plus the
+ *               file header
+ *      now_us:  Time stamps of the records, NULL for none
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Sensor_Capture_Init (sensor_capture_t *capture, uint8_t *ring, size_t size, uint32_t (*now_us) (void))
+{
+  static const uint8_t file_header[SENSOR_CAPTURE_FILE_HEADER] = { 'S', 'C', 'A', 'P', SENSOR_CAPTURE_VERSION, 0, 0, 0 };
+
+  memset(capture, 0, sizeof(*capture));
+
+  capture->ring = ring;
+  capture->size = size;
+  capture->now_us = now_us;
+
+  capture->head = Sensor_Capture_Put(capture, 0, file_header, sizeof(file_header));
+}
+
+
+/**************************************************************************//**
+ * Bus tap (sensor_bus_tap_t) recording every finished transaction, ctx is
+ * the capture
+ *****************************************************************************/
+void Sensor_Capture_Tap (void *ctx, uint8_t addr, bool write, uint8_t reg, const uint8_t *data, size_t len,
+                         sensor_bus_status_t status)
+{
+  Sensor_Capture_Record(ctx, write ? SENSOR_CAPTURE_WRITE : SENSOR_CAPTURE_READ, addr, reg, status, data, len);
+}
+
+
+/**************************************************************************//**
+ * This function records an event handed to the application
+ *
+ * @param:
+ *      capture: The capture
+ *      signal:  The external signal
+ *
+ * @return:
+ *      no return
+ *****************************************************************************/
+void Sensor_Capture_Signal (sensor_capture_t *capture, uint32_t signal)
+{
+  uint8_t data[4] = { signal, signal >> 8, signal >> 16, signal >> 24 };
+
+  Sensor_Capture_Record(capture, SENSOR_CAPTURE_SIGNAL, 0, 0, SENSOR_BUS_OK, data, sizeof(data));
+}
+
+
+/**************************************************************************//**
+ * This function hands the records in the ring to the output, at most two
+ * calls (the ring wraps)
+ *
+ * @param:
+ *      capture: The capture
+ *      out:     The output
+ *      ctx:     Passed to the output
+ *
+ * @return:
+ *      Number of bytes flushed
+ *****************************************************************************/
+size_t Sensor_Capture_Flush (sensor_capture_t *capture, sensor_capture_out_t out, void *ctx)
+{
+  size_t head = capture->head;
+  size_t tail = capture->tail;
+  size_t flushed = 0;
+
+  if (head < tail)
+  {
+      out(ctx, &capture->ring[tail], capture->size - tail);
+      flushed += capture->size - tail;
+      tail = 0;
+  }
+
+  if (head > tail)
+  {
+      out(ctx, &capture->ring[tail], head - tail);
+      flushed += head - tail;
+      tail = head;
+  }
+
+  capture->tail = tail;
+
+  return flushed;
+}
+
+
+/**************************************************************************//**
+ * This function reads a little endian 32 bit value
+ *****************************************************************************/
+static uint32_t Sensor_Capture_U32 (const uint8_t *data)
+{
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+
+/**************************************************************************//**
+ * This function decodes a capture. A record cut short at the end (the
+ * stream was stopped) is ignored, decoding stops at the first lost records.
+ *
+ * @param:
+ *      data:  The capture
+ *      len:   Size of the capture
+ *      trace: Arrays to fill (records, signals and their sizes), the counts
+ *             are set
+ *
+ * @return:
+ *      false if this is not a capture, the records are of an unknown type
+ *      or don't fit in the arrays
+ *****************************************************************************/
+bool Sensor_Capture_Decode (const uint8_t *data, size_t len, sensor_capture_trace_t *trace)
+{
+  size_t pos = SENSOR_CAPTURE_FILE_HEADER;
+  bool first = true;
+  uint32_t first_us = 0;
+
+  trace->nrecords = 0;
+  trace->nsignals = 0;
+  trace->lost = 0;
+  trace->duration_us = 0;
+
+  if ((len < SENSOR_CAPTURE_FILE_HEADER) || memcmp(data, SENSOR_CAPTURE_MAGIC, 4) ||
+      (data[4] != SENSOR_CAPTURE_VERSION))
+    return false;
+
+  while (len - pos >= SENSOR_CAPTURE_RECORD_HEADER)
+  {
+      const uint8_t *header = &data[pos];
+      uint32_t t_us = Sensor_Capture_U32(&header[4]);
+      size_t nbytes = header[8] | (header[9] << 8);
+      const uint8_t *payload = &header[SENSOR_CAPTURE_RECORD_HEADER];
+
+      if (len - pos - SENSOR_CAPTURE_RECORD_HEADER < nbytes)
+        break;
+
+      pos += SENSOR_CAPTURE_RECORD_HEADER + nbytes;
+
+      if (first)
+        first_us = t_us;
+      first = false;
+      trace->duration_us = t_us - first_us;
+
+      switch (header[0])
+      {
+        case SENSOR_CAPTURE_READ:
+        case SENSOR_CAPTURE_WRITE:
+          if (trace->nrecords == trace->max_records)
+            return false;
+
+          trace->records[trace->nrecords].addr = header[1];
+          trace->records[trace->nrecords].write = (header[0] == SENSOR_CAPTURE_WRITE);
+          trace->records[trace->nrecords].reg = header[2];
+          trace->records[trace->nrecords].len = nbytes;
+          trace->records[trace->nrecords].data = payload;
+          trace->records[trace->nrecords].status = header[3];
+          trace->nrecords++;
+        break;
+
+        case SENSOR_CAPTURE_SIGNAL:
+          if ((trace->nsignals == trace->max_signals) || (nbytes != 4))
+            return false;
+
+          trace->signals[trace->nsignals].signal = Sensor_Capture_U32(payload);
+          trace->signals[trace->nsignals].t_us = t_us;
+          trace->nsignals++;
+        break;
+
+        case SENSOR_CAPTURE_LOST:
+          trace->lost = (nbytes == 4) ? Sensor_Capture_U32(payload) : 1;
+          return true;
+
+        default:
+          return false;
+      }
+  }
+
+  return true;
+}
@@ -0,0 +1,104 @@
+/*
+ * sensor_capture.h
+ *
+ *  Capture of the sensor bus traffic and of the application events that
+ *  drove it, in a compact binary format, so that a session recorded on a
+ *  device can be replayed on a host through the same drain and DSP code.
+ *
+ *  Format, little endian. A file header:
+ *
+ *    magic "SCAP", version (1 byte), 3 bytes reserved
+ *
+ *  followed by records of a 10 byte header and len bytes of data:
+ *
+ *    type (1), addr (1), reg (1), status (1), t_us (4), len (2), data (len)
+ *
+ *    SENSOR_CAPTURE_READ    Register read, data is what the sensor returned
+ *                           (FIFO bursts, interrupt status and pointers,
+ *                           temperature)
+ *    SENSOR_CAPTURE_WRITE   Register write, data is what was written (the
+ *                           sensor configuration)
+ *    SENSOR_CAPTURE_SIGNAL  Event handed to the application, data is the
+ *                           4 byte signal. Completions of interrupt driven
+ *                           transfers are not recorded, the replay makes
+ *                           its own.
+ *    SENSOR_CAPTURE_LOST    Records dropped because the ring was full, data
+ *                           is the 4 byte count. The capture can't be
+ *                           replayed past it.
+ *
+ *  t_us is the time of the device, it wraps every 71 minutes.
+ *
+ */
+
+#ifndef SRC_SENSOR_CAPTURE_H_
+#define SRC_SENSOR_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sensor_bus.h"
+
+#define SENSOR_CAPTURE_MAGIC          "SCAP"
+#define SENSOR_CAPTURE_VERSION        (1)
+#define SENSOR_CAPTURE_FILE_HEADER    (8)
+#define SENSOR_CAPTURE_RECORD_HEADER  (10)
+
+typedef enum
+{
+  SENSOR_CAPTURE_READ = 1,
+  SENSOR_CAPTURE_WRITE,
+  SENSOR_CAPTURE_SIGNAL,
+  SENSOR_CAPTURE_LOST,
+} sensor_capture_type_t;
+
+// Writer: records are put in a ring by the bus tap (possibly in interrupt
+// context) and taken out by Sensor_Capture_Flush() in the main loop. The
+// caller keeps the tap and the signals from running concurrently (critical
+// section on target).
+typedef struct
+{
+  uint8_t *ring;
+  size_t size;
+  volatile size_t head;             // Written by the producer only
+  volatile size_t tail;             // Written by Sensor_Capture_Flush() only
+  uint32_t (*now_us) (void);
+  uint32_t lost;                    // Not yet reported with a SENSOR_CAPTURE_LOST record
+  uint32_t lost_total;
+} sensor_capture_t;
+
+// Output of Sensor_Capture_Flush()
+typedef void (*sensor_capture_out_t) (void *ctx, const uint8_t *data, size_t len);
+
+// Application event of a decoded capture
+typedef struct
+{
+  uint32_t signal;
+  uint32_t t_us;
+} sensor_capture_signal_t;
+
+// Decoded capture, the transactions point into the capture data and are
+// replayed by Sensor_Bus_Replay_Init()
+typedef struct
+{
+  sensor_bus_record_t *records;
+  size_t nrecords;
+  size_t max_records;
+
+  sensor_capture_signal_t *signals;
+  size_t nsignals;
+  size_t max_signals;
+
+  uint32_t lost;                    // Count of the first SENSOR_CAPTURE_LOST record, decoding stops there
+  uint32_t duration_us;             // Time from the first record to the last
+} sensor_capture_trace_t;
+
+void Sensor_Capture_Init (sensor_capture_t *capture, uint8_t *ring, size_t size, uint32_t (*now_us) (void));
+void Sensor_Capture_Tap (void *ctx, uint8_t addr, bool write, uint8_t reg, const uint8_t *data, size_t len,
+                         sensor_bus_status_t status);
+void Sensor_Capture_Signal (sensor_capture_t *capture, uint32_t signal);
+size_t Sensor_Capture_Flush (sensor_capture_t *capture, sensor_capture_out_t out, void *ctx);
+
+bool Sensor_Capture_Decode (const uint8_t *data, size_t len, sensor_capture_trace_t *trace);
+
+#endif /* SRC_SENSOR_CAPTURE_H_ */
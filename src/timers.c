@@ -131,6 +131,38 @@ void timerWaitUs_blocking(uint32_t us_wait)
 
 
 
+/**************************************************************************//**
+ * This function enables the LETIMER underflow interrupt, which starts a
+ * measurement every LETIMER_PERIOD_MS
+ *
+ * @param:
+ *      no params
+ * @return:
+ *      no return
+ *****************************************************************************/
+void timerUFIntEnable()
+{
+  LETIMER_IntEnable(LETIMER0, LETIMER_IEN_UF);
+}
+
+
+
+/**************************************************************************//**
+ * This function disables the LETIMER underflow interrupt, no measurement is
+ * started until it is enabled again
+ *
+ * @param:
+ *      no params
+ * @return:
+ *      no return
+ *****************************************************************************/
+void timerUFIntDisable()
+{
+  LETIMER_IntDisable(LETIMER0, LETIMER_IEN_UF);
+}
+
+
+
 /**************************************************************************//**
  * This function takes in time (in micro-seconds) and creates a interrupt
  * based delay
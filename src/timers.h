@@ -25,6 +25,8 @@ void timer_Init();
 int32_t settingPrescalerValue(const int time_ms);
 void timerWaitUs_blocking(uint32_t us_wait);
 void timerWaitUs_IRQ(uint32_t us_wait);
+void timerUFIntEnable();
+void timerUFIntDisable();
 
 
 #endif /*SRC_TIMERS_H_*/